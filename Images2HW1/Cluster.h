@@ -1,59 +1,25 @@
 #ifndef CLUSTER_H
 #define CLUSTER_H
 
-#include <vector>
-#include <array>
-#include <utility>
+#include "span.h"
 
-#include <boost/serialization/vector.hpp>
-#include <boost/serialization/utility.hpp>
-#include <boost/serialization/array.hpp>
+#include <array>
 
+//Кластер - вид на кусок общего хранилища ClusterSpace: центр, дескрипторы членов
+//подряд по Dim чисел и их исходные номера. Ничего не копирует.
 template<class T, size_t Dim>
 class Cluster
 {
 public:
   typedef std::array<T, Dim> Descriptor;
-  typedef std::pair<int, Descriptor> LabeledDescriptor;
-  typedef std::vector<LabeledDescriptor> DataStorage;
-
-  Cluster() : m_label(0)
-  {
-
-  }
-
-  Cluster(const Cluster& cluster) : m_label(cluster.label()),
-                                    m_center(cluster.center()),
-                                    m_data(cluster.data())
-  {
-  }
-
-  Cluster(int label, const std::vector<T>& center) : m_label(label), m_center(center)
-  {
-  }
-
-  Cluster(int label, DataStorage&& data)
-    : m_label(label), m_data(std::move(data))
-  {
-  }
 
-  Cluster(Cluster&& cluster) : m_label(cluster.label()), m_data(std::move(cluster.data()))
+  Cluster() : m_label(0), m_center(nullptr), m_descriptors(nullptr), m_indexes(nullptr), m_size(0)
   {
   }
 
-  void add_data(int index, const Descriptor& data)
+  Cluster(int label, const T* center, const T* descriptors, const int* indexes, size_t size)
+    : m_label(label), m_center(center), m_descriptors(descriptors), m_indexes(indexes), m_size(size)
   {
-    m_data.push_back(std::make_pair(index, data));
-  }
-
-  void add_data(int index, Descriptor&& data)
-  {
-    m_data.push_back(std::make_pair(index, std::move(data)));
-  }
-
-  DataStorage data() const
-  {
-    return m_data;
   }
 
   int label() const
@@ -61,60 +27,49 @@ public:
     return m_label;
   }
 
-  typename DataStorage::const_iterator begin() const
+  size_t size() const
   {
-    return m_data.begin();
+    return m_size;
   }
 
-  typename DataStorage::const_iterator end() const
+  Span<const T> center() const
   {
-    return m_data.end();
+    return Span<const T>(m_center, Dim);
   }
 
-  size_t size() const
+  //i-й член кластера, Dim чисел
+  Span<const T> descriptor(size_t i) const
   {
-    return m_data.size();
+    return Span<const T>(m_descriptors + i * Dim, Dim);
   }
 
-  const std::vector<T>& center() const
+  //Все члены подряд, size() * Dim чисел
+  Span<const T> descriptors() const
   {
-      return m_center;
+    return Span<const T>(m_descriptors, m_size * Dim);
   }
 
-  std::vector<size_t> indexes() const
+  Span<const int> indexes() const
   {
-    std::vector<size_t> result;
-    std::transform(m_data.begin(), m_data.end(), std::back_inserter(result), [&] (const LabeledDescriptor& desc) {
-      return desc.first;
-    });
+    return Span<const int>(m_indexes, m_size);
+  }
 
-    return result;
+  const int* begin() const
+  {
+    return m_indexes;
   }
 
-  template <class Archive>
-  void serialize(Archive& archive, const int)
+  const int* end() const
   {
-    archive & m_label;
-    archive & m_center;
-    archive & m_data;
+    return m_indexes + m_size;
   }
 
 private:
   int m_label;
-  std::vector<T> m_center;
-  DataStorage m_data;
+  const T* m_center;
+  const T* m_descriptors;
+  const int* m_indexes;
+  size_t m_size;
 };
 
-namespace boost
-{
-namespace serialization
-{
-  template <class Archive, class T, size_t l>
-  void serialize(Archive& ar, std::array<T, l>& array, const unsigned int)
-  {
-    ar & boost::serialization::make_array(array.data(), array.size());
-  }
-}
-}
-
 #endif // CLUSTER_H
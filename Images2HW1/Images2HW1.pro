@@ -4,9 +4,21 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.cpp \
-    knnfinder.cpp
+    knnfinder.cpp \
+    exactknn.cpp \
+    hnswindex.cpp \
+    ivfpqindex.cpp \
+    lshindex.cpp \
+    dataset.cpp \
+    descriptorstream.cpp \
+    minibatchkmeans.cpp \
+    invertedfile.cpp \
+    mappedfile.cpp \
+    descriptorsink.cpp \
+    siftpipeline.cpp \
+    patchextractor.cpp
 
-LIBS += -L/usr/local/lib -lopencv_core -lopencv_highgui -lopencv_flann -lopencv_nonfree -lopencv_features2d -lopencv_imgproc -lQtCore
+LIBS += -L/usr/local/lib -lopencv_core -lopencv_highgui -lopencv_flann -lopencv_nonfree -lopencv_features2d -lopencv_imgproc -lQtCore -lpthread
 
 INCLUDEPATH += /usr/include/qt4 /usr/include/qt4/QtCore
 
@@ -15,5 +27,26 @@ QMAKE_CXXFLAGS += -std=c++11
 HEADERS += \
     knnfinder.h \
     clusterspace.h \
-    Cluster.h
+    Cluster.h \
+    exactknn.h \
+    parallel.h \
+    distance.h \
+    knnindex.h \
+    hnswindex.h \
+    ivfpqindex.h \
+    lshindex.h \
+    dataset.h \
+    neighbours.h \
+    span.h \
+    descriptorstream.h \
+    minibatchkmeans.h \
+    hamerlykmeans.h \
+    vocabularytree.h \
+    invertedfile.h \
+    checksum.h \
+    mappedfile.h \
+    descriptorsink.h \
+    boundedqueue.h \
+    siftpipeline.h \
+    patchextractor.h
 
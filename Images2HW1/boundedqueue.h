@@ -0,0 +1,106 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//Очередь между стадиями конвейера. push ждёт, пока в очереди есть место или очередь
+//не закрыта, pop - пока есть элемент или очередь не закрыта. Суммарное время ожидания с обеих сторон
+//копится: долгий push значит, что следующая стадия не успевает (backpressure),
+//долгий pop - что не успевает предыдущая.
+template <class T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(size_t capacity)
+    : m_capacity(capacity), m_closed(false), m_pushed(0), m_pushWait(0), m_popWait(0)
+  {
+  }
+
+  //false, если очередь закрыта: элемент тогда выбрасывается, и писателю пора остановиться.
+  //Иначе после закрытия очередь росла бы сверх capacity, а элементы никто бы не забрал
+  bool push(T value)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_items.size() >= m_capacity && !m_closed)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      m_notFull.wait(lock, [this]() { return m_items.size() < m_capacity || m_closed; });
+      m_pushWait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (m_closed)
+      return false;
+
+    m_items.push_back(std::move(value));
+    ++m_pushed;
+    m_notEmpty.notify_one();
+    return true;
+  }
+
+  //false, если очередь закрыта и пуста
+  bool pop(T& value)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_items.empty() && !m_closed)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      m_notEmpty.wait(lock, [this]() { return !m_items.empty() || m_closed; });
+      m_popWait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (m_items.empty())
+      return false;
+
+    value = std::move(m_items.front());
+    m_items.pop_front();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  //Больше элементов не будет
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_notEmpty.notify_all();
+    m_notFull.notify_all();
+  }
+
+  size_t pushed() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pushed;
+  }
+
+  //Секунды, которые все писатели простояли на полной очереди
+  double push_wait() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pushWait;
+  }
+
+  //Секунды, которые все читатели простояли на пустой очереди
+  double pop_wait() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_popWait;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::condition_variable m_notFull;
+  std::condition_variable m_notEmpty;
+  std::deque<T> m_items;
+
+  size_t m_capacity;
+  bool m_closed;
+
+  size_t m_pushed;
+  double m_pushWait;
+  double m_popWait;
+};
+
+#endif // BOUNDEDQUEUE_H
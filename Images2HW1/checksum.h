@@ -0,0 +1,19 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+//64-битный FNV-1a. hash - значение с предыдущего куска, чтобы считать по частям
+inline uint64_t fnv1a(const void* bytes, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+  const unsigned char* ptr = static_cast<const unsigned char*>(bytes);
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= ptr[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+#endif // CHECKSUM_H
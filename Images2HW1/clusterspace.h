@@ -2,108 +2,529 @@
 #define CLUSTERSPACE_H
 
 #include "Cluster.h"
+#include "minibatchkmeans.h"
+#include "hamerlykmeans.h"
+#include "exactknn.h"
+#include "checksum.h"
+#include "mappedfile.h"
+#include "span.h"
+#include "vocabularytree.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <cassert>
+#include <iostream>
 #include <ostream>
 #include <istream>
 
 #include <opencv2/opencv.hpp>
-#include <boost/serialization/serialization.hpp>
 
+//Строка row матрицы m любого из типов CV_32F/CV_64F, приведённая к T
+template <class T>
+void copy_row(const cv::Mat& m, int row, T* out)
+{
+  if (m.depth() == CV_32F)
+    std::copy(m.ptr<float>(row), m.ptr<float>(row) + m.cols, out);
+  else
+    std::copy(m.ptr<double>(row), m.ptr<double>(row) + m.cols, out);
+}
+
+enum KMeansMethod
+{
+  OPENCV_KMEANS,
+  HAMERLY_KMEANS
+};
+
+//Заголовок файла ClusterSpace. За ним с выравниванием CLUSTER_SPACE_ALIGNMENT идут
+//центры (clusters x dim), смещения членов (clusters + 1, uint64), исходные номера
+//членов (descriptors, int32) и дескрипторы членов (descriptors x dim)
+struct ClusterSpaceHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t element_size;
+  uint32_t dim;
+  uint64_t clusters;
+  uint64_t descriptors;
+  uint64_t centers_offset;
+  uint64_t offsets_offset;
+  uint64_t indexes_offset;
+  uint64_t descriptors_offset;
+  uint64_t file_size;
+  //FNV-1a всех четырёх массивов подряд
+  uint64_t data_checksum;
+  //FNV-1a всех полей выше
+  uint64_t header_checksum;
+};
+
+const uint32_t CLUSTER_SPACE_MAGIC = 0x50534c43; // "CLSP"
+const uint32_t CLUSTER_SPACE_VERSION = 1;
+const uint64_t CLUSTER_SPACE_ALIGNMENT = 64;
+
+//Дескрипторы всех кластеров лежат в одной матрице, переставленной по кластерам:
+//члены кластера i занимают строки [m_offsets[i], m_offsets[i + 1]),
+//m_indexes в тех же позициях хранит исходные номера дескрипторов.
 template <class T, size_t Dim>
 class ClusterSpace
 {
 public:
   typedef typename Cluster<T, Dim>::Descriptor Descriptor;
-  typedef typename Cluster<T, Dim>::LabeledDescriptor LabeledDescriptor;
-  typedef typename Cluster<T, Dim>::DataStorage DataStorage;
 
-  ClusterSpace() : m_k(0), m_currentIndex(0)
+  class const_iterator : public std::iterator<std::input_iterator_tag, Cluster<T, Dim>, ptrdiff_t,
+                                              const Cluster<T, Dim>*, Cluster<T, Dim>>
+  {
+  public:
+    const_iterator(const ClusterSpace* space, size_t index) : m_space(space), m_index(index)
+    {
+    }
+
+    Cluster<T, Dim> operator*() const
+    {
+      return (*m_space)[m_index];
+    }
+
+    const_iterator& operator++()
+    {
+      ++m_index;
+      return *this;
+    }
+
+    bool operator==(const const_iterator& other) const
+    {
+      return m_index == other.m_index;
+    }
+
+    bool operator!=(const const_iterator& other) const
+    {
+      return m_index != other.m_index;
+    }
+
+  private:
+    const ClusterSpace* m_space;
+    size_t m_index;
+  };
+
+  ClusterSpace(int k = 0)
+    : m_mappedCenters(nullptr), m_mappedOffsets(nullptr), m_mappedIndexes(nullptr), m_mappedDescriptors(nullptr),
+      m_mappedDescriptorCount(0), m_mappedChecksum(0), m_k(k), m_currentIndex(0)
+  {
+  }
+
+  //Записать в файл, который потом можно открыть map
+  bool save(const std::string& path) const
+  {
+    const size_t clusters = size();
+    const size_t count = descriptor_count();
+
+    ClusterSpaceHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = CLUSTER_SPACE_MAGIC;
+    header.version = CLUSTER_SPACE_VERSION;
+    header.element_size = sizeof(T);
+    header.dim = Dim;
+    header.clusters = clusters;
+    header.descriptors = count;
+    header.centers_offset = align(sizeof(header));
+    header.offsets_offset = align(header.centers_offset + clusters * Dim * sizeof(T));
+    header.indexes_offset = align(header.offsets_offset + (clusters + 1) * sizeof(uint64_t));
+    header.descriptors_offset = align(header.indexes_offset + count * sizeof(int32_t));
+    header.file_size = header.descriptors_offset + count * Dim * sizeof(T);
+
+    const Section sections[] = {
+      Section(header.centers_offset, centers_data(), clusters * Dim * sizeof(T)),
+      Section(header.offsets_offset, offsets_data(), clusters > 0 ? (clusters + 1) * sizeof(uint64_t) : 0),
+      Section(header.indexes_offset, indexes_data(), count * sizeof(int32_t)),
+      Section(header.descriptors_offset, descriptors_data(), count * Dim * sizeof(T))
+    };
+
+    header.data_checksum = fnv1a(nullptr, 0);
+    for (const Section& section : sections)
+      header.data_checksum = fnv1a(section.data, section.size, header.data_checksum);
+    header.header_checksum = fnv1a(&header, offsetof(ClusterSpaceHeader, header_checksum));
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const Section& section : sections)
+    {
+      const std::vector<char> padding(section.offset - file.tellp(), 0);
+      file.write(padding.data(), padding.size());
+      file.write(static_cast<const char*>(section.data), section.size);
+    }
+
+    return static_cast<bool>(file);
+  }
+
+  //Открыть файл save без чтения: массивы используются прямо из отображённых страниц,
+  //поэтому открытие не зависит от размера словаря. Проверяются заголовок и его
+  //контрольная сумма, сумма данных - только при verify_data (это проход по всему файлу).
+  //Если файл не подошёл, ClusterSpace остаётся прежним
+  bool map(const std::string& path, bool verify_data = false)
   {
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(path);
+    if (!mapping->is_open() || mapping->size() < sizeof(ClusterSpaceHeader))
+      return false;
+
+    ClusterSpaceHeader header;
+    std::memcpy(&header, mapping->data(), sizeof(header));
+
+    if (header.magic != CLUSTER_SPACE_MAGIC || header.version != CLUSTER_SPACE_VERSION
+        || header.element_size != sizeof(T) || header.dim != Dim || header.file_size != mapping->size()
+        || header.header_checksum != fnv1a(&header, offsetof(ClusterSpaceHeader, header_checksum)))
+      return false;
+
+    //Разделы идут по порядку и каждый помещается до начала следующего. Размеры
+    //сравниваются делением, чтобы испорченные clusters или descriptors не переполнили умножение
+    const uint64_t file_size = header.file_size;
+    if (header.clusters > file_size / (Dim * sizeof(T)) || header.descriptors > file_size / (Dim * sizeof(T)))
+      return false;
+
+    const uint64_t clusters = header.clusters;
+    const uint64_t count = header.descriptors;
+    const Section sections[] = {
+      Section(header.centers_offset, nullptr, clusters * Dim * sizeof(T)),
+      Section(header.offsets_offset, nullptr, clusters > 0 ? (clusters + 1) * sizeof(uint64_t) : 0),
+      Section(header.indexes_offset, nullptr, count * sizeof(int32_t)),
+      Section(header.descriptors_offset, nullptr, count * Dim * sizeof(T))
+    };
+
+    uint64_t end = sizeof(ClusterSpaceHeader);
+    for (const Section& section : sections)
+    {
+      if (section.offset % CLUSTER_SPACE_ALIGNMENT != 0 || section.offset < end
+          || section.offset > file_size || section.size > file_size - section.offset)
+        return false;
+      end = section.offset + section.size;
+    }
+
+    if (end != file_size || clusters > static_cast<uint64_t>(std::numeric_limits<int>::max()))
+      return false;
+
+    //Всё проверяется по локальным указателям: пока файл не принят целиком, объект не меняется
+    const char* data = mapping->data();
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(data + header.offsets_offset);
+
+    //Границы кластеров должны возрастать от 0 до числа дескрипторов, иначе cluster()
+    //и pictures() выйдут за отображение. Это O(k), а не проход по всем данным
+    if (clusters > 0)
+    {
+      if (offsets[0] != 0 || offsets[clusters] != count)
+        return false;
+      for (uint64_t i = 0; i < clusters; ++i)
+        if (offsets[i] > offsets[i + 1])
+          return false;
+    }
+
+    if (verify_data)
+    {
+      uint64_t checksum = fnv1a(nullptr, 0);
+      for (const Section& section : sections)
+        checksum = fnv1a(data + section.offset, section.size, checksum);
+      if (checksum != header.data_checksum)
+        return false;
+    }
+
+    m_mapping = mapping;
+    m_k = clusters;
+    m_mappedDescriptorCount = count;
+    m_mappedCenters = reinterpret_cast<const T*>(data + header.centers_offset);
+    m_mappedOffsets = offsets;
+    m_mappedIndexes = reinterpret_cast<const int32_t*>(data + header.indexes_offset);
+    m_mappedDescriptors = reinterpret_cast<const T*>(data + header.descriptors_offset);
+    m_mappedChecksum = header.data_checksum;
+
+    m_centers.clear();
+    m_descriptors.clear();
+    m_offsets.clear();
+    m_indexes.clear();
+    m_tree = VocabularyTree<Dim>();
+
+    return true;
+  }
+
+  //Сверить данные отображённого файла с контрольной суммой из заголовка
+  bool verify() const
+  {
+    if (!m_mapping)
+      return true;
+
+    const size_t count = m_mappedDescriptorCount;
+
+    uint64_t checksum = fnv1a(nullptr, 0);
+    checksum = fnv1a(m_mappedCenters, m_k * Dim * sizeof(T), checksum);
+    checksum = fnv1a(m_mappedOffsets, m_k > 0 ? (m_k + 1) * sizeof(uint64_t) : 0, checksum);
+    checksum = fnv1a(m_mappedIndexes, count * sizeof(int32_t), checksum);
+    checksum = fnv1a(m_mappedDescriptors, count * Dim * sizeof(T), checksum);
+
+    return checksum == m_mappedChecksum;
   }
 
-  ClusterSpace(int k) : m_k(k), m_currentIndex(0)
+  bool is_mapped() const
   {
+    return static_cast<bool>(m_mapping);
   }
 
-  void build(const cv::Mat& data)
+  //method = HAMERLY_KMEANS - точный k-means с отсечениями по неравенству треугольника,
+  //iterations - предел числа итераций для него
+  void build(const cv::Mat& data, KMeansMethod method = OPENCV_KMEANS, int iterations = 100)
   {
+    m_mapping.reset();
+    m_tree = VocabularyTree<Dim>();
+
     std::vector<int> best_labels;
     cv::Mat centers(m_k, data.cols, CV_64F);
 
     std::cerr << "Starting KMeans..." << std::endl;
-    cv::kmeans(data, m_k, best_labels, cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 10, 1.0 ),
-               1 ,cv::KMEANS_PP_CENTERS, centers);
+    if (method == HAMERLY_KMEANS)
+    {
+      cv::Mat double_data;
+      data.convertTo(double_data, CV_64F);
+
+      HamerlyKMeans<Dim> kmeans(m_k, iterations);
+      best_labels = kmeans.fit(double_data);
+      centers = kmeans.centers();
+      std::cerr << "Iterations: " << kmeans.iterations() << std::endl;
+    }
+    else
+      cv::kmeans(data, m_k, best_labels, cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 10, 1.0 ),
+                 1 ,cv::KMEANS_PP_CENTERS, centers);
 
     assert(best_labels.size() == data.rows);
     assert(centers.rows == m_k);
     assert(centers.cols == data.cols);
+    assert(data.cols == Dim);
 
     std::cerr << "KMeans finished!" << std::endl;
     std::cerr << "Filling internal structures!" << std::endl;
 
+    m_centers.resize(m_k * Dim);
     for (int i = 0; i < m_k; ++i)
-    {
-      T* row_pointer = centers.ptr<T>(i);
-      m_clusters.emplace_back(i, std::vector<T>(row_pointer, row_pointer + centers.cols));
-    }
+      copy_row(centers, i, &m_centers[i * Dim]);
+
+    fill(data, best_labels);
+  }
 
-    for (size_t i = 0; i < best_labels.size(); ++i)
+  //Только словарь: центры учатся mini-batch k-means по потоку, дескрипторы не сохраняются
+  void build_vocabulary(DescriptorStream& stream, const MiniBatchParams& params)
+  {
+    assert(stream.cols() == Dim);
+
+    m_mapping.reset();
+    m_tree = VocabularyTree<Dim>();
+    m_k = params.k;
+    MiniBatchKMeans kmeans(params);
+    const cv::Mat& centers = kmeans.fit(stream);
+
+    m_centers.resize(m_k * Dim);
+    for (int i = 0; i < m_k; ++i)
+      copy_row(centers, i, &m_centers[i * Dim]);
+
+    m_offsets.assign(m_k + 1, 0);
+    m_descriptors.clear();
+    m_indexes.clear();
+  }
+
+  //Словарь - листья дерева (VocabularyTree по data, ветвление branching, глубина depth):
+  //кластеры - листья с их строками data, центры - центры листьев, так что слов до
+  //branching^depth, а assign спускается по дереву за O(branching * depth) расстояний.
+  //Ответ приближённый - ближайший центр листа может оказаться в соседней ветви.
+  //Дерево не сохраняется: после map assign перебирает центры листьев точно
+  void build_tree(const cv::Mat& data, int branching, int depth)
+  {
+    assert(data.cols == Dim);
+
+    m_mapping.reset();
+    m_tree = VocabularyTree<Dim>();
+    m_tree.build(data, branching, depth);
+    m_k = m_tree.words();
+
+    m_centers.resize(m_k * Dim);
+    std::vector<int> labels(data.rows);
+    for (int word = 0; word < m_k; ++word)
     {
-      const T* row_ptr = data.ptr<T>(i);
-      Descriptor descriptor;
-      std::copy(row_ptr, row_ptr + data.cols, descriptor.begin());
-      m_clusters[best_labels[i]].add_data(m_currentIndex++, descriptor);
+      std::copy(m_tree.center(word), m_tree.center(word) + Dim, &m_centers[word * Dim]);
+      for (int row : m_tree.rows(word))
+        labels[row] = word;
     }
+
+    fill(data, labels);
+  }
+
+  bool has_tree() const
+  {
+    return m_tree.words() > 0;
+  }
+
+  //Номер ближайшего центра (визуального слова) для каждого дескриптора,
+  //после build_tree - лист дерева, в который спускается дескриптор
+  std::vector<int> assign(const cv::Mat& descriptors) const
+  {
+    assert(descriptors.cols == Dim);
+
+    if (has_tree())
+      return m_tree.assign(descriptors);
+
+    cv::Mat centers(m_k, Dim, CV_64F);
+    for (int i = 0; i < m_k; ++i)
+      std::copy(centers_data() + i * Dim, centers_data() + (i + 1) * Dim, centers.ptr<double>(i));
+
+    cv::Mat double_descriptors, indices, distances;
+    descriptors.convertTo(double_descriptors, CV_64F);
+    ExactKnnIndex(centers).knnSearch(double_descriptors, indices, distances, 1);
+
+    return std::vector<int>(indices.ptr<int>(0), indices.ptr<int>(0) + descriptors.rows);
   }
 
   void set_pictures(std::vector<cv::Mat>&& pictures)
   {
     m_pictures = std::move(pictures);
-    m_maxIndex = pictures.size();
+    permute_pictures();
   }
 
-  typename std::vector<Cluster<T, Dim>>::const_iterator begin() const
+  const_iterator begin() const
   {
-    return m_clusters.begin();
+    return const_iterator(this, 0);
   }
 
-  typename std::vector<Cluster<T, Dim>>::const_iterator end() const
+  const_iterator end() const
   {
-    return m_clusters.end();
+    return const_iterator(this, size());
   }
 
   size_t size() const
   {
-    return m_clusters.size();
+    if (m_mapping)
+      return m_k;
+    return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+  }
+
+  Cluster<T, Dim> operator[](size_t index) const
+  {
+    const uint64_t* offsets = offsets_data();
+    const size_t first = offsets[index];
+    return Cluster<T, Dim>(index, centers_data() + index * Dim, descriptors_data() + first * Dim,
+                           indexes_data() + first, offsets[index + 1] - first);
+  }
+
+  //Картинки членов кластера index, в том же порядке, что и Cluster::indexes()
+  Span<const cv::Mat> get_pictures_by_index(size_t index) const
+  {
+    if (m_pictures.size() != descriptor_count())
+      return Span<const cv::Mat>();
+
+    const uint64_t* offsets = offsets_data();
+    return Span<const cv::Mat>(m_pictures.data() + offsets[index], offsets[index + 1] - offsets[index]);
   }
 
-  std::vector<cv::Mat> get_pictures_by_index(size_t index) const
+private:
+  struct Section
   {
-    std::vector<cv::Mat> result;
-    std::vector<size_t> indexes = m_clusters[index].indexes();
-    for (size_t i : indexes)
+    Section(uint64_t offset, const void* data, size_t size) : offset(offset), data(data), size(size)
     {
-      result.push_back(m_pictures[i]);
     }
-    return result;
+
+    uint64_t offset;
+    const void* data;
+    size_t size;
+  };
+
+  static uint64_t align(uint64_t offset)
+  {
+    return (offset + CLUSTER_SPACE_ALIGNMENT - 1) / CLUSTER_SPACE_ALIGNMENT * CLUSTER_SPACE_ALIGNMENT;
   }
 
-  template <class Archive>
-  void serialize(Archive& archive, const int)
+  //Массивы берутся из отображённого файла, если он открыт, иначе из своих векторов
+  const T* centers_data() const
   {
-    archive & m_k;
-    archive & m_clusters;
+    return m_mapping ? m_mappedCenters : m_centers.data();
   }
 
-private:
-  std::vector<Cluster<T, Dim>> m_clusters;
+  const uint64_t* offsets_data() const
+  {
+    return m_mapping ? m_mappedOffsets : m_offsets.data();
+  }
+
+  const int32_t* indexes_data() const
+  {
+    return m_mapping ? m_mappedIndexes : m_indexes.data();
+  }
+
+  const T* descriptors_data() const
+  {
+    return m_mapping ? m_mappedDescriptors : m_descriptors.data();
+  }
+
+  size_t descriptor_count() const
+  {
+    return m_mapping ? m_mappedDescriptorCount : m_indexes.size();
+  }
+
+  //Раскладка по кластерам сортировкой подсчётом
+  void fill(const cv::Mat& data, const std::vector<int>& labels)
+  {
+    m_offsets.assign(m_k + 1, 0);
+    for (int label : labels)
+      ++m_offsets[label + 1];
+    std::partial_sum(m_offsets.begin(), m_offsets.end(), m_offsets.begin());
+
+    m_descriptors.resize(labels.size() * Dim);
+    m_indexes.resize(labels.size());
+
+    std::vector<uint64_t> position(m_offsets.begin(), m_offsets.end() - 1);
+    for (size_t i = 0; i < labels.size(); ++i)
+    {
+      const size_t pos = position[labels[i]]++;
+      copy_row(data, i, &m_descriptors[pos * Dim]);
+      m_indexes[pos] = m_currentIndex++;
+    }
+
+    permute_pictures();
+  }
+
+  //Картинки приходят в исходном порядке, храним их в порядке членов кластеров
+  void permute_pictures()
+  {
+    const size_t count = descriptor_count();
+    if (m_pictures.empty() || count == 0)
+      return;
+
+    const int32_t* indexes = indexes_data();
+    std::vector<cv::Mat> permuted(count);
+    for (size_t pos = 0; pos < count; ++pos)
+      if (static_cast<size_t>(indexes[pos]) < m_pictures.size())
+        permuted[pos] = m_pictures[indexes[pos]];
+
+    m_pictures.swap(permuted);
+  }
+
+  std::vector<T> m_centers;
+  std::vector<T> m_descriptors;
+  std::vector<uint64_t> m_offsets;
+  std::vector<int32_t> m_indexes;
   std::vector<cv::Mat> m_pictures;
 
+  //Открытый map файл. Общий у копий ClusterSpace, так что указатели в него остаются верными
+  std::shared_ptr<MappedFile> m_mapping;
+  const T* m_mappedCenters;
+  const uint64_t* m_mappedOffsets;
+  const int32_t* m_mappedIndexes;
+  const T* m_mappedDescriptors;
+  size_t m_mappedDescriptorCount;
+  uint64_t m_mappedChecksum;
+
+  //Пустое, пока не вызван build_tree
+  VocabularyTree<Dim> m_tree;
+
   int m_k;
-  int m_maxIndex;
   int m_currentIndex;
 
 };
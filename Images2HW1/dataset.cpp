@@ -0,0 +1,114 @@
+#include "dataset.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+  const uint32_t DATASET_MAGIC = 0x4d444e4b; // "KNDM"
+  const size_t HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(int32_t);
+}
+
+DatasetWriter::DatasetWriter(const std::string& path, int cols)
+  : m_file(path, std::ios::binary), m_rows(0), m_cols(cols)
+{
+  const int32_t header_cols = cols;
+  m_file.write(reinterpret_cast<const char*>(&DATASET_MAGIC), sizeof(DATASET_MAGIC));
+  m_file.write(reinterpret_cast<const char*>(&m_rows), sizeof(m_rows));
+  m_file.write(reinterpret_cast<const char*>(&header_cols), sizeof(header_cols));
+}
+
+DatasetWriter::~DatasetWriter()
+{
+  close();
+}
+
+bool DatasetWriter::append(const cv::Mat& rows)
+{
+  if (!m_file.is_open())
+    return false;
+  if (rows.empty())
+    return static_cast<bool>(m_file);
+  assert(rows.type() == CV_64F && rows.cols == m_cols);
+
+  for (int i = 0; i < rows.rows; ++i)
+    m_file.write(reinterpret_cast<const char*>(rows.ptr<double>(i)), m_cols * sizeof(double));
+  m_rows += rows.rows;
+  return static_cast<bool>(m_file);
+}
+
+bool DatasetWriter::close()
+{
+  if (!m_file.is_open())
+    return false;
+
+  m_file.seekp(sizeof(DATASET_MAGIC));
+  m_file.write(reinterpret_cast<const char*>(&m_rows), sizeof(m_rows));
+  m_file.close();
+  return static_cast<bool>(m_file);
+}
+
+ChunkedDataset::ChunkedDataset(const std::string& path)
+  : m_file(path, std::ios::binary), m_rows(0), m_cols(0)
+{
+  uint32_t magic = 0;
+  uint64_t rows = 0;
+  int32_t cols = 0;
+
+  m_file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+  m_file.read(reinterpret_cast<char*>(&rows), sizeof(rows));
+  m_file.read(reinterpret_cast<char*>(&cols), sizeof(cols));
+
+  if (!m_file || magic != DATASET_MAGIC)
+  {
+    m_file.close();
+    return;
+  }
+
+  m_rows = rows;
+  m_cols = cols;
+}
+
+bool ChunkedDataset::read(size_t first, size_t count, cv::Mat& rows) const
+{
+  count = std::min(count, m_rows - std::min(first, m_rows));
+  rows.create(count, m_cols, CV_64F);
+
+  m_file.clear();
+  m_file.seekg(HEADER_SIZE + first * m_cols * sizeof(double));
+  for (size_t i = 0; i < count; ++i)
+    m_file.read(reinterpret_cast<char*>(rows.ptr<double>(i)), m_cols * sizeof(double));
+
+  return static_cast<bool>(m_file);
+}
+
+cv::Mat ChunkedDataset::sample(size_t count, size_t limit) const
+{
+  limit = std::min(limit, m_rows);
+  count = std::min(count, limit);
+
+  //Выбор без повторений (Флойд), строки читаем по возрастанию номеров
+  std::mt19937 generator(limit);
+  std::unordered_set<size_t> taken;
+  for (size_t j = limit - count; j < limit; ++j)
+  {
+    const size_t candidate = std::uniform_int_distribution<size_t>(0, j)(generator);
+    taken.insert(taken.count(candidate) ? j : candidate);
+  }
+
+  std::vector<size_t> chosen(taken.begin(), taken.end());
+  std::sort(chosen.begin(), chosen.end());
+
+  cv::Mat result(count, m_cols, CV_64F);
+  cv::Mat row;
+  for (size_t i = 0; i < chosen.size(); ++i)
+  {
+    read(chosen[i], 1, row);
+    std::copy(row.ptr<double>(0), row.ptr<double>(0) + m_cols, result.ptr<double>(i));
+  }
+
+  return result;
+}
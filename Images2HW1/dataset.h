@@ -0,0 +1,69 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+//Бинарный файл с данными: заголовок (метка, строки, столбцы), затем строки double подряд.
+//В отличие от текстовых файлов его можно читать кусками с любого места.
+class DatasetWriter
+{
+public:
+  DatasetWriter(const std::string& path, int cols);
+
+  ~DatasetWriter();
+
+  bool is_open() const
+  {
+    return m_file.is_open();
+  }
+
+  //false, если файл не открылся или запись не удалась
+  bool append(const cv::Mat& rows);
+
+  //Дописывает в заголовок итоговое число строк. false, если файл не был открыт
+  //или что-то из записанного не дошло до файла
+  bool close();
+
+private:
+  std::ofstream m_file;
+  uint64_t m_rows;
+  int m_cols;
+};
+
+class ChunkedDataset
+{
+public:
+  ChunkedDataset(const std::string& path);
+
+  bool is_open() const
+  {
+    return m_file.is_open();
+  }
+
+  size_t rows() const
+  {
+    return m_rows;
+  }
+
+  int cols() const
+  {
+    return m_cols;
+  }
+
+  //Прочитать строки [first, first + count) в rows (CV_64F)
+  bool read(size_t first, size_t count, cv::Mat& rows) const;
+
+  //Равномерная случайная выборка count строк из первых limit
+  cv::Mat sample(size_t count, size_t limit) const;
+
+private:
+  mutable std::ifstream m_file;
+  size_t m_rows;
+  int m_cols;
+};
+
+#endif // DATASET_H
@@ -0,0 +1,142 @@
+#include "descriptorsink.h"
+
+#include <algorithm>
+#include <cassert>
+
+DescriptorSink::DescriptorSink(int cols, size_t memory_budget, const std::string& spill_path, size_t sample_size)
+  : m_cols(cols), m_memoryBudget(memory_budget), m_spillPath(spill_path), m_rows(0), m_spilled(0),
+    m_finished(false), m_sample(sample_size, cols, CV_64F), m_sampleSize(sample_size), m_generator(sample_size),
+    m_position(0)
+{
+}
+
+void DescriptorSink::add_to_sample(const double* row)
+{
+  //m_rows - номер этой строки, то есть сколько строк было до неё
+  size_t slot = m_rows;
+  if (m_rows >= m_sampleSize)
+    slot = std::uniform_int_distribution<size_t>(0, m_rows)(m_generator);
+
+  if (slot < m_sampleSize)
+    std::copy(row, row + m_cols, m_sample.ptr<double>(slot));
+}
+
+bool DescriptorSink::append(const cv::Mat& rows)
+{
+  assert(!m_finished);
+  //У картинки без особых точек compute отдаёт пустую матрицу без столбцов
+  if (rows.empty())
+    return true;
+  assert(rows.cols == m_cols);
+
+  cv::Mat double_rows;
+  rows.convertTo(double_rows, CV_64F);
+
+  for (int i = 0; i < double_rows.rows; ++i)
+  {
+    const size_t in_chunk = (m_rows - m_spilled) % CHUNK_ROWS;
+    if (in_chunk == 0)
+    {
+      const size_t sample_bytes = m_sample.total() * m_sample.elemSize();
+      if (sample_bytes + (m_chunks.size() + 1) * CHUNK_ROWS * m_cols * sizeof(double) > m_memoryBudget
+          && !spill())
+        return false;
+      m_chunks.push_back(cv::Mat(CHUNK_ROWS, m_cols, CV_64F));
+    }
+
+    const double* row = double_rows.ptr<double>(i);
+    std::copy(row, row + m_cols, m_chunks.back().ptr<double>(in_chunk));
+
+    add_to_sample(row);
+    ++m_rows;
+  }
+
+  return true;
+}
+
+bool DescriptorSink::spill()
+{
+  if (m_chunks.empty())
+    return true;
+
+  if (!m_writer)
+    m_writer.reset(new DatasetWriter(m_spillPath, m_cols));
+
+  //Вызывается только на границе кусков, так что все куски заполнены
+  for (const cv::Mat& chunk : m_chunks)
+    if (!m_writer->append(chunk))
+      return false;
+
+  m_spilled += m_chunks.size() * CHUNK_ROWS;
+  m_chunks.clear();
+  return true;
+}
+
+bool DescriptorSink::finish()
+{
+  if (m_finished)
+    return !m_writer || (m_spillFile && m_spillFile->is_open());
+
+  m_finished = true;
+  if (!m_writer)
+    return true;
+
+  if (!m_writer->close())
+    return false;
+
+  m_spillFile.reset(new ChunkedDataset(m_spillPath));
+  return m_spillFile->is_open() && m_spillFile->rows() == m_spilled;
+}
+
+cv::Mat DescriptorSink::sample() const
+{
+  return cv::Mat(m_sample, cv::Range(0, std::min(m_rows, m_sampleSize)), cv::Range::all()).clone();
+}
+
+bool DescriptorSink::read(size_t first, size_t count, cv::Mat& rows) const
+{
+  assert(m_finished);
+
+  count = std::min(count, m_rows - std::min(first, m_rows));
+  rows.create(count, m_cols, CV_64F);
+
+  size_t done = 0;
+  if (first < m_spilled)
+  {
+    cv::Mat head;
+    done = std::min(count, m_spilled - first);
+    if (!m_spillFile || !m_spillFile->read(first, done, head))
+      return false;
+    for (size_t i = 0; i < done; ++i)
+      std::copy(head.ptr<double>(i), head.ptr<double>(i) + m_cols, rows.ptr<double>(i));
+  }
+
+  for (; done < count; ++done)
+  {
+    const size_t row = first + done - m_spilled;
+    const double* source = m_chunks[row / CHUNK_ROWS].ptr<double>(row % CHUNK_ROWS);
+    std::copy(source, source + m_cols, rows.ptr<double>(done));
+  }
+
+  return true;
+}
+
+int DescriptorSink::cols() const
+{
+  return m_cols;
+}
+
+size_t DescriptorSink::next(size_t count, cv::Mat& batch)
+{
+  count = std::min(count, m_rows - m_position);
+  if (count == 0 || !read(m_position, count, batch))
+    return 0;
+
+  m_position += count;
+  return count;
+}
+
+void DescriptorSink::rewind()
+{
+  m_position = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef DESCRIPTORSINK_H
+#define DESCRIPTORSINK_H
+
+#include "dataset.h"
+#include "descriptorstream.h"
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+//Копилка дескрипторов с ограниченной памятью. Строки дописываются в заранее
+//выделенные куски по CHUNK_ROWS, без перевыделения всего накопленного. Заодно
+//поддерживается равномерная выборка sample_size строк резервуаром, на которой можно
+//учить словарь. memory_budget байт - на выборку и куски вместе: выборка выделяется
+//сразу целиком, и когда куски с ней превышают бюджет, заполненные сбрасываются в файл
+//spill_path (формат DatasetWriter) и освобождаются. Один кусок держится в памяти всегда.
+//После finish() всё накопленное читается как DescriptorStream или кусками через read.
+class DescriptorSink : public DescriptorStream
+{
+public:
+  DescriptorSink(int cols, size_t memory_budget, const std::string& spill_path, size_t sample_size);
+
+  //rows - CV_32F или CV_64F, пустая матрица пропускается. false, если не удалось
+  //сбросить куски в файл: тогда строки rows с этого места не добавлены
+  bool append(const cv::Mat& rows);
+
+  //Закончить запись: закрыть файл сброса, дальше только чтение.
+  //false, если файл сброса не дописался или не открывается на чтение
+  bool finish();
+
+  size_t rows() const
+  {
+    return m_rows;
+  }
+
+  //Сколько строк ушло в файл
+  size_t spilled() const
+  {
+    return m_spilled;
+  }
+
+  //Равномерная выборка min(rows(), sample_size) строк, CV_64F
+  cv::Mat sample() const;
+
+  //Прочитать строки [first, first + count) в rows (CV_64F). Только после finish()
+  bool read(size_t first, size_t count, cv::Mat& rows) const;
+
+  int cols() const;
+
+  size_t next(size_t count, cv::Mat& batch);
+
+  void rewind();
+
+  static const int CHUNK_ROWS = 4096;
+
+private:
+  void add_to_sample(const double* row);
+
+  //Сбросить в файл все заполненные куски, false - файл не открылся или запись не удалась
+  bool spill();
+
+  int m_cols;
+  size_t m_memoryBudget;
+  std::string m_spillPath;
+
+  //Куски в памяти. Первая строка m_chunks[0] - строка m_spilled
+  std::vector<cv::Mat> m_chunks;
+  size_t m_rows;
+  size_t m_spilled;
+
+  std::unique_ptr<DatasetWriter> m_writer;
+  std::unique_ptr<ChunkedDataset> m_spillFile;
+  bool m_finished;
+
+  cv::Mat m_sample;
+  size_t m_sampleSize;
+  std::mt19937_64 m_generator;
+
+  size_t m_position;
+};
+
+#endif // DESCRIPTORSINK_H
@@ -0,0 +1,115 @@
+#include "descriptorstream.h"
+
+#include <algorithm>
+
+MatDescriptorStream::MatDescriptorStream(const cv::Mat& data)
+  : m_data(data), m_position(0)
+{
+}
+
+int MatDescriptorStream::cols() const
+{
+  return m_data.cols;
+}
+
+bool MatDescriptorStream::read(size_t first, size_t count, cv::Mat& rows) const
+{
+  if (first + count > static_cast<size_t>(m_data.rows))
+    return false;
+
+  cv::Mat(m_data, cv::Range(first, first + count), cv::Range::all()).convertTo(rows, CV_64F);
+  return true;
+}
+
+size_t MatDescriptorStream::next(size_t count, cv::Mat& batch)
+{
+  count = std::min(count, m_data.rows - m_position);
+  if (count == 0)
+    return 0;
+
+  cv::Mat(m_data, cv::Range(m_position, m_position + count), cv::Range::all()).convertTo(batch, CV_64F);
+  m_position += count;
+  return count;
+}
+
+void MatDescriptorStream::rewind()
+{
+  m_position = 0;
+}
+
+DatasetDescriptorStream::DatasetDescriptorStream(const std::string& path)
+  : m_dataset(path), m_position(0)
+{
+}
+
+int DatasetDescriptorStream::cols() const
+{
+  return m_dataset.cols();
+}
+
+size_t DatasetDescriptorStream::next(size_t count, cv::Mat& batch)
+{
+  count = std::min(count, m_dataset.rows() - m_position);
+  if (count == 0 || !m_dataset.read(m_position, count, batch))
+    return 0;
+
+  m_position += count;
+  return count;
+}
+
+void DatasetDescriptorStream::rewind()
+{
+  m_position = 0;
+}
+
+ShuffledDescriptorStream::ShuffledDescriptorStream(const DescriptorStream& source, size_t block_rows, unsigned seed)
+  : m_source(source), m_blockRows(std::max<size_t>(block_rows, 1)), m_position(0), m_blockOffset(0),
+    m_taken(0), m_generator(seed)
+{
+  m_blocks.resize((m_source.rows() + m_blockRows - 1) / m_blockRows);
+  for (size_t i = 0; i < m_blocks.size(); ++i)
+    m_blocks[i] = i;
+  std::shuffle(m_blocks.begin(), m_blocks.end(), m_generator);
+}
+
+size_t ShuffledDescriptorStream::next(size_t count, cv::Mat& batch)
+{
+  count = std::min(count, m_source.rows() - m_taken);
+  if (count == 0)
+    return 0;
+
+  batch.create(count, m_source.cols(), CV_64F);
+
+  //Блок, начатый прошлой пачкой, дочитывается с m_blockOffset
+  cv::Mat block;
+  for (size_t filled = 0; filled < count;)
+  {
+    const size_t first = m_blocks[m_position] * m_blockRows + m_blockOffset;
+    const size_t block_end = std::min((m_blocks[m_position] + 1) * m_blockRows, m_source.rows());
+    const size_t size = std::min(block_end - first, count - filled);
+    if (!m_source.read(first, size, block))
+      return 0;
+
+    cv::Mat rows(batch, cv::Range(filled, filled + size), cv::Range::all());
+    block.copyTo(rows);
+    filled += size;
+
+    m_blockOffset += size;
+    if (first + size == block_end)
+    {
+      ++m_position;
+      m_blockOffset = 0;
+    }
+  }
+
+  m_taken += count;
+  return count;
+}
+
+void ShuffledDescriptorStream::rewind()
+{
+  std::shuffle(m_blocks.begin(), m_blocks.end(), m_generator);
+  m_position = 0;
+  m_blockOffset = 0;
+  m_taken = 0;
+}
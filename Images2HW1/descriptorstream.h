@@ -0,0 +1,131 @@
+#ifndef DESCRIPTORSTREAM_H
+#define DESCRIPTORSTREAM_H
+
+#include "dataset.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <random>
+#include <vector>
+
+//Источник дескрипторов, который отдаёт их пачками и не обязан держать все в памяти
+class DescriptorStream
+{
+public:
+  virtual ~DescriptorStream()
+  {
+  }
+
+  virtual size_t rows() const = 0;
+
+  virtual int cols() const = 0;
+
+  //Прочитать строки [first, first + count) в rows (CV_64F) в обход текущей позиции
+  virtual bool read(size_t first, size_t count, cv::Mat& rows) const = 0;
+
+  //Прочитать до count следующих строк в batch (CV_64F), вернуть число прочитанных. 0 - поток кончился
+  virtual size_t next(size_t count, cv::Mat& batch) = 0;
+
+  //Вернуться в начало потока
+  virtual void rewind() = 0;
+};
+
+//Поток по матрице в памяти (CV_32F или CV_64F)
+class MatDescriptorStream : public DescriptorStream
+{
+public:
+  MatDescriptorStream(const cv::Mat& data);
+
+  size_t rows() const
+  {
+    return m_data.rows;
+  }
+
+  int cols() const;
+
+  bool read(size_t first, size_t count, cv::Mat& rows) const;
+
+  size_t next(size_t count, cv::Mat& batch);
+
+  void rewind();
+
+private:
+  cv::Mat m_data;
+  size_t m_position;
+};
+
+//Поток по бинарному файлу, записанному DatasetWriter
+class DatasetDescriptorStream : public DescriptorStream
+{
+public:
+  DatasetDescriptorStream(const std::string& path);
+
+  bool is_open() const
+  {
+    return m_dataset.is_open();
+  }
+
+  size_t rows() const
+  {
+    return m_dataset.rows();
+  }
+
+  int cols() const;
+
+  bool read(size_t first, size_t count, cv::Mat& rows) const
+  {
+    return m_dataset.read(first, count, rows);
+  }
+
+  size_t next(size_t count, cv::Mat& batch);
+
+  void rewind();
+
+private:
+  ChunkedDataset m_dataset;
+  size_t m_position;
+};
+
+//Обёртка, которая отдаёт строки source в случайном порядке: поток режется на блоки
+//по block_rows строк, пачки набираются из блоков по случайной перестановке.
+//Блоки, а не отдельные строки - чтобы чтение из файла оставалось кусками подряд.
+//Каждый rewind перемешивает блоки заново, так что mini-batch k-means не видит
+//дескрипторы одной картинки или категории в одной пачке
+class ShuffledDescriptorStream : public DescriptorStream
+{
+public:
+  ShuffledDescriptorStream(const DescriptorStream& source, size_t block_rows = 256, unsigned seed = 0);
+
+  size_t rows() const
+  {
+    return m_source.rows();
+  }
+
+  int cols() const
+  {
+    return m_source.cols();
+  }
+
+  //Строки в исходном порядке
+  bool read(size_t first, size_t count, cv::Mat& rows) const
+  {
+    return m_source.read(first, count, rows);
+  }
+
+  size_t next(size_t count, cv::Mat& batch);
+
+  void rewind();
+
+private:
+  const DescriptorStream& m_source;
+  size_t m_blockRows;
+  //Номера блоков в порядке выдачи, текущий блок, сколько строк из него
+  //уже выдано и сколько выдано всего с последнего rewind
+  std::vector<size_t> m_blocks;
+  size_t m_position;
+  size_t m_blockOffset;
+  size_t m_taken;
+  std::mt19937_64 m_generator;
+};
+
+#endif // DESCRIPTORSTREAM_H
@@ -0,0 +1,83 @@
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include <emmintrin.h>
+
+inline double horizontal_sum(__m128d value)
+{
+  return _mm_cvtsd_f64(_mm_add_sd(value, _mm_unpackhi_pd(value, value)));
+}
+
+inline double dot_product(const double* a, const double* b, int size)
+{
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+
+  int i = 0;
+  for (; i + 4 <= size; i += 4)
+  {
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+
+  double result = horizontal_sum(_mm_add_pd(acc0, acc1));
+  for (; i < size; ++i)
+    result += a[i] * b[i];
+
+  return result;
+}
+
+//Квадрат L2 расстояния, как у cvflann::L2<double>
+inline double l2_squared(const double* a, const double* b, int size)
+{
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+
+  int i = 0;
+  for (; i + 4 <= size; i += 4)
+  {
+    const __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    const __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+  }
+
+  double result = horizontal_sum(_mm_add_pd(acc0, acc1));
+
+  for (; i < size; ++i)
+    result += (a[i] - b[i]) * (a[i] - b[i]);
+
+  return result;
+}
+
+//То же для размерности, известной при компиляции: число шагов цикла постоянно,
+//и компилятор разворачивает его целиком
+template <int Dim>
+inline double l2_squared(const double* a, const double* b)
+{
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+  __m128d acc2 = _mm_setzero_pd();
+  __m128d acc3 = _mm_setzero_pd();
+
+  const int unrolled = Dim / 8 * 8;
+  for (int i = 0; i < unrolled; i += 8)
+  {
+    const __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    const __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+    const __m128d d2 = _mm_sub_pd(_mm_loadu_pd(a + i + 4), _mm_loadu_pd(b + i + 4));
+    const __m128d d3 = _mm_sub_pd(_mm_loadu_pd(a + i + 6), _mm_loadu_pd(b + i + 6));
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    acc2 = _mm_add_pd(acc2, _mm_mul_pd(d2, d2));
+    acc3 = _mm_add_pd(acc3, _mm_mul_pd(d3, d3));
+  }
+
+  double result = horizontal_sum(_mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3)));
+  if (unrolled < Dim)
+    result += l2_squared(a + unrolled, b + unrolled, Dim - unrolled);
+
+  return result;
+}
+
+#endif // DISTANCE_H
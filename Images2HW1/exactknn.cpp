@@ -0,0 +1,217 @@
+#include "exactknn.h"
+#include "distance.h"
+#include "neighbours.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#include <emmintrin.h>
+
+namespace
+{
+  //Размеры блоков подобраны так, чтобы кусок данных DATA_BLOCK x DEPTH_BLOCK
+  //лежал в L2, а кусок запросов QUERY_BLOCK x DEPTH_BLOCK - в L1.
+  const int QUERY_BLOCK = 32;
+  const int DATA_BLOCK = 64;
+  const int DEPTH_BLOCK = 128;
+
+  //dots[i * DATA_BLOCK + j] += queries[i] . rows[j] по первым depth измерениям.
+  //Микроядро 2 запроса x 4 строки: 8 аккумуляторов в регистрах на 6 загрузок.
+  void accumulate_dots(const double* queries, size_t query_step, int query_count,
+                       const double* rows, size_t row_step, int row_count,
+                       int depth, double* dots)
+  {
+    int i = 0;
+    for (; i + 2 <= query_count; i += 2)
+    {
+      const double* q0 = queries + i * query_step;
+      const double* q1 = q0 + query_step;
+      double* dots0 = dots + i * DATA_BLOCK;
+      double* dots1 = dots0 + DATA_BLOCK;
+
+      int j = 0;
+      for (; j + 4 <= row_count; j += 4)
+      {
+        const double* x0 = rows + j * row_step;
+        const double* x1 = x0 + row_step;
+        const double* x2 = x1 + row_step;
+        const double* x3 = x2 + row_step;
+
+        __m128d a00 = _mm_setzero_pd(), a01 = _mm_setzero_pd(), a02 = _mm_setzero_pd(), a03 = _mm_setzero_pd();
+        __m128d a10 = _mm_setzero_pd(), a11 = _mm_setzero_pd(), a12 = _mm_setzero_pd(), a13 = _mm_setzero_pd();
+
+        int k = 0;
+        for (; k + 2 <= depth; k += 2)
+        {
+          const __m128d v0 = _mm_loadu_pd(q0 + k);
+          const __m128d v1 = _mm_loadu_pd(q1 + k);
+
+          __m128d y = _mm_loadu_pd(x0 + k);
+          a00 = _mm_add_pd(a00, _mm_mul_pd(v0, y));
+          a10 = _mm_add_pd(a10, _mm_mul_pd(v1, y));
+
+          y = _mm_loadu_pd(x1 + k);
+          a01 = _mm_add_pd(a01, _mm_mul_pd(v0, y));
+          a11 = _mm_add_pd(a11, _mm_mul_pd(v1, y));
+
+          y = _mm_loadu_pd(x2 + k);
+          a02 = _mm_add_pd(a02, _mm_mul_pd(v0, y));
+          a12 = _mm_add_pd(a12, _mm_mul_pd(v1, y));
+
+          y = _mm_loadu_pd(x3 + k);
+          a03 = _mm_add_pd(a03, _mm_mul_pd(v0, y));
+          a13 = _mm_add_pd(a13, _mm_mul_pd(v1, y));
+        }
+
+        double s00 = horizontal_sum(a00), s01 = horizontal_sum(a01), s02 = horizontal_sum(a02), s03 = horizontal_sum(a03);
+        double s10 = horizontal_sum(a10), s11 = horizontal_sum(a11), s12 = horizontal_sum(a12), s13 = horizontal_sum(a13);
+
+        for (; k < depth; ++k)
+        {
+          s00 += q0[k] * x0[k]; s01 += q0[k] * x1[k]; s02 += q0[k] * x2[k]; s03 += q0[k] * x3[k];
+          s10 += q1[k] * x0[k]; s11 += q1[k] * x1[k]; s12 += q1[k] * x2[k]; s13 += q1[k] * x3[k];
+        }
+
+        dots0[j] += s00; dots0[j + 1] += s01; dots0[j + 2] += s02; dots0[j + 3] += s03;
+        dots1[j] += s10; dots1[j + 1] += s11; dots1[j + 2] += s12; dots1[j + 3] += s13;
+      }
+
+      for (; j < row_count; ++j)
+      {
+        const double* x = rows + j * row_step;
+        dots0[j] += dot_product(q0, x, depth);
+        dots1[j] += dot_product(q1, x, depth);
+      }
+    }
+
+    for (; i < query_count; ++i)
+    {
+      const double* q = queries + i * query_step;
+      for (int j = 0; j < row_count; ++j)
+        dots[i * DATA_BLOCK + j] += dot_product(q, rows + j * row_step, depth);
+    }
+  }
+}
+
+ExactKnnIndex::ExactKnnIndex(const cv::Mat& data)
+{
+  if (data.type() == CV_64F)
+    m_data = data;
+  else
+    data.convertTo(m_data, CV_64F);
+
+  m_norms.resize(m_data.rows);
+  parallel_for(m_data.rows, 4096, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+    {
+      const double* row = m_data.ptr<double>(i);
+      m_norms[i] = dot_product(row, row, m_data.cols);
+    }
+  });
+}
+
+void ExactKnnIndex::knnSearch(const cv::Mat& queries, cv::Mat& indices, cv::Mat& distances, int knn) const
+{
+  assert(queries.type() == CV_64F);
+  assert(queries.cols == m_data.cols);
+  assert(knn > 0 && knn <= m_data.rows);
+
+  const int query_count = queries.rows;
+  const int rows = m_data.rows;
+  const int cols = m_data.cols;
+  const size_t query_step = queries.step1();
+  const size_t data_step = m_data.step1();
+
+  std::vector<double> query_norms(query_count);
+  for (int i = 0; i < query_count; ++i)
+    query_norms[i] = dot_product(queries.ptr<double>(i), queries.ptr<double>(i), cols);
+
+  //Задача - блок запросов x кусок данных. Если запросов мало, режем данные мельче,
+  //чтобы загрузить все потоки.
+  const int query_blocks = (query_count + QUERY_BLOCK - 1) / QUERY_BLOCK;
+  const int data_blocks = (rows + DATA_BLOCK - 1) / DATA_BLOCK;
+  const int wanted_chunks = std::max<int>(1, (hardware_threads() * 4 + query_blocks - 1) / query_blocks);
+  const int blocks_per_chunk = std::max(1, (data_blocks + wanted_chunks - 1) / wanted_chunks);
+  const int chunk_rows = blocks_per_chunk * DATA_BLOCK;
+  const int chunks = (rows + chunk_rows - 1) / chunk_rows;
+
+  std::vector<std::vector<NeighbourHeap>> partial(query_blocks * chunks);
+
+  parallel_for(partial.size(), 1, [&](size_t task_begin, size_t task_end) {
+    std::vector<double> dots(QUERY_BLOCK * DATA_BLOCK);
+
+    for (size_t task = task_begin; task < task_end; ++task)
+    {
+      const int first_query = (task / chunks) * QUERY_BLOCK;
+      const int block_queries = std::min(QUERY_BLOCK, query_count - first_query);
+      const int chunk_begin = (task % chunks) * chunk_rows;
+      const int chunk_end = std::min(rows, chunk_begin + chunk_rows);
+
+      std::vector<NeighbourHeap>& heaps = partial[task];
+      heaps.resize(block_queries);
+
+      for (int first_row = chunk_begin; first_row < chunk_end; first_row += DATA_BLOCK)
+      {
+        const int block_rows = std::min(DATA_BLOCK, chunk_end - first_row);
+        std::fill(dots.begin(), dots.end(), 0.0);
+
+        for (int first_dim = 0; first_dim < cols; first_dim += DEPTH_BLOCK)
+        {
+          accumulate_dots(queries.ptr<double>(first_query) + first_dim, query_step, block_queries,
+                          m_data.ptr<double>(first_row) + first_dim, data_step, block_rows,
+                          std::min(DEPTH_BLOCK, cols - first_dim), dots.data());
+        }
+
+        for (int i = 0; i < block_queries; ++i)
+        {
+          const double query_norm = query_norms[first_query + i];
+          const double* query_dots = dots.data() + i * DATA_BLOCK;
+          for (int j = 0; j < block_rows; ++j)
+          {
+            //Из-за округления разложение может дать чуть меньше нуля
+            const double distance = std::max(0.0, query_norm + m_norms[first_row + j] - 2 * query_dots[j]);
+            push_neighbour(heaps[i], knn, distance, first_row + j);
+          }
+        }
+      }
+    }
+  });
+
+  indices.create(query_count, knn, CV_32S);
+  distances.create(query_count, knn, CV_64F);
+
+  parallel_for(query_count, 16, [&](size_t begin, size_t end) {
+    for (size_t query = begin; query < end; ++query)
+    {
+      NeighbourHeap merged;
+      const size_t block = query / QUERY_BLOCK;
+      const size_t offset = query % QUERY_BLOCK;
+      for (int chunk = 0; chunk < chunks; ++chunk)
+        for (const Neighbour& neighbour : partial[block * chunks + chunk][offset])
+          push_neighbour(merged, knn, neighbour.first, neighbour.second);
+
+      std::sort_heap(merged.begin(), merged.end());
+
+      int* index_row = indices.ptr<int>(query);
+      double* distance_row = distances.ptr<double>(query);
+      for (int i = 0; i < knn; ++i)
+      {
+        index_row[i] = merged[i].second;
+        distance_row[i] = merged[i].first;
+      }
+    }
+  });
+}
+
+void ExactKnnIndex::knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                              std::vector<double>& distances, int knn) const
+{
+  cv::Mat query_mat(1, query.size(), CV_64F, const_cast<double*>(query.data()));
+  cv::Mat index_mat, distance_mat;
+  knnSearch(query_mat, index_mat, distance_mat, knn);
+
+  indices.assign(index_mat.ptr<int>(0), index_mat.ptr<int>(0) + knn);
+  distances.assign(distance_mat.ptr<double>(0), distance_mat.ptr<double>(0) + knn);
+}
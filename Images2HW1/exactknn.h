@@ -0,0 +1,38 @@
+#ifndef EXACTKNN_H
+#define EXACTKNN_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+//Точный поиск k ближайших соседей полным перебором.
+//Расстояния считаются как |q|^2 + |x|^2 - 2 q.x блоками "запросы x строки данных",
+//так что блок данных переиспользуется из кэша сразу для нескольких запросов.
+//Возвращает квадраты L2 расстояний, как cvflann::L2<double>.
+class ExactKnnIndex
+{
+public:
+  ExactKnnIndex(const cv::Mat& data);
+
+  //Пакетный поиск: queries - CV_64F, по строке на запрос.
+  //indices (CV_32S) и distances (CV_64F) получают размер queries.rows x knn.
+  void knnSearch(const cv::Mat& queries, cv::Mat& indices, cv::Mat& distances, int knn) const;
+
+  void knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                 std::vector<double>& distances, int knn) const;
+
+  size_t size() const
+  {
+    return m_data.rows;
+  }
+
+  size_t veclen() const
+  {
+    return m_data.cols;
+  }
+
+private:
+  cv::Mat m_data;
+  std::vector<double> m_norms;
+};
+
+#endif // EXACTKNN_H
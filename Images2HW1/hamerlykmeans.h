@@ -0,0 +1,256 @@
+#ifndef HAMERLYKMEANS_H
+#define HAMERLYKMEANS_H
+
+#include "distance.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+//Точный k-means Ллойда с отсечениями Хамерли (Hamerly, Making k-means even faster).
+//Для каждой точки хранятся верхняя граница расстояния до своего центра и одна нижняя
+//граница до всех остальных. Пока верхняя не превышает max(нижней, половины расстояния
+//от своего центра до ближайшего другого), точка заведомо не меняет кластер и расстояния
+//до центров для неё не считаются. Памяти O(n) в отличие от O(nk) у Элкана, что важно
+//при тысячах центров. Метки и центры получаются те же, что у обычного Ллойда
+//с той же инициализацией.
+template <int Dim>
+class HamerlyKMeans
+{
+public:
+  //threads - сколько потоков использовать, 0 - все
+  HamerlyKMeans(int k, int max_iterations = 100, unsigned seed = 0, size_t threads = 0)
+    : m_k(k), m_maxIterations(max_iterations), m_seed(seed), m_threads(threads), m_iterations(0)
+  {
+  }
+
+  //data - CV_64F, Dim столбцов. Возвращает метки, центры доступны через centers()
+  std::vector<int> fit(const cv::Mat& data)
+  {
+    assert(data.type() == CV_64F && data.cols == Dim);
+    assert(data.rows >= m_k);
+
+    const size_t n = data.rows;
+
+    init_centers(data);
+
+    m_labels.assign(n, 0);
+    m_upper.assign(n, 0);
+    m_lower.assign(n, 0);
+
+    //Первый проход - полный, он же задаёт границы
+    parallel_for(n, 1024, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i)
+        full_scan(data.ptr<double>(i), i);
+    }, m_threads);
+
+    std::vector<double> half_gaps(m_k);
+    std::vector<double> moves(m_k);
+
+    for (m_iterations = 1; m_iterations <= m_maxIterations; ++m_iterations)
+    {
+      if (!move_centers(data, moves))
+        break;
+
+      //Сдвиг центров ослабляет границы: своя верхняя растёт на сдвиг своего центра,
+      //нижняя падает на наибольший сдвиг среди остальных
+      const size_t farthest = std::max_element(moves.begin(), moves.end()) - moves.begin();
+      double second_move = 0;
+      for (int c = 0; c < m_k; ++c)
+        if (c != static_cast<int>(farthest))
+          second_move = std::max(second_move, moves[c]);
+
+      center_gaps(half_gaps);
+
+      std::atomic<size_t> changed(0);
+      parallel_for(n, 1024, [&](size_t begin, size_t end) {
+        size_t local_changed = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+          const int label = m_labels[i];
+          m_upper[i] += moves[label];
+          m_lower[i] -= label == static_cast<int>(farthest) ? second_move : moves[farthest];
+
+          const double bound = std::max(half_gaps[label], m_lower[i]);
+          if (m_upper[i] <= bound)
+            continue;
+
+          const double* row = data.ptr<double>(i);
+          m_upper[i] = std::sqrt(l2_squared<Dim>(row, center(label)));
+          if (m_upper[i] <= bound)
+            continue;
+
+          full_scan(row, i);
+          if (m_labels[i] != label)
+            ++local_changed;
+        }
+        changed += local_changed;
+      }, m_threads);
+
+      if (changed == 0)
+        break;
+    }
+
+    return m_labels;
+  }
+
+  //k x Dim, CV_64F
+  cv::Mat centers() const
+  {
+    return cv::Mat(m_k, Dim, CV_64F, const_cast<double*>(m_centers.data())).clone();
+  }
+
+  int iterations() const
+  {
+    return m_iterations;
+  }
+
+private:
+  const double* center(int c) const
+  {
+    return &m_centers[c * Dim];
+  }
+
+  //k-means++: очередной центр выбирается с вероятностью, пропорциональной
+  //квадрату расстояния до ближайшего уже выбранного
+  void init_centers(const cv::Mat& data)
+  {
+    const size_t n = data.rows;
+    std::mt19937_64 generator(m_seed);
+
+    m_centers.resize(m_k * Dim);
+    std::vector<double> nearest(n, std::numeric_limits<double>::max());
+
+    size_t chosen = std::uniform_int_distribution<size_t>(0, n - 1)(generator);
+    for (int c = 0; c < m_k; ++c)
+    {
+      std::copy(data.ptr<double>(chosen), data.ptr<double>(chosen) + Dim, &m_centers[c * Dim]);
+      if (c + 1 == m_k)
+        break;
+
+      parallel_for(n, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+          nearest[i] = std::min(nearest[i], l2_squared<Dim>(data.ptr<double>(i), center(c)));
+      }, m_threads);
+
+      const double total = std::accumulate(nearest.begin(), nearest.end(), 0.0);
+      double target = std::uniform_real_distribution<double>(0, total)(generator);
+
+      chosen = n - 1;
+      for (size_t i = 0; i < n; ++i)
+      {
+        target -= nearest[i];
+        if (target <= 0 && nearest[i] > 0)
+        {
+          chosen = i;
+          break;
+        }
+      }
+    }
+  }
+
+  //Расстояния до всех центров: метка, точная верхняя граница и нижняя по второму центру
+  void full_scan(const double* row, size_t i)
+  {
+    double best = std::numeric_limits<double>::max();
+    double second = std::numeric_limits<double>::max();
+    int label = 0;
+
+    for (int c = 0; c < m_k; ++c)
+    {
+      const double distance = l2_squared<Dim>(row, center(c));
+      if (distance < best)
+      {
+        second = best;
+        best = distance;
+        label = c;
+      }
+      else if (distance < second)
+        second = distance;
+    }
+
+    m_labels[i] = label;
+    m_upper[i] = std::sqrt(best);
+    m_lower[i] = std::sqrt(second);
+  }
+
+  //Половина расстояния от каждого центра до ближайшего другого
+  void center_gaps(std::vector<double>& half_gaps) const
+  {
+    parallel_for(m_k, 16, [&](size_t begin, size_t end) {
+      for (size_t c = begin; c < end; ++c)
+      {
+        double nearest = std::numeric_limits<double>::max();
+        for (int other = 0; other < m_k; ++other)
+          if (other != static_cast<int>(c))
+            nearest = std::min(nearest, l2_squared<Dim>(center(c), center(other)));
+
+        half_gaps[c] = 0.5 * std::sqrt(nearest);
+      }
+    }, m_threads);
+  }
+
+  //Пересчитать центры как средние своих точек, moves - насколько сдвинулся каждый.
+  //false, если ни один центр не сдвинулся
+  bool move_centers(const cv::Mat& data, std::vector<double>& moves)
+  {
+    std::vector<size_t> offsets(m_k + 1, 0);
+    for (int label : m_labels)
+      ++offsets[label + 1];
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    std::vector<int> members(m_labels.size());
+    std::vector<size_t> position(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < m_labels.size(); ++i)
+      members[position[m_labels[i]]++] = i;
+
+    parallel_for(m_k, 8, [&](size_t begin, size_t end) {
+      double sum[Dim];
+      for (size_t c = begin; c < end; ++c)
+      {
+        moves[c] = 0;
+        if (offsets[c] == offsets[c + 1])
+          continue;
+
+        std::fill(sum, sum + Dim, 0.0);
+        for (size_t i = offsets[c]; i < offsets[c + 1]; ++i)
+        {
+          const double* row = data.ptr<double>(members[i]);
+          for (int j = 0; j < Dim; ++j)
+            sum[j] += row[j];
+        }
+
+        const double count = offsets[c + 1] - offsets[c];
+        for (int j = 0; j < Dim; ++j)
+          sum[j] /= count;
+
+        double* current = &m_centers[c * Dim];
+        moves[c] = std::sqrt(l2_squared<Dim>(sum, current));
+        std::copy(sum, sum + Dim, current);
+      }
+    }, m_threads);
+
+    return *std::max_element(moves.begin(), moves.end()) > 0;
+  }
+
+  int m_k;
+  int m_maxIterations;
+  unsigned m_seed;
+  size_t m_threads;
+  int m_iterations;
+
+  std::vector<double> m_centers;
+  std::vector<int> m_labels;
+  std::vector<double> m_upper;
+  std::vector<double> m_lower;
+};
+
+#endif // HAMERLYKMEANS_H
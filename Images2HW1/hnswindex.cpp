@@ -0,0 +1,397 @@
+#include "hnswindex.h"
+#include "distance.h"
+#include "neighbours.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  const uint32_t HNSW_MAGIC = 0x57534e48; // "HNSW"
+  const uint32_t HNSW_VERSION = 1;
+
+  thread_local VisitedList visited;
+
+  //Список связей [число, связи...] не длиннее max_links и ссылается только на вершины [0, rows)
+  bool valid_links(const int* links, int max_links, int rows)
+  {
+    if (links[0] < 0 || links[0] > max_links)
+      return false;
+
+    for (int i = 1; i <= links[0]; ++i)
+      if (links[i] < 0 || links[i] >= rows)
+        return false;
+    return true;
+  }
+}
+
+HnswIndex::HnswIndex(const HnswParams& params)
+  : m_params(params), m_entryPoint(-1), m_maxLevel(-1)
+{
+}
+
+std::string HnswIndex::name() const
+{
+  return "HnswIndex";
+}
+
+std::string HnswIndex::params() const
+{
+  std::ostringstream text;
+  text << "M=" << m_params.M << " ef_construction=" << m_params.ef_construction;
+  return text.str();
+}
+
+void HnswIndex::reset(const cv::Mat& data)
+{
+  assert(data.type() == CV_64F);
+
+  m_data = data;
+  m_entryPoint = -1;
+  m_maxLevel = -1;
+  m_locks.reset(new std::mutex[data.rows]);
+}
+
+void HnswIndex::build(const cv::Mat& data)
+{
+  reset(data);
+
+  const int count = data.rows;
+  const double level_mult = 1 / std::log(static_cast<double>(m_params.M));
+
+  //Уровни разыгрываем заранее и последовательно, чтобы они не зависели от числа потоков.
+  //Сам граф от потоков зависит: соседи вершины - те, что успели вставиться раньше неё
+  std::mt19937 generator(count);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  m_levels.resize(count);
+  m_upperLevels.assign(count, std::vector<int>());
+  for (int i = 0; i < count; ++i)
+  {
+    m_levels[i] = static_cast<int>(-std::log(1 - uniform(generator)) * level_mult);
+    m_upperLevels[i].assign(m_levels[i] * (max_links(1) + 1), 0);
+  }
+
+  m_level0.assign(static_cast<size_t>(count) * (max_links(0) + 1), 0);
+
+  if (count == 0)
+    return;
+
+  insert(0);
+  parallel_for(count - 1, 256, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      insert(i + 1);
+  });
+}
+
+int* HnswIndex::links(int node, int layer)
+{
+  if (layer == 0)
+    return &m_level0[static_cast<size_t>(node) * (max_links(0) + 1)];
+  return &m_upperLevels[node][(layer - 1) * (max_links(1) + 1)];
+}
+
+const int* HnswIndex::links(int node, int layer) const
+{
+  return const_cast<HnswIndex*>(this)->links(node, layer);
+}
+
+double HnswIndex::distance(const double* point, int node) const
+{
+  return l2_squared(point, m_data.ptr<double>(node), m_data.cols);
+}
+
+void HnswIndex::copy_links(int node, int layer, std::vector<int>& result, bool locked) const
+{
+  std::unique_lock<std::mutex> lock(m_locks[node], std::defer_lock);
+  if (locked)
+    lock.lock();
+
+  const int* node_links = links(node, layer);
+  result.assign(node_links + 1, node_links + 1 + node_links[0]);
+}
+
+HnswIndex::Candidate HnswIndex::greedy_descent(const double* point, Candidate current,
+                                               int from_layer, int to_layer, bool locked) const
+{
+  std::vector<int> neighbours;
+  for (int layer = from_layer; layer > to_layer; --layer)
+  {
+    bool changed = true;
+    while (changed)
+    {
+      changed = false;
+      copy_links(current.second, layer, neighbours, locked);
+      for (int neighbour : neighbours)
+      {
+        const double dist = distance(point, neighbour);
+        if (dist < current.first)
+        {
+          current = Candidate(dist, neighbour);
+          changed = true;
+        }
+      }
+    }
+  }
+  return current;
+}
+
+std::vector<HnswIndex::Candidate> HnswIndex::search_layer(const double* point, const std::vector<Candidate>& entry_points,
+                                                          int ef, int layer, bool locked) const
+{
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+  std::priority_queue<Candidate> found;
+
+  visited.start(m_data.rows);
+  for (const Candidate& entry : entry_points)
+  {
+    if (!visited.visit(entry.second))
+      continue;
+    candidates.push(entry);
+    found.push(entry);
+    if (static_cast<int>(found.size()) > ef)
+      found.pop();
+  }
+
+  std::vector<int> neighbours;
+  while (!candidates.empty())
+  {
+    const Candidate current = candidates.top();
+    if (current.first > found.top().first && static_cast<int>(found.size()) >= ef)
+      break;
+    candidates.pop();
+
+    copy_links(current.second, layer, neighbours, locked);
+    for (int neighbour : neighbours)
+    {
+      if (!visited.visit(neighbour))
+        continue;
+
+      const double dist = distance(point, neighbour);
+      if (static_cast<int>(found.size()) < ef || dist < found.top().first)
+      {
+        candidates.push(Candidate(dist, neighbour));
+        found.push(Candidate(dist, neighbour));
+        if (static_cast<int>(found.size()) > ef)
+          found.pop();
+      }
+    }
+  }
+
+  std::vector<Candidate> result(found.size());
+  for (size_t i = result.size(); i > 0; --i)
+  {
+    result[i - 1] = found.top();
+    found.pop();
+  }
+  return result;
+}
+
+void HnswIndex::select_neighbours(std::vector<Candidate>& candidates, int count) const
+{
+  std::sort(candidates.begin(), candidates.end());
+
+  std::vector<Candidate> selected;
+  for (const Candidate& candidate : candidates)
+  {
+    if (static_cast<int>(selected.size()) >= count)
+      break;
+
+    const double* point = m_data.ptr<double>(candidate.second);
+    bool good = true;
+    for (const Candidate& other : selected)
+    {
+      if (distance(point, other.second) < candidate.first)
+      {
+        good = false;
+        break;
+      }
+    }
+
+    if (good)
+      selected.push_back(candidate);
+  }
+
+  candidates.swap(selected);
+}
+
+void HnswIndex::connect(int node, const Candidate& neighbour, int layer)
+{
+  std::lock_guard<std::mutex> lock(m_locks[node]);
+
+  int* node_links = links(node, layer);
+  const int size = node_links[0];
+  if (std::find(node_links + 1, node_links + 1 + size, neighbour.second) != node_links + 1 + size)
+    return;
+
+  if (size < max_links(layer))
+  {
+    node_links[1 + size] = neighbour.second;
+    ++node_links[0];
+    return;
+  }
+
+  //Список переполнен - заново выбираем соседей среди старых и нового
+  const double* point = m_data.ptr<double>(node);
+  std::vector<Candidate> candidates(1, neighbour);
+  for (int i = 1; i <= size; ++i)
+    candidates.push_back(Candidate(distance(point, node_links[i]), node_links[i]));
+
+  select_neighbours(candidates, max_links(layer));
+
+  node_links[0] = candidates.size();
+  for (size_t i = 0; i < candidates.size(); ++i)
+    node_links[1 + i] = candidates[i].second;
+}
+
+void HnswIndex::insert(int node)
+{
+  const double* point = m_data.ptr<double>(node);
+  const int level = m_levels[node];
+
+  //Если вершина станет новой точкой входа, держим блокировку до конца вставки
+  std::unique_lock<std::mutex> entry_lock(m_entryLock);
+  const int entry_point = m_entryPoint;
+  const int max_level = m_maxLevel;
+  if (entry_point != -1 && level <= max_level)
+    entry_lock.unlock();
+
+  if (entry_point == -1)
+  {
+    m_entryPoint = node;
+    m_maxLevel = level;
+    return;
+  }
+
+  Candidate current = greedy_descent(point, Candidate(distance(point, entry_point), entry_point), max_level, level, true);
+
+  std::vector<Candidate> entry_points(1, current);
+  for (int layer = std::min(level, max_level); layer >= 0; --layer)
+  {
+    std::vector<Candidate> found = search_layer(point, entry_points, m_params.ef_construction, layer, true);
+
+    std::vector<Candidate> neighbours = found;
+    select_neighbours(neighbours, m_params.M);
+
+    for (const Candidate& neighbour : neighbours)
+    {
+      connect(node, neighbour, layer);
+      connect(neighbour.second, Candidate(neighbour.first, node), layer);
+    }
+
+    entry_points.swap(found);
+  }
+
+  if (level > max_level)
+  {
+    m_entryPoint = node;
+    m_maxLevel = level;
+  }
+}
+
+void HnswIndex::knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                          std::vector<double>& distances, int knn) const
+{
+  assert(static_cast<int>(query.size()) == m_data.cols);
+
+  indices.assign(knn, -1);
+  distances.assign(knn, std::numeric_limits<double>::max());
+  if (m_entryPoint == -1)
+    return;
+
+  const double* point = query.data();
+  Candidate current = greedy_descent(point, Candidate(distance(point, m_entryPoint), m_entryPoint), m_maxLevel, 0, false);
+
+  std::vector<Candidate> found = search_layer(point, std::vector<Candidate>(1, current),
+                                              std::max(m_params.ef_search, knn), 0, false);
+
+  for (int i = 0; i < knn && i < static_cast<int>(found.size()); ++i)
+  {
+    indices[i] = found[i].second;
+    distances[i] = found[i].first;
+  }
+}
+
+void HnswIndex::save(std::ostream& stream) const
+{
+  write_pod(stream, HNSW_MAGIC);
+  write_pod(stream, HNSW_VERSION);
+  write_pod(stream, m_params);
+  write_pod(stream, m_entryPoint);
+  write_pod(stream, m_maxLevel);
+
+  write_vector(stream, m_levels);
+  write_vector(stream, m_level0);
+  for (const std::vector<int>& upper : m_upperLevels)
+    stream.write(reinterpret_cast<const char*>(upper.data()), upper.size() * sizeof(int));
+}
+
+bool HnswIndex::load(std::istream& stream, const cv::Mat& data)
+{
+  uint32_t magic = 0, version = 0;
+  HnswParams params;
+  if (!read_pod(stream, magic) || !read_pod(stream, version) || !read_pod(stream, params))
+    return false;
+
+  if (magic != HNSW_MAGIC || version != HNSW_VERSION || params.M != m_params.M
+      || params.ef_construction != m_params.ef_construction)
+    return false;
+
+  reset(data);
+  if (!read_pod(stream, m_entryPoint) || !read_pod(stream, m_maxLevel)
+      || !read_vector(stream, m_levels) || !read_vector(stream, m_level0))
+    return fail_load();
+
+  //Поиск ходит по этим массивам без проверок, поэтому испорченный файл отсекается здесь
+  const int rows = data.rows;
+  if (static_cast<int>(m_levels.size()) != rows
+      || m_level0.size() != static_cast<size_t>(rows) * (max_links(0) + 1))
+    return fail_load();
+
+  if (rows == 0 ? m_entryPoint != -1 || m_maxLevel != -1
+                : m_entryPoint < 0 || m_entryPoint >= rows || m_maxLevel < 0 || m_levels[m_entryPoint] != m_maxLevel)
+    return fail_load();
+
+  m_upperLevels.assign(rows, std::vector<int>());
+  for (int i = 0; i < rows; ++i)
+  {
+    if (m_levels[i] < 0 || m_levels[i] > m_maxLevel)
+      return fail_load();
+
+    m_upperLevels[i].resize(m_levels[i] * (max_links(1) + 1));
+    if (!stream.read(reinterpret_cast<char*>(m_upperLevels[i].data()), m_upperLevels[i].size() * sizeof(int)))
+      return fail_load();
+  }
+
+  for (int i = 0; i < rows; ++i)
+    for (int layer = 0; layer <= m_levels[i]; ++layer)
+      if (!valid_links(links(i, layer), max_links(layer), rows))
+        return fail_load();
+
+  return true;
+}
+
+bool HnswIndex::fail_load()
+{
+  m_entryPoint = -1;
+  m_maxLevel = -1;
+  m_levels.clear();
+  m_level0.clear();
+  m_upperLevels.clear();
+  return false;
+}
+
+size_t HnswIndex::memory_usage() const
+{
+  size_t result = (m_levels.size() + m_level0.size()) * sizeof(int);
+  for (const std::vector<int>& upper : m_upperLevels)
+    result += sizeof(upper) + upper.size() * sizeof(int);
+  return result;
+}
@@ -0,0 +1,101 @@
+#ifndef HNSWINDEX_H
+#define HNSWINDEX_H
+
+#include "knnindex.h"
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+struct HnswParams
+{
+  HnswParams(int M = 16, int ef_construction = 200, int ef_search = 64)
+    : M(M), ef_construction(ef_construction), ef_search(ef_search)
+  {
+  }
+
+  //Число связей вершины на верхних слоях, на нулевом - 2 * M
+  int M;
+  int ef_construction;
+  int ef_search;
+};
+
+//Иерархический граф малого мира (HNSW, Malkov & Yashunin).
+//Строится параллельно: вершины вставляются из всех потоков, списки связей защищены
+//мьютексами отдельных вершин. Порядок вставки при этом задаёт планировщик, так что
+//при нескольких потоках граф (и точность поиска) от запуска к запуску немного разный.
+class HnswIndex : public KnnIndex
+{
+public:
+  HnswIndex(const HnswParams& params = HnswParams());
+
+  std::string name() const;
+
+  std::string params() const;
+
+  void build(const cv::Mat& data);
+
+  void knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                 std::vector<double>& distances, int knn) const;
+
+  void save(std::ostream& stream) const;
+
+  bool load(std::istream& stream, const cv::Mat& data);
+
+  size_t memory_usage() const;
+
+  void set_ef_search(int ef_search)
+  {
+    m_params.ef_search = ef_search;
+  }
+
+private:
+  typedef std::pair<double, int> Candidate;
+
+  void reset(const cv::Mat& data);
+
+  //Оставить пустой индекс после неудачного load
+  bool fail_load();
+
+  void insert(int node);
+
+  void connect(int node, const Candidate& neighbour, int layer);
+
+  //Жадный поиск ef ближайших на слое layer, результат отсортирован по возрастанию
+  std::vector<Candidate> search_layer(const double* point, const std::vector<Candidate>& entry_points,
+                                      int ef, int layer, bool locked) const;
+
+  //Эвристика выбора соседей: кандидат берётся, только если он ближе к point,
+  //чем к любому уже выбранному соседу
+  void select_neighbours(std::vector<Candidate>& candidates, int count) const;
+
+  Candidate greedy_descent(const double* point, Candidate current, int from_layer, int to_layer, bool locked) const;
+
+  void copy_links(int node, int layer, std::vector<int>& result, bool locked) const;
+
+  int* links(int node, int layer);
+  const int* links(int node, int layer) const;
+
+  double distance(const double* point, int node) const;
+
+  int max_links(int layer) const
+  {
+    return layer == 0 ? 2 * m_params.M : m_params.M;
+  }
+
+  HnswParams m_params;
+  cv::Mat m_data;
+
+  //Вершина на слое: [число связей, связи...]
+  std::vector<int> m_levels;
+  std::vector<int> m_level0;
+  std::vector<std::vector<int>> m_upperLevels;
+
+  std::unique_ptr<std::mutex[]> m_locks;
+  std::mutex m_entryLock;
+  int m_entryPoint;
+  int m_maxLevel;
+};
+
+#endif // HNSWINDEX_H
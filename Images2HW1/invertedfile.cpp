@@ -0,0 +1,186 @@
+#include "invertedfile.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+  void write_varint(std::vector<uint8_t>& buffer, uint32_t value)
+  {
+    while (value >= 0x80)
+    {
+      buffer.push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(value));
+  }
+
+  uint32_t read_varint(const uint8_t*& position)
+  {
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+      const uint8_t byte = *position++;
+      value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if (byte < 0x80)
+        return value;
+    }
+  }
+
+  //Оценки по картинкам для одного потока, обнуляются только тронутые
+  struct Scores
+  {
+    std::vector<float> values;
+    std::vector<int> touched;
+  };
+
+  thread_local Scores scores;
+
+  //Обойти список слова: visit(картинка, число вхождений)
+  template <class Visit>
+  void for_each_posting(const std::vector<uint8_t>& posting, Visit visit)
+  {
+    const uint8_t* position = posting.data();
+    const uint8_t* end = position + posting.size();
+
+    int image = 0;
+    while (position < end)
+    {
+      image += read_varint(position);
+      visit(image, read_varint(position));
+    }
+  }
+}
+
+InvertedFile::InvertedFile(int words)
+  : m_postings(words), m_last(words, 0), m_documentFrequency(words, 0), m_images(0)
+{
+}
+
+std::vector<std::pair<int, int>> InvertedFile::histogram(std::vector<int> words)
+{
+  std::sort(words.begin(), words.end());
+
+  std::vector<std::pair<int, int>> result;
+  for (int word : words)
+  {
+    if (!result.empty() && result.back().first == word)
+      ++result.back().second;
+    else
+      result.push_back(std::make_pair(word, 1));
+  }
+  return result;
+}
+
+int InvertedFile::add_image(const std::vector<int>& words)
+{
+  const int image = m_images++;
+
+  for (const std::pair<int, int>& entry : histogram(words))
+  {
+    assert(entry.first >= 0 && entry.first < static_cast<int>(m_postings.size()));
+
+    write_varint(m_postings[entry.first], image - m_last[entry.first]);
+    write_varint(m_postings[entry.first], entry.second);
+    m_last[entry.first] = image;
+    ++m_documentFrequency[entry.first];
+  }
+
+  return image;
+}
+
+void InvertedFile::finalize()
+{
+  const int words = m_postings.size();
+
+  m_idf.assign(words, 0);
+  for (int word = 0; word < words; ++word)
+    if (m_documentFrequency[word] > 0)
+      m_idf[word] = std::log(static_cast<double>(m_images) / m_documentFrequency[word]);
+
+  //Квадраты норм копятся по спискам, поэтому без блокировок это один поток
+  std::vector<double> squares(m_images, 0);
+  for (int word = 0; word < words; ++word)
+  {
+    const double idf = m_idf[word];
+    for_each_posting(m_postings[word], [&](int image, int count) {
+      squares[image] += (count * idf) * (count * idf);
+    });
+  }
+
+  m_norms.resize(m_images);
+  for (int image = 0; image < m_images; ++image)
+    m_norms[image] = squares[image] > 0 ? std::sqrt(squares[image]) : 1.0f;
+
+  for (std::vector<uint8_t>& posting : m_postings)
+    posting.shrink_to_fit();
+}
+
+std::vector<InvertedFile::Match> InvertedFile::query(const std::vector<int>& words, int knn) const
+{
+  assert(m_norms.size() == static_cast<size_t>(m_images));
+
+  scores.values.resize(m_images, 0);
+
+  std::vector<std::pair<int, int>> query_histogram = histogram(words);
+  double query_norm = 0;
+  for (const std::pair<int, int>& entry : query_histogram)
+  {
+    const double weight = entry.second * m_idf[entry.first];
+    query_norm += weight * weight;
+  }
+  query_norm = query_norm > 0 ? std::sqrt(query_norm) : 1;
+
+  for (const std::pair<int, int>& entry : query_histogram)
+  {
+    const double idf = m_idf[entry.first];
+    if (idf == 0)
+      continue;
+
+    const float query_weight = entry.second * idf * idf;
+    for_each_posting(m_postings[entry.first], [&](int image, int count) {
+      if (scores.values[image] == 0)
+        scores.touched.push_back(image);
+      scores.values[image] += query_weight * count;
+    });
+  }
+
+  std::vector<Match> result;
+  result.reserve(scores.touched.size());
+  for (int image : scores.touched)
+  {
+    result.push_back(Match(scores.values[image] / (m_norms[image] * query_norm), image));
+    scores.values[image] = 0;
+  }
+  scores.touched.clear();
+
+  const size_t count = std::min<size_t>(knn, result.size());
+  std::partial_sort(result.begin(), result.begin() + count, result.end(),
+                    [](const Match& a, const Match& b) { return a.first > b.first; });
+  result.resize(count);
+
+  return result;
+}
+
+std::vector<std::vector<InvertedFile::Match>> InvertedFile::query(const std::vector<std::vector<int>>& queries,
+                                                                  int knn) const
+{
+  std::vector<std::vector<Match>> result(queries.size());
+  parallel_for(queries.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      result[i] = query(queries[i], knn);
+  });
+
+  return result;
+}
+
+size_t InvertedFile::memory_usage() const
+{
+  size_t result = (m_last.size() + m_documentFrequency.size()) * sizeof(int)
+                + (m_idf.size() + m_norms.size()) * sizeof(float);
+  for (const std::vector<uint8_t>& posting : m_postings)
+    result += sizeof(posting) + posting.capacity();
+  return result;
+}
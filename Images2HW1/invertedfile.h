@@ -0,0 +1,60 @@
+#ifndef INVERTEDFILE_H
+#define INVERTEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+//Инвертированный файл по визуальным словам с весами tf-idf.
+//Для каждого слова хранится список картинок, где оно встречается: разность номера
+//картинки с предыдущей в списке и число вхождений, оба как varint. На запрос
+//просматриваются только списки слов запроса, оценка - косинус tf-idf векторов.
+class InvertedFile
+{
+public:
+  //Оценка и номер картинки
+  typedef std::pair<double, int> Match;
+
+  InvertedFile(int words);
+
+  //Добавить картинку по словам её дескрипторов. Номера картинок идут подряд с нуля
+  int add_image(const std::vector<int>& words);
+
+  //Посчитать idf и нормы картинок. Вызывается после всех add_image
+  void finalize();
+
+  //knn картинок с наибольшей оценкой, по убыванию
+  std::vector<Match> query(const std::vector<int>& words, int knn) const;
+
+  //Запросы обрабатываются параллельно
+  std::vector<std::vector<Match>> query(const std::vector<std::vector<int>>& queries, int knn) const;
+
+  int images() const
+  {
+    return m_images;
+  }
+
+  int words() const
+  {
+    return m_postings.size();
+  }
+
+  size_t memory_usage() const;
+
+private:
+  //Гистограмма слов: пары (слово, число вхождений) по возрастанию слова
+  static std::vector<std::pair<int, int>> histogram(std::vector<int> words);
+
+  std::vector<std::vector<uint8_t>> m_postings;
+  //Номер последней картинки в каждом списке, от него считается следующая разность
+  std::vector<int> m_last;
+  std::vector<int> m_documentFrequency;
+
+  std::vector<float> m_idf;
+  std::vector<float> m_norms;
+
+  int m_images;
+};
+
+#endif // INVERTEDFILE_H
@@ -0,0 +1,332 @@
+#include "ivfpqindex.h"
+#include "distance.h"
+#include "exactknn.h"
+#include "neighbours.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  const uint32_t IVFPQ_MAGIC = 0x51504649; // "IFPQ"
+  const uint32_t IVFPQ_VERSION = 1;
+
+  //Сколько строк кодировать за раз при добавлении
+  const int ADD_CHUNK = 65536;
+
+  cv::Mat sample_rows(const cv::Mat& data, int count)
+  {
+    count = std::min(count, data.rows);
+
+    std::vector<int> rows(data.rows);
+    std::iota(rows.begin(), rows.end(), 0);
+
+    std::mt19937 generator(data.rows);
+    for (int i = 0; i < count; ++i)
+      std::swap(rows[i], rows[std::uniform_int_distribution<int>(i, data.rows - 1)(generator)]);
+
+    cv::Mat result(count, data.cols, CV_64F);
+    for (int i = 0; i < count; ++i)
+      std::copy(data.ptr<double>(rows[i]), data.ptr<double>(rows[i]) + data.cols, result.ptr<double>(i));
+
+    return result;
+  }
+
+  //cv::kmeans умеет только float
+  cv::Mat kmeans_centers(const cv::Mat& samples, int k)
+  {
+    cv::Mat float_samples, labels, centers;
+    samples.convertTo(float_samples, CV_32F);
+
+    cv::kmeans(float_samples, k, labels, cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 10, 1e-4),
+               1, cv::KMEANS_PP_CENTERS, centers);
+
+    centers.convertTo(centers, CV_64F);
+    return centers;
+  }
+}
+
+IvfPqIndex::IvfPqIndex(const IvfPqParams& params)
+  : m_params(params), m_dim(0), m_subDim(0)
+{
+}
+
+std::string IvfPqIndex::name() const
+{
+  return m_params.rerank > 0 ? "IvfPqRerankIndex" : "IvfPqIndex";
+}
+
+std::string IvfPqIndex::params() const
+{
+  std::ostringstream text;
+  text << "lists=" << m_params.lists << " sub_vectors=" << m_params.sub_vectors
+       << " train_size=" << m_params.train_size;
+  return text.str();
+}
+
+void IvfPqIndex::build(const cv::Mat& data)
+{
+  assert(data.type() == CV_64F);
+
+  m_data = data;
+  train(sample_rows(data, m_params.train_size));
+  add(data, 0);
+}
+
+std::vector<int> IvfPqIndex::assign(const cv::Mat& rows) const
+{
+  ExactKnnIndex coarse(m_centroids);
+  cv::Mat indices, distances;
+  coarse.knnSearch(rows, indices, distances, 1);
+
+  return std::vector<int>(indices.ptr<int>(0), indices.ptr<int>(0) + rows.rows);
+}
+
+void IvfPqIndex::train(const cv::Mat& sample)
+{
+  assert(sample.type() == CV_64F);
+  assert(sample.cols % m_params.sub_vectors == 0);
+  assert(sample.rows >= std::max(m_params.lists, CODEBOOK_SIZE));
+
+  m_dim = sample.cols;
+  m_subDim = m_dim / m_params.sub_vectors;
+
+  m_centroids = kmeans_centers(sample, m_params.lists);
+
+  //Квантователи кусков учим на остатках относительно грубых центров
+  std::vector<int> assignment = assign(sample);
+  cv::Mat residuals(sample.rows, m_dim, CV_64F);
+  for (int i = 0; i < sample.rows; ++i)
+  {
+    const double* row = sample.ptr<double>(i);
+    const double* centroid = m_centroids.ptr<double>(assignment[i]);
+    double* residual = residuals.ptr<double>(i);
+    for (int j = 0; j < m_dim; ++j)
+      residual[j] = row[j] - centroid[j];
+  }
+
+  m_codebooks.resize(m_params.sub_vectors * CODEBOOK_SIZE * m_subDim);
+  parallel_for(m_params.sub_vectors, 1, [&](size_t begin, size_t end) {
+    for (size_t sub = begin; sub < end; ++sub)
+    {
+      cv::Mat columns(residuals, cv::Range::all(), cv::Range(sub * m_subDim, (sub + 1) * m_subDim));
+      cv::Mat centers = kmeans_centers(columns, CODEBOOK_SIZE);
+
+      double* codebook = &m_codebooks[sub * CODEBOOK_SIZE * m_subDim];
+      for (int c = 0; c < CODEBOOK_SIZE; ++c)
+        std::copy(centers.ptr<double>(c), centers.ptr<double>(c) + m_subDim, codebook + c * m_subDim);
+    }
+  });
+
+  m_listIds.assign(m_params.lists, std::vector<int>());
+  m_listCodes.assign(m_params.lists, std::vector<uint8_t>());
+}
+
+void IvfPqIndex::encode(const double* residual, uint8_t* code) const
+{
+  for (int sub = 0; sub < m_params.sub_vectors; ++sub)
+  {
+    const double* part = residual + sub * m_subDim;
+    const double* codebook = &m_codebooks[sub * CODEBOOK_SIZE * m_subDim];
+
+    int best = 0;
+    double best_distance = std::numeric_limits<double>::max();
+    for (int c = 0; c < CODEBOOK_SIZE; ++c)
+    {
+      const double distance = l2_squared(part, codebook + c * m_subDim, m_subDim);
+      if (distance < best_distance)
+      {
+        best_distance = distance;
+        best = c;
+      }
+    }
+
+    code[sub] = static_cast<uint8_t>(best);
+  }
+}
+
+void IvfPqIndex::add(const cv::Mat& rows, int first_index)
+{
+  assert(rows.type() == CV_64F && rows.cols == m_dim);
+
+  const int code_size = m_params.sub_vectors;
+  std::vector<uint8_t> codes;
+
+  for (int chunk_begin = 0; chunk_begin < rows.rows; chunk_begin += ADD_CHUNK)
+  {
+    const int chunk_end = std::min(rows.rows, chunk_begin + ADD_CHUNK);
+    cv::Mat chunk(rows, cv::Range(chunk_begin, chunk_end), cv::Range::all());
+
+    std::vector<int> assignment = assign(chunk);
+    codes.resize(chunk.rows * code_size);
+
+    parallel_for(chunk.rows, 256, [&](size_t begin, size_t end) {
+      std::vector<double> residual(m_dim);
+      for (size_t i = begin; i < end; ++i)
+      {
+        const double* row = chunk.ptr<double>(i);
+        const double* centroid = m_centroids.ptr<double>(assignment[i]);
+        for (int j = 0; j < m_dim; ++j)
+          residual[j] = row[j] - centroid[j];
+
+        encode(residual.data(), &codes[i * code_size]);
+      }
+    });
+
+    for (int i = 0; i < chunk.rows; ++i)
+    {
+      const int list = assignment[i];
+      m_listIds[list].push_back(first_index + chunk_begin + i);
+      m_listCodes[list].insert(m_listCodes[list].end(), &codes[i * code_size], &codes[(i + 1) * code_size]);
+    }
+  }
+}
+
+void IvfPqIndex::knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                           std::vector<double>& distances, int knn) const
+{
+  assert(static_cast<int>(query.size()) == m_dim);
+
+  const int sub_vectors = m_params.sub_vectors;
+  const int probes = std::min(m_params.probes, m_params.lists);
+  const bool rerank = m_params.rerank > 0 && !m_data.empty();
+  const size_t candidates = rerank ? std::max(m_params.rerank, knn) : knn;
+
+  std::vector<Neighbour> coarse(m_params.lists);
+  for (int list = 0; list < m_params.lists; ++list)
+    coarse[list] = Neighbour(l2_squared(query.data(), m_centroids.ptr<double>(list), m_dim), list);
+  std::partial_sort(coarse.begin(), coarse.begin() + probes, coarse.end());
+
+  std::vector<double> residual(m_dim);
+  std::vector<double> table(sub_vectors * CODEBOOK_SIZE);
+  NeighbourHeap heap;
+
+  for (int probe = 0; probe < probes; ++probe)
+  {
+    const int list = coarse[probe].second;
+    const std::vector<int>& ids = m_listIds[list];
+    if (ids.empty())
+      continue;
+
+    //Таблица расстояний от остатка запроса до всех слов всех квантователей
+    const double* centroid = m_centroids.ptr<double>(list);
+    for (int j = 0; j < m_dim; ++j)
+      residual[j] = query[j] - centroid[j];
+
+    for (int sub = 0; sub < sub_vectors; ++sub)
+    {
+      const double* part = residual.data() + sub * m_subDim;
+      const double* codebook = &m_codebooks[sub * CODEBOOK_SIZE * m_subDim];
+      for (int c = 0; c < CODEBOOK_SIZE; ++c)
+        table[sub * CODEBOOK_SIZE + c] = l2_squared(part, codebook + c * m_subDim, m_subDim);
+    }
+
+    const uint8_t* code = m_listCodes[list].data();
+    for (size_t i = 0; i < ids.size(); ++i, code += sub_vectors)
+    {
+      double distance = 0;
+      for (int sub = 0; sub < sub_vectors; ++sub)
+        distance += table[sub * CODEBOOK_SIZE + code[sub]];
+
+      push_neighbour(heap, candidates, distance, ids[i]);
+    }
+  }
+
+  if (rerank)
+  {
+    NeighbourHeap exact;
+    for (const Neighbour& candidate : heap)
+      push_neighbour(exact, knn, l2_squared(query.data(), m_data.ptr<double>(candidate.second), m_dim), candidate.second);
+    heap.swap(exact);
+  }
+
+  std::sort_heap(heap.begin(), heap.end());
+
+  indices.assign(knn, -1);
+  distances.assign(knn, std::numeric_limits<double>::max());
+  for (int i = 0; i < knn && i < static_cast<int>(heap.size()); ++i)
+  {
+    indices[i] = heap[i].second;
+    distances[i] = heap[i].first;
+  }
+}
+
+void IvfPqIndex::save(std::ostream& stream) const
+{
+  write_pod(stream, IVFPQ_MAGIC);
+  write_pod(stream, IVFPQ_VERSION);
+  write_pod(stream, m_params.lists);
+  write_pod(stream, m_params.sub_vectors);
+  write_pod(stream, m_dim);
+
+  for (int list = 0; list < m_params.lists; ++list)
+    stream.write(reinterpret_cast<const char*>(m_centroids.ptr<double>(list)), m_dim * sizeof(double));
+
+  write_vector(stream, m_codebooks);
+  for (int list = 0; list < m_params.lists; ++list)
+  {
+    write_vector(stream, m_listIds[list]);
+    write_vector(stream, m_listCodes[list]);
+  }
+}
+
+bool IvfPqIndex::load(std::istream& stream, const cv::Mat& data)
+{
+  uint32_t magic = 0, version = 0;
+  int lists = 0, sub_vectors = 0, dim = 0;
+  if (!read_pod(stream, magic) || !read_pod(stream, version) || !read_pod(stream, lists)
+      || !read_pod(stream, sub_vectors) || !read_pod(stream, dim))
+    return false;
+
+  if (magic != IVFPQ_MAGIC || version != IVFPQ_VERSION || lists != m_params.lists
+      || sub_vectors != m_params.sub_vectors || dim != data.cols || sub_vectors <= 0 || dim % sub_vectors != 0)
+    return false;
+
+  m_data = data;
+  m_dim = dim;
+  m_subDim = dim / sub_vectors;
+
+  m_centroids.create(lists, dim, CV_64F);
+  for (int list = 0; list < lists; ++list)
+    if (!stream.read(reinterpret_cast<char*>(m_centroids.ptr<double>(list)), dim * sizeof(double)))
+      return false;
+
+  if (!read_vector(stream, m_codebooks)
+      || m_codebooks.size() != static_cast<size_t>(sub_vectors) * CODEBOOK_SIZE * m_subDim)
+    return false;
+
+  m_listIds.assign(lists, std::vector<int>());
+  m_listCodes.assign(lists, std::vector<uint8_t>());
+
+  //Поиск читает коды и исходные строки по этим номерам без проверок
+  size_t total = 0;
+  for (int list = 0; list < lists; ++list)
+  {
+    if (!read_vector(stream, m_listIds[list]) || !read_vector(stream, m_listCodes[list]))
+      return false;
+
+    const std::vector<int>& ids = m_listIds[list];
+    if (m_listCodes[list].size() != ids.size() * sub_vectors)
+      return false;
+    for (int id : ids)
+      if (id < 0 || id >= data.rows)
+        return false;
+
+    total += ids.size();
+  }
+
+  return total == static_cast<size_t>(data.rows);
+}
+
+size_t IvfPqIndex::memory_usage() const
+{
+  size_t result = m_centroids.total() * sizeof(double) + m_codebooks.size() * sizeof(double);
+  for (size_t list = 0; list < m_listIds.size(); ++list)
+    result += m_listIds[list].size() * sizeof(int) + m_listCodes[list].size();
+  return result;
+}
@@ -0,0 +1,80 @@
+#ifndef IVFPQINDEX_H
+#define IVFPQINDEX_H
+
+#include "knnindex.h"
+
+#include <cstdint>
+#include <vector>
+
+struct IvfPqParams
+{
+  IvfPqParams(int lists = 1024, int probes = 32, int sub_vectors = 50, int rerank = 0, int train_size = 65536)
+    : lists(lists), probes(probes), sub_vectors(sub_vectors), rerank(rerank), train_size(train_size)
+  {
+  }
+
+  //Число центров грубого квантователя и сколько ближайших списков просматривать
+  int lists;
+  int probes;
+  //На сколько кусков режется вектор, каждый кодируется одним байтом
+  int sub_vectors;
+  //Сколько лучших по PQ кандидатов пересчитать точно по исходным данным, 0 - не пересчитывать
+  int rerank;
+  //Размер случайной выборки для обучения квантователей
+  int train_size;
+};
+
+//Инвертированный файл с произведением квантователей (IVFADC, Jegou et al.).
+//Вектор хранится как номер грубого центра + sub_vectors байт кода остатка.
+//На запрос для каждого просматриваемого списка строится таблица расстояний
+//sub_vectors x 256, и расстояние до кода - это сумма sub_vectors чисел из таблицы.
+class IvfPqIndex : public KnnIndex
+{
+public:
+  IvfPqIndex(const IvfPqParams& params = IvfPqParams());
+
+  std::string name() const;
+
+  std::string params() const;
+
+  void build(const cv::Mat& data);
+
+  void knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                 std::vector<double>& distances, int knn) const;
+
+  void save(std::ostream& stream) const;
+
+  bool load(std::istream& stream, const cv::Mat& data);
+
+  size_t memory_usage() const;
+
+  //Обучить квантователи на выборке. После этого индекс пуст, векторы добавляются add
+  void train(const cv::Mat& sample);
+
+  //Добавить строки rows под номерами first_index, first_index + 1, ...
+  void add(const cv::Mat& rows, int first_index);
+
+  static const int CODEBOOK_SIZE = 256;
+
+private:
+  //Номер ближайшего грубого центра для каждой строки rows
+  std::vector<int> assign(const cv::Mat& rows) const;
+
+  void encode(const double* residual, uint8_t* code) const;
+
+  IvfPqParams m_params;
+  cv::Mat m_data;
+
+  int m_dim;
+  int m_subDim;
+
+  //lists x dim
+  cv::Mat m_centroids;
+  //sub_vectors x CODEBOOK_SIZE x sub_dim, подряд
+  std::vector<double> m_codebooks;
+
+  std::vector<std::vector<int>> m_listIds;
+  std::vector<std::vector<uint8_t>> m_listCodes;
+};
+
+#endif // IVFPQINDEX_H
@@ -1,12 +1,25 @@
 #include "knnfinder.h"
+#include "checksum.h"
+#include "exactknn.h"
+#include "neighbours.h"
+#include "parallel.h"
 
 #include <chrono>
 #include <memory>
 #include <cassert>
 #include <fstream>
 #include <random>
+#include <sstream>
+#include <cstdio>
 
 #include <QtGui/QApplication>
+#include <QtCore/QDir>
+
+//Строк в одном куске при подсчёте отпечатка
+const size_t FINGERPRINT_CHUNK = 4096;
+
+//Строк в куске, который держим в памяти при работе без загрузки всех данных
+const size_t OUT_OF_CORE_CHUNK = 16384;
 
 KnnFinder::KnnFinder(cv::Mat&& data) : m_data(std::move(data))
 {
@@ -17,6 +30,13 @@ KnnFinder::KnnFinder(cv::Mat&& data) : m_data(std::move(data))
     }
 }
 
+KnnFinder::KnnFinder(const std::string& dataset_path)
+  : m_dataset(std::make_shared<ChunkedDataset>(dataset_path))
+{
+    if (!m_dataset->is_open())
+        std::cerr << "Couldn't open " << dataset_path << std::endl;
+}
+
 double accuracy(const std::vector<int>& rightIndices, const std::vector<int>& guessedIndices)
 {
     assert(rightIndices.size() == guessedIndices.size());
@@ -33,6 +53,203 @@ double accuracy(const std::vector<int>& rightIndices, const std::vector<int>& gu
     return guessed / right_amount;
 }
 
+cv::Mat to_mat(const std::vector<std::vector<double>>& rows)
+{
+  cv::Mat result(rows.size(), rows.empty() ? 0 : rows[0].size(), CV_64F);
+  for (size_t i = 0; i < rows.size(); ++i)
+    std::copy(rows[i].begin(), rows[i].end(), result.ptr<double>(i));
+  return result;
+}
+
+//Точные ответы для всех запросов одним пакетом
+std::vector<std::vector<int>> exact_answers(std::ostream& log, const cv::Mat& data,
+                                            const std::vector<std::vector<double>>& queries, int knn)
+{
+  using namespace std::chrono;
+
+  ExactKnnIndex exact(data);
+  cv::Mat indices, distances;
+
+  steady_clock::time_point now = steady_clock::now();
+  exact.knnSearch(to_mat(queries), indices, distances, knn);
+  steady_clock::time_point after = steady_clock::now();
+
+  duration<double> time_span = duration_cast<duration<double>>(after - now);
+  log << "ExactIndex search took " << time_span.count() / queries.size() << " seconds per query" << std::endl;
+
+  std::vector<std::vector<int>> result(queries.size());
+  for (size_t i = 0; i < queries.size(); ++i)
+    result[i].assign(indices.ptr<int>(i), indices.ptr<int>(i) + knn);
+
+  return result;
+}
+
+uint64_t KnnFinder::fingerprint(size_t rows, const std::string& params)
+{
+  assert(rows <= static_cast<size_t>(m_data.rows));
+  const size_t row_bytes = m_data.cols * m_data.elemSize();
+
+  //Хэши кусков считаем один раз для всех данных, отпечаток префикса собирается из них
+  if (m_chunkHashes.empty())
+  {
+    m_chunkHashes.resize(m_data.rows / FINGERPRINT_CHUNK);
+    parallel_for(m_chunkHashes.size(), 1, [&](size_t begin, size_t end) {
+      for (size_t chunk = begin; chunk < end; ++chunk)
+        m_chunkHashes[chunk] = fnv1a(m_data.ptr(chunk * FINGERPRINT_CHUNK), FINGERPRINT_CHUNK * row_bytes);
+    });
+  }
+
+  uint64_t header[] = { rows, static_cast<uint64_t>(m_data.cols), static_cast<uint64_t>(m_data.type()) };
+  uint64_t hash = fnv1a(header, sizeof(header));
+  hash = fnv1a(params.data(), params.size(), hash);
+
+  const size_t full_chunks = rows / FINGERPRINT_CHUNK;
+  hash = fnv1a(m_chunkHashes.data(), full_chunks * sizeof(uint64_t), hash);
+
+  const size_t tail = rows - full_chunks * FINGERPRINT_CHUNK;
+  if (tail > 0)
+    hash = fnv1a(m_data.ptr(full_chunks * FINGERPRINT_CHUNK), tail * row_bytes, hash);
+
+  return hash;
+}
+
+//Параметры FLANN текстом, "ключ=значение" через пробел в порядке ключей
+std::string params_text(const cvflann::IndexParams& params)
+{
+  std::stringstream text;
+  for (const cvflann::IndexParams::value_type& param : params)
+    text << param.first << "=" << param.second << " ";
+  return text.str();
+}
+
+//Имя файлов кэша индекса без расширения. Хэш параметров в имени разводит по разным
+//файлам индексы одного типа с разными параметрами
+std::string cache_name(const std::string& index_name, const std::string& params, const cv::Mat& data)
+{
+  std::stringstream name;
+  name << INDEX_CACHE_DIRECTORY << index_name << "-" << data.rows << "x" << data.cols
+       << "-" << std::hex << fnv1a(params.data(), params.size());
+  return name.str();
+}
+
+bool fingerprint_matches(const std::string& name, uint64_t current_fingerprint)
+{
+  std::ifstream fingerprint_file(name + ".fingerprint");
+  uint64_t saved_fingerprint = 0;
+
+  return fingerprint_file >> std::hex >> saved_fingerprint && saved_fingerprint == current_fingerprint
+      && std::ifstream(name + ".idx").good();
+}
+
+//Сохранить индекс функцией save и записать отпечаток.
+//Отпечаток пишем последним: если упадём посередине сохранения, недописанный индекс не примут
+template <class Save>
+void save_with_fingerprint(const std::string& name, uint64_t current_fingerprint, Save save)
+{
+  if (!QDir().mkpath(QString::fromStdString(INDEX_CACHE_DIRECTORY)))
+    return;
+
+  const std::string fingerprint_path = name + ".fingerprint";
+  std::remove(fingerprint_path.c_str());
+  save(name + ".idx");
+
+  std::ofstream fingerprint_file(fingerprint_path);
+  fingerprint_file << std::hex << current_fingerprint << std::endl;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  using namespace std::chrono;
+  return duration_cast<duration<double>>(steady_clock::now() - start).count();
+}
+
+std::unique_ptr<FlannIndex> KnnFinder::load_or_build(const cv::Mat& data, size_t index_number, std::ostream& log)
+{
+  using namespace std::chrono;
+
+  //Линейному индексу нечего сохранять
+  const bool cacheable = index_number != 0;
+
+  const std::string index_params = params_text(*params[index_number]);
+  const std::string name = cache_name(param_names[index_number], index_params, data);
+  const uint64_t current_fingerprint = cacheable ? fingerprint(data.rows, index_params) : 0;
+
+  if (cacheable && fingerprint_matches(name, current_fingerprint))
+  {
+    steady_clock::time_point now = steady_clock::now();
+    std::unique_ptr<FlannIndex> index(new FlannIndex(data, cvflann::SavedIndexParams(name + ".idx")));
+    log << "load took " << seconds_since(now) << " seconds" << std::endl;
+    return index;
+  }
+
+  steady_clock::time_point now = steady_clock::now();
+  std::unique_ptr<FlannIndex> index(new FlannIndex(data, *params[index_number]));
+  log << "build took " << seconds_since(now) << " seconds" << std::endl;
+
+  if (cacheable)
+  {
+    save_with_fingerprint(name, current_fingerprint, [&](const std::string& path) {
+      index->save(path);
+    });
+  }
+
+  return index;
+}
+
+void KnnFinder::load_or_build(const cv::Mat& data, KnnIndex& index, std::ostream& log)
+{
+  using namespace std::chrono;
+
+  const std::string name = cache_name(index.name(), index.params(), data);
+  const uint64_t current_fingerprint = fingerprint(data.rows, index.params());
+
+  if (fingerprint_matches(name, current_fingerprint))
+  {
+    steady_clock::time_point now = steady_clock::now();
+    std::ifstream file(name + ".idx", std::ios::binary);
+    if (index.load(file, data))
+    {
+      log << "load took " << seconds_since(now) << " seconds" << std::endl;
+      return;
+    }
+  }
+
+  steady_clock::time_point now = steady_clock::now();
+  index.build(data);
+  log << "build took " << seconds_since(now) << " seconds" << std::endl;
+
+  save_with_fingerprint(name, current_fingerprint, [&](const std::string& path) {
+    std::ofstream file(path, std::ios::binary);
+    index.save(file);
+  });
+}
+
+//Среднее время одного запроса и средняя точность относительно точных ответов
+template <class Search>
+std::pair<double, double> measure_search(const std::vector<std::vector<double>>& queries,
+                                         const std::vector<std::vector<int>>& right_answers, int knn, Search search)
+{
+  using namespace std::chrono;
+
+  double time_duration = 0;
+  double current_accuracy = 0;
+
+  for (size_t times = 0; times < queries.size(); ++times)
+  {
+    std::vector<double> query = queries[times];
+    std::vector<int> indices(knn);
+    std::vector<double> distances(knn);
+
+    steady_clock::time_point now = steady_clock::now();
+    search(query, indices, distances);
+    time_duration += seconds_since(now);
+
+    current_accuracy += accuracy(right_answers[times], indices);
+  }
+
+  return std::make_pair(time_duration / queries.size(), current_accuracy / queries.size());
+}
+
 std::function<double()> make_double_rand()
 {
   std::random_device random_device;
@@ -45,7 +262,6 @@ std::function<double()> make_double_rand()
 void KnnFinder::do_different_dimensions_search()
 {
   using namespace cvflann;
-  using namespace std::chrono;
 
   const int KNN = 10;
   const int N = 100;
@@ -55,9 +271,6 @@ void KnnFinder::do_different_dimensions_search()
 
   std::function<double()> random_double = make_double_rand();
 
-  std::vector<std::vector<int>> right_answers(N);
-  std::vector<std::vector<double>> right_distances(N);
-
   for (int dimension = 500; dimension <= 500; dimension += 50)
   {
     std::vector<std::vector<double>> queries(N);
@@ -65,46 +278,40 @@ void KnnFinder::do_different_dimensions_search()
       for (int j = 0; j < dimension; ++j)
         queries[i].push_back(random_double());
 
+    cv::Mat continious_data = m_data;
+    std::vector<std::vector<int>> right_answers = exact_answers(file, continious_data, queries, KNN);
+
     for (size_t index_number = 0; index_number < params.size(); ++index_number)
     {
       file << param_names[index_number] << " " << dimension << std::endl;
 
-      cv::Mat continious_data = m_data;
-
-      cv::flann::GenericIndex<cv::flann::L2<double>> index(continious_data, *params[index_number]);
+      std::unique_ptr<FlannIndex> index = load_or_build(continious_data, index_number, file);
       std::cout << param_names[index_number] << "with D = " << dimension << " built successfully!" << std::endl;
 
-      double time_duration = 0;
-      double current_accuracy = 0;
+      std::pair<double, double> result = measure_search(queries, right_answers, KNN,
+        [&](std::vector<double>& query, std::vector<int>& indices, std::vector<double>& distances) {
+          index->knnSearch(query, indices, distances, KNN, search_params);
+        });
 
-      for (int times = 0; times < N; ++times)
-      {
-        std::vector<double> query = queries[times];
-        std::vector<int> indices(KNN);
-        std::vector<double> distances(KNN);
-
-        steady_clock::time_point now = steady_clock::now();
-        index.knnSearch(query, indices, distances, KNN, search_params);
-        steady_clock::time_point after = steady_clock::now();
-
-        if (index_number == 0)
-        {
-          right_answers[times] = indices;
-          right_distances[times] = distances;
-        }
-        else
-        {
-          current_accuracy += accuracy(right_answers[times], indices);
-        }
-
-        duration<double> time_span = duration_cast<duration<double>>(after - now);
-        time_duration += time_span.count();
-      }
+      file << "Dim: " << dimension << " time: " << result.first << " qps: " << 1 / result.first
+           << " accuracy: " << result.second << std::endl;
+    }
+
+    for (const std::shared_ptr<KnnIndex>& index : native_indices)
+    {
+      file << index->name() << " " << dimension << std::endl;
+
+      load_or_build(continious_data, *index, file);
+      std::cout << index->name() << "with D = " << dimension << " built successfully!" << std::endl;
 
-      time_duration /= N;
-      current_accuracy /= N;
+      std::pair<double, double> result = measure_search(queries, right_answers, KNN,
+        [&](std::vector<double>& query, std::vector<int>& indices, std::vector<double>& distances) {
+          index->knnSearch(query, indices, distances, KNN);
+        });
 
-      file << "Dim: " << dimension << " time: " << time_duration << " accuracy: " << current_accuracy << std::endl;
+      file << "Dim: " << dimension << " time: " << result.first << " qps: " << 1 / result.first
+           << " accuracy: " << result.second
+           << " memory per vector: " << double(index->memory_usage()) / continious_data.rows << std::endl;
     }
 
     file << "------------------------------------------" << std::endl;
@@ -113,7 +320,6 @@ void KnnFinder::do_different_dimensions_search()
 
 void KnnFinder::do_different_size_search()
 {
-  using namespace std::chrono;
   std::ofstream log("log_different_sizes.txt");
 
   cvflann::SearchParams search_params;
@@ -124,7 +330,6 @@ void KnnFinder::do_different_size_search()
   std::function<double()> random_double = make_double_rand();
 
   std::vector<std::vector<double>> queries(N);
-  std::vector<std::vector<int>> right_indices(N);
 
   for (int i = 0; i < N; ++i)
     for (int j = 0; j < 500; ++j)
@@ -136,37 +341,148 @@ void KnnFinder::do_different_size_search()
     {
       cv::Mat data(m_data, cv::Range(0, size), cv::Range(0, m_data.cols));
 
+      log << "ExactIndex with " << size << " size:" << std::endl;
+      std::vector<std::vector<int>> right_indices = exact_answers(log, data, queries, KNN);
+
       for (size_t index = 0; index < params.size(); ++index)
       {
         log << param_names[index] << " with " << size << " size:" << std::endl;
 
-        cv::flann::GenericIndex<cvflann::L2<double>> generic_index(data, *params[index]);
+        std::unique_ptr<FlannIndex> generic_index = load_or_build(data, index, log);
 
-        double duration = 0;
-        double current_accuracy = 0;
-        for (int times = 0; times < N; ++times)
-        {
-          std::vector<double> query = queries[times];
-          std::vector<int> indices(KNN);
-          std::vector<double> distances(KNN);
+        std::pair<double, double> result = measure_search(queries, right_indices, KNN,
+          [&](std::vector<double>& query, std::vector<int>& indices, std::vector<double>& distances) {
+            generic_index->knnSearch(query, indices, distances, KNN, search_params);
+          });
 
-          steady_clock::time_point now = steady_clock::now();
-          generic_index.knnSearch(query, indices, distances, KNN, search_params);
-          steady_clock::time_point after = steady_clock::now();
+        log << "search took " << result.first << " seconds (" << 1 / result.first << " queries per second)"
+            << " with accuracy: " << result.second << std::endl;
+      }
 
-          if (index == 0)
-            right_indices[times] = indices;
-          else
-            current_accuracy += accuracy(right_indices[times], indices);
+      for (const std::shared_ptr<KnnIndex>& index : native_indices)
+      {
+        log << index->name() << " with " << size << " size:" << std::endl;
 
-          std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>(after - now);
-          duration += time_span.count();
-        }
+        load_or_build(data, *index, log);
 
-        duration /= N;
-        current_accuracy /= N;
-        log << "search took " << duration << " seconds with accuracy: " << current_accuracy << std::endl;
+        std::pair<double, double> result = measure_search(queries, right_indices, KNN,
+          [&](std::vector<double>& query, std::vector<int>& indices, std::vector<double>& distances) {
+            index->knnSearch(query, indices, distances, KNN);
+          });
+
+        log << "search took " << result.first << " seconds (" << 1 / result.first << " queries per second)"
+            << " with accuracy: " << result.second << std::endl;
+        log << "index memory per vector: " << double(index->memory_usage()) / size << " bytes" << std::endl;
       }
     }
   }
 }
+
+void KnnFinder::do_out_of_core_size_search()
+{
+  using namespace std::chrono;
+  std::ofstream log("log_out_of_core_sizes.txt");
+
+  const int N = 100;
+  const int KNN = 10;
+
+  if (!log.is_open() || !m_dataset || !m_dataset->is_open() || m_dataset->rows() < 10)
+    return;
+
+  std::function<double()> random_double = make_double_rand();
+
+  std::vector<std::vector<double>> queries(N);
+  for (int i = 0; i < N; ++i)
+    for (int j = 0; j < m_dataset->cols(); ++j)
+      queries[i].push_back(random_double());
+
+  const cv::Mat query_mat = to_mat(queries);
+  const size_t total = m_dataset->rows();
+
+  //HNSW и LSH считают расстояния по исходным векторам, поэтому здесь участвует только IVF-PQ
+  //и без точного пересчёта. Квантователи учатся на выборке из первой доли данных.
+  //train требует строк не меньше числа списков и размера кодовой книги: списков берём
+  //не больше, чем строк в выборке, а на слишком малых данных замеры не делаем
+  const int LISTS = 1024;
+  const int SUB_VECTORS = 50;
+  const cv::Mat train_sample = m_dataset->sample(IvfPqParams().train_size, total / 10);
+  if (train_sample.rows < IvfPqIndex::CODEBOOK_SIZE || m_dataset->cols() % SUB_VECTORS != 0)
+  {
+    log << "Can't train IvfPqIndex: " << train_sample.rows << " sample rows (need " << IvfPqIndex::CODEBOOK_SIZE
+        << "), " << m_dataset->cols() << " columns (need a multiple of " << SUB_VECTORS << ")" << std::endl;
+    return;
+  }
+
+  const int lists = std::min(LISTS, train_sample.rows);
+  if (lists < LISTS)
+    log << "IvfPqIndex lists reduced from " << LISTS << " to " << lists << " to fit the training sample" << std::endl;
+
+  IvfPqIndex ivfpq(IvfPqParams(lists, 32, SUB_VECTORS, 0));
+  {
+    steady_clock::time_point now = steady_clock::now();
+    ivfpq.train(train_sample);
+    log << ivfpq.name() << " training took " << seconds_since(now) << " seconds" << std::endl;
+  }
+
+  std::vector<NeighbourHeap> exact_heaps(N);
+  double exact_duration = 0;
+  double add_duration = 0;
+
+  int size_number = 1;
+  size_t next_size = total / 10;
+  cv::Mat chunk, indices, distances;
+
+  for (size_t first = 0; first < total; first += chunk.rows)
+  {
+    //Куски не пересекают границу очередного размера. Недочитанный файл - конец замеров:
+    //без куска точные ответы и индекс разойдутся с данными
+    if (!m_dataset->read(first, std::min(OUT_OF_CORE_CHUNK, next_size - first), chunk) || chunk.rows == 0)
+    {
+      log << "Couldn't read rows from " << first << ", stopping" << std::endl;
+      std::cerr << "Couldn't read rows from " << first << std::endl;
+      return;
+    }
+
+    steady_clock::time_point now = steady_clock::now();
+    ExactKnnIndex exact(chunk);
+    exact.knnSearch(query_mat, indices, distances, std::min(KNN, chunk.rows));
+    for (int i = 0; i < N; ++i)
+      for (int j = 0; j < indices.cols; ++j)
+        push_neighbour(exact_heaps[i], KNN, distances.at<double>(i, j), first + indices.at<int>(i, j));
+    exact_duration += seconds_since(now);
+
+    now = steady_clock::now();
+    ivfpq.add(chunk, first);
+    add_duration += seconds_since(now);
+
+    if (first + chunk.rows < next_size)
+      continue;
+
+    const size_t size = next_size;
+    next_size = total * ++size_number / 10;
+
+    std::vector<std::vector<int>> right_indices(N);
+    for (int i = 0; i < N; ++i)
+    {
+      NeighbourHeap sorted = exact_heaps[i];
+      std::sort_heap(sorted.begin(), sorted.end());
+      for (const Neighbour& neighbour : sorted)
+        right_indices[i].push_back(neighbour.second);
+    }
+
+    log << "ExactIndex with " << size << " size:" << std::endl;
+    log << "chunked search took " << exact_duration / N << " seconds per query" << std::endl;
+
+    log << ivfpq.name() << " with " << size << " size:" << std::endl;
+    log << "adding took " << add_duration << " seconds" << std::endl;
+
+    std::pair<double, double> result = measure_search(queries, right_indices, KNN,
+      [&](std::vector<double>& query, std::vector<int>& indices, std::vector<double>& distances) {
+        ivfpq.knnSearch(query, indices, distances, KNN);
+      });
+
+    log << "search took " << result.first << " seconds (" << 1 / result.first << " queries per second)"
+        << " with accuracy: " << result.second << std::endl;
+    log << "index memory per vector: " << double(ivfpq.memory_usage()) / size << " bytes" << std::endl;
+  }
+}
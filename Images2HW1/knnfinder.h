@@ -1,14 +1,26 @@
 #ifndef KNNFINDER_H
 #define KNNFINDER_H
 
+#include "knnindex.h"
+#include "hnswindex.h"
+#include "ivfpqindex.h"
+#include "lshindex.h"
+#include "dataset.h"
+
 #include <vector>
 #include <opencv2/flann/flann.hpp>
 #include <opencv2/flann/linear_index.h>
 #include <memory>
+#include <ostream>
+#include <cstdint>
 
 const int DATA_SIZE = 1000000;
 const int ROW_SIZE = 500;
 
+const std::string INDEX_CACHE_DIRECTORY = "./index_cache/";
+
+typedef cv::flann::GenericIndex<cvflann::L2<double>> FlannIndex;
+
 using namespace cvflann;
 
 class KnnFinder
@@ -16,12 +28,30 @@ class KnnFinder
 public:
     KnnFinder(cv::Mat&& data);
 
+    //Данные не грузятся в память целиком, а читаются кусками из бинарного файла
+    KnnFinder(const std::string& dataset_path);
+
     void do_different_dimensions_search();
 
     void do_different_size_search();
 
+    //То же, что do_different_size_search, но за один проход по файлу с данными:
+    //точные ответы собираются по кускам, IVF-PQ учится на выборке и пополняется кусками
+    void do_out_of_core_size_search();
+
 private:
+    //Загрузить индекс с диска, если отпечаток данных совпадает, иначе построить и сохранить.
+    //Время построения и загрузки пишется в log раздельно.
+    std::unique_ptr<FlannIndex> load_or_build(const cv::Mat& data, size_t index_number, std::ostream& log);
+
+    void load_or_build(const cv::Mat& data, KnnIndex& index, std::ostream& log);
+
+    //Отпечаток первых rows строк m_data и параметров индекса params
+    uint64_t fingerprint(size_t rows, const std::string& params);
+
     cv::Mat m_data;
+    std::shared_ptr<ChunkedDataset> m_dataset;
+    std::vector<uint64_t> m_chunkHashes;
 
     const std::vector<std::shared_ptr<cvflann::IndexParams>> params = {
             std::make_shared<LinearIndexParams>(),
@@ -30,7 +60,16 @@ private:
             std::make_shared<CompositeIndexParams>()
     };
 
-    std::vector<std::string> param_names = { "LinearIndex", "KDTreeIndex", "KMeansIndex", "CompositeIndex", "LshIndex" };
+    std::vector<std::string> param_names = { "LinearIndex", "KDTreeIndex", "KMeansIndex", "CompositeIndex" };
+
+    //Собственные индексы, участвуют в тех же замерах, что и FLANN
+    const std::vector<std::shared_ptr<KnnIndex>> native_indices = {
+            std::make_shared<HnswIndex>(HnswParams(16, 200, 64)),
+            std::make_shared<IvfPqIndex>(IvfPqParams(1024, 32, 50, 0)),
+            std::make_shared<IvfPqIndex>(IvfPqParams(1024, 32, 50, 100)),
+            //LSH из FLANN работает только с расстоянием Хэмминга, поэтому свой
+            std::make_shared<LshIndex>(LshParams(16, 8, 16.0, 64))
+    };
 
 };
 
@@ -0,0 +1,73 @@
+#ifndef KNNINDEX_H
+#define KNNINDEX_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+//Общий интерфейс собственных индексов, которые сравниваются с FLANN в KnnFinder.
+//Как и cv::flann::GenericIndex, индекс не копирует данные, а хранит ссылку на data.
+class KnnIndex
+{
+public:
+  virtual ~KnnIndex()
+  {
+  }
+
+  virtual std::string name() const = 0;
+
+  //Параметры построения текстом, например "M=16 ef_construction=200". Входят в имя и
+  //отпечаток кэша, чтобы индексы с разными параметрами не подменяли друг друга.
+  //Параметры только поиска (ef_search, probes) сохранённый индекс не меняют и не входят
+  virtual std::string params() const = 0;
+
+  virtual void build(const cv::Mat& data) = 0;
+
+  virtual void knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                         std::vector<double>& distances, int knn) const = 0;
+
+  virtual void save(std::ostream& stream) const = 0;
+
+  //Возвращает false, если в потоке индекс другого типа или с другими параметрами
+  virtual bool load(std::istream& stream, const cv::Mat& data) = 0;
+
+  //Размер самого индекса в байтах, без данных
+  virtual size_t memory_usage() const = 0;
+};
+
+//Бинарная (де)сериализация для save/load
+template <class T>
+void write_pod(std::ostream& stream, const T& value)
+{
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+bool read_pod(std::istream& stream, T& value)
+{
+  return static_cast<bool>(stream.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+template <class T>
+void write_vector(std::ostream& stream, const std::vector<T>& values)
+{
+  write_pod<uint64_t>(stream, values.size());
+  stream.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <class T>
+bool read_vector(std::istream& stream, std::vector<T>& values)
+{
+  uint64_t size = 0;
+  if (!read_pod(stream, size))
+    return false;
+
+  values.resize(size);
+  return static_cast<bool>(stream.read(reinterpret_cast<char*>(values.data()), size * sizeof(T)));
+}
+
+#endif // KNNINDEX_H
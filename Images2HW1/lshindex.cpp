@@ -0,0 +1,309 @@
+#include "lshindex.h"
+#include "distance.h"
+#include "neighbours.h"
+#include "parallel.h"
+
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  const uint32_t LSH_MAGIC = 0x4853534c; // "LSSH"
+  const uint32_t LSH_VERSION = 1;
+
+  thread_local VisitedList visited;
+}
+
+LshIndex::LshIndex(const LshParams& params)
+  : m_params(params)
+{
+}
+
+std::string LshIndex::name() const
+{
+  return "LshIndex";
+}
+
+std::string LshIndex::params() const
+{
+  std::ostringstream text;
+  text << "tables=" << m_params.tables << " hashes=" << m_params.hashes << " width=" << m_params.width;
+  return text.str();
+}
+
+void LshIndex::init_functions(int dim)
+{
+  const int functions = m_params.tables * m_params.hashes;
+
+  std::mt19937 generator(functions);
+  std::normal_distribution<double> normal(0, 1);
+  std::uniform_real_distribution<double> uniform(0, m_params.width);
+
+  m_projections.create(functions, dim, CV_64F);
+  m_offsets.resize(functions);
+  for (int i = 0; i < functions; ++i)
+  {
+    double* row = m_projections.ptr<double>(i);
+    for (int j = 0; j < dim; ++j)
+      row[j] = normal(generator);
+    m_offsets[i] = uniform(generator);
+  }
+}
+
+void LshIndex::project(const double* point, int table, double* values) const
+{
+  for (int i = 0; i < m_params.hashes; ++i)
+  {
+    const int function = table * m_params.hashes + i;
+    values[i] = (dot_product(m_projections.ptr<double>(function), point, m_projections.cols) + m_offsets[function])
+              / m_params.width;
+  }
+}
+
+uint64_t LshIndex::bucket_key(const int* hashes, int count)
+{
+  uint64_t key = 0;
+  for (int i = 0; i < count; ++i)
+    key = (key ^ static_cast<uint32_t>(hashes[i])) * 0x9E3779B97F4A7C15ULL + (key >> 29);
+  return key;
+}
+
+void LshIndex::build(const cv::Mat& data)
+{
+  assert(data.type() == CV_64F);
+
+  init_functions(data.cols);
+  m_tables.assign(m_params.tables, HashTable());
+  add(data, 0, data.rows);
+}
+
+void LshIndex::add(const cv::Mat& data, int first, int last)
+{
+  assert(data.cols == m_projections.cols);
+  m_data = data;
+
+  //Таблицы независимы, так что каждую заполняет свой поток без блокировок
+  parallel_for(m_params.tables, 1, [&](size_t begin, size_t end) {
+    std::vector<double> values(m_params.hashes);
+    std::vector<int> hashes(m_params.hashes);
+
+    for (size_t table = begin; table < end; ++table)
+    {
+      for (int row = first; row < last; ++row)
+      {
+        project(data.ptr<double>(row), table, values.data());
+        for (int i = 0; i < m_params.hashes; ++i)
+          hashes[i] = static_cast<int>(std::floor(values[i]));
+
+        m_tables[table][bucket_key(hashes.data(), m_params.hashes)].push_back(row);
+      }
+    }
+  });
+}
+
+void LshIndex::probe_sequence(const double* values, std::vector<std::vector<int>>& probes) const
+{
+  const int count = m_params.hashes;
+
+  //Шаг - сдвиг одной функции на +-1. Оценка - квадрат расстояния до границы корзины
+  typedef std::pair<double, std::pair<int, int>> Step;
+  std::vector<Step> steps;
+  std::vector<int> base(count);
+
+  for (int i = 0; i < count; ++i)
+  {
+    base[i] = static_cast<int>(std::floor(values[i]));
+    const double fraction = values[i] - base[i];
+    steps.push_back(Step(fraction * fraction, std::make_pair(i, -1)));
+    steps.push_back(Step((1 - fraction) * (1 - fraction), std::make_pair(i, 1)));
+  }
+  std::sort(steps.begin(), steps.end());
+
+  probes.assign(1, base);
+
+  //Наборы шагов перебираются в порядке возрастания суммарной оценки операциями shift и expand
+  typedef std::pair<double, std::vector<int>> StepSet;
+  std::priority_queue<StepSet, std::vector<StepSet>, std::greater<StepSet>> sets;
+  sets.push(StepSet(steps[0].first, std::vector<int>(1, 0)));
+
+  const int total_steps = steps.size();
+  while (static_cast<int>(probes.size()) < m_params.probes && !sets.empty())
+  {
+    const StepSet set = sets.top();
+    sets.pop();
+
+    const int last = set.second.back();
+    if (last + 1 < total_steps)
+    {
+      StepSet shifted = set;
+      shifted.second.back() = last + 1;
+      shifted.first += steps[last + 1].first - steps[last].first;
+      sets.push(shifted);
+
+      StepSet expanded = set;
+      expanded.second.push_back(last + 1);
+      expanded.first += steps[last + 1].first;
+      sets.push(expanded);
+    }
+
+    std::vector<int> probe = base;
+    std::vector<bool> used(count, false);
+    bool valid = true;
+    for (int position : set.second)
+    {
+      const int function = steps[position].second.first;
+      if (used[function])
+      {
+        valid = false;
+        break;
+      }
+      used[function] = true;
+      probe[function] += steps[position].second.second;
+    }
+
+    if (valid)
+      probes.push_back(probe);
+  }
+}
+
+void LshIndex::knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                         std::vector<double>& distances, int knn) const
+{
+  assert(static_cast<int>(query.size()) == m_projections.cols);
+
+  std::vector<double> values(m_params.hashes);
+  std::vector<std::vector<int>> probes;
+  NeighbourHeap heap;
+
+  visited.start(m_data.rows);
+  for (int table = 0; table < m_params.tables; ++table)
+  {
+    project(query.data(), table, values.data());
+    probe_sequence(values.data(), probes);
+
+    for (const std::vector<int>& probe : probes)
+    {
+      HashTable::const_iterator bucket = m_tables[table].find(bucket_key(probe.data(), m_params.hashes));
+      if (bucket == m_tables[table].end())
+        continue;
+
+      for (int row : bucket->second)
+      {
+        if (visited.visit(row))
+          push_neighbour(heap, knn, l2_squared(query.data(), m_data.ptr<double>(row), m_data.cols), row);
+      }
+    }
+  }
+
+  std::sort_heap(heap.begin(), heap.end());
+
+  indices.assign(knn, -1);
+  distances.assign(knn, std::numeric_limits<double>::max());
+  for (int i = 0; i < knn && i < static_cast<int>(heap.size()); ++i)
+  {
+    indices[i] = heap[i].second;
+    distances[i] = heap[i].first;
+  }
+}
+
+void LshIndex::save(std::ostream& stream) const
+{
+  write_pod(stream, LSH_MAGIC);
+  write_pod(stream, LSH_VERSION);
+  write_pod(stream, m_params.tables);
+  write_pod(stream, m_params.hashes);
+  write_pod(stream, m_params.width);
+  write_pod(stream, m_projections.cols);
+
+  for (int i = 0; i < m_projections.rows; ++i)
+    stream.write(reinterpret_cast<const char*>(m_projections.ptr<double>(i)), m_projections.cols * sizeof(double));
+  write_vector(stream, m_offsets);
+
+  for (const HashTable& table : m_tables)
+  {
+    write_pod<uint64_t>(stream, table.size());
+    for (const HashTable::value_type& bucket : table)
+    {
+      write_pod(stream, bucket.first);
+      write_vector(stream, bucket.second);
+    }
+  }
+}
+
+bool LshIndex::load(std::istream& stream, const cv::Mat& data)
+{
+  uint32_t magic = 0, version = 0;
+  int tables = 0, hashes = 0, dim = 0;
+  double width = 0;
+  if (!read_pod(stream, magic) || !read_pod(stream, version) || !read_pod(stream, tables)
+      || !read_pod(stream, hashes) || !read_pod(stream, width) || !read_pod(stream, dim))
+    return false;
+
+  if (magic != LSH_MAGIC || version != LSH_VERSION || tables != m_params.tables
+      || hashes != m_params.hashes || width != m_params.width || dim != data.cols
+      || tables <= 0 || hashes <= 0)
+    return false;
+
+  //Всё читается в локальные переменные: испорченный файл не должен оставить индекс
+  //наполовину заменённым. Поиск берёт строки из корзин без проверок, поэтому номера
+  //строк сверяются с data здесь
+  cv::Mat projections(tables * hashes, dim, CV_64F);
+  for (int i = 0; i < projections.rows; ++i)
+    if (!stream.read(reinterpret_cast<char*>(projections.ptr<double>(i)), dim * sizeof(double)))
+      return false;
+
+  std::vector<double> offsets;
+  if (!read_vector(stream, offsets) || offsets.size() != static_cast<size_t>(tables) * hashes)
+    return false;
+
+  std::vector<HashTable> hash_tables(tables);
+  for (HashTable& table : hash_tables)
+  {
+    uint64_t buckets = 0;
+    if (!read_pod(stream, buckets))
+      return false;
+
+    size_t total = 0;
+    for (uint64_t i = 0; i < buckets; ++i)
+    {
+      uint64_t key = 0;
+      std::vector<int> rows;
+      if (!read_pod(stream, key) || !read_vector(stream, rows))
+        return false;
+
+      for (int row : rows)
+        if (row < 0 || row >= data.rows)
+          return false;
+
+      total += rows.size();
+      std::vector<int>& bucket = table[key];
+      bucket.insert(bucket.end(), rows.begin(), rows.end());
+    }
+
+    if (total != static_cast<size_t>(data.rows))
+      return false;
+  }
+
+  m_data = data;
+  m_projections = projections;
+  m_offsets.swap(offsets);
+  m_tables.swap(hash_tables);
+  return true;
+}
+
+size_t LshIndex::memory_usage() const
+{
+  size_t result = m_projections.total() * sizeof(double) + m_offsets.size() * sizeof(double);
+  for (const HashTable& table : m_tables)
+  {
+    result += table.bucket_count() * sizeof(void*);
+    for (const HashTable::value_type& bucket : table)
+      result += sizeof(bucket) + sizeof(void*) + bucket.second.capacity() * sizeof(int);
+  }
+  return result;
+}
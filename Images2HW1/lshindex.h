@@ -0,0 +1,74 @@
+#ifndef LSHINDEX_H
+#define LSHINDEX_H
+
+#include "knnindex.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct LshParams
+{
+  LshParams(int tables = 16, int hashes = 8, double width = 8.0, int probes = 32)
+    : tables(tables), hashes(hashes), width(width), probes(probes)
+  {
+  }
+
+  int tables;
+  //Сколько функций h(v) = floor((a.v + b) / width) склеивается в ключ одной таблицы
+  int hashes;
+  double width;
+  //Сколько корзин смотреть в каждой таблице, включая корзину самого запроса
+  int probes;
+};
+
+//LSH для L2 на p-устойчивых (гауссовых) проекциях, как в E2LSH,
+//с многозондовым поиском (Lv et al., Multi-Probe LSH).
+//Кандидаты из корзин досчитываются точно по исходным данным.
+class LshIndex : public KnnIndex
+{
+public:
+  LshIndex(const LshParams& params = LshParams());
+
+  std::string name() const;
+
+  std::string params() const;
+
+  void build(const cv::Mat& data);
+
+  //Добавить строки [first, last) из data. data должна содержать и все ранее добавленные строки
+  void add(const cv::Mat& data, int first, int last);
+
+  void knnSearch(const std::vector<double>& query, std::vector<int>& indices,
+                 std::vector<double>& distances, int knn) const;
+
+  void save(std::ostream& stream) const;
+
+  bool load(std::istream& stream, const cv::Mat& data);
+
+  size_t memory_usage() const;
+
+private:
+  typedef std::unordered_map<uint64_t, std::vector<int>> HashTable;
+
+  void init_functions(int dim);
+
+  //Значения (a.v + b) / width всех функций таблицы table
+  void project(const double* point, int table, double* values) const;
+
+  static uint64_t bucket_key(const int* hashes, int count);
+
+  //Номера корзин для многозондового поиска в порядке возрастания оценки расстояния до них
+  void probe_sequence(const double* values, std::vector<std::vector<int>>& probes) const;
+
+  LshParams m_params;
+  cv::Mat m_data;
+
+  //(tables * hashes) x dim
+  cv::Mat m_projections;
+  std::vector<double> m_offsets;
+
+  std::vector<HashTable> m_tables;
+};
+
+#endif // LSHINDEX_H
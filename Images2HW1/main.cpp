@@ -1,5 +1,8 @@
 #include "knnfinder.h"
 #include "clusterspace.h"
+#include "invertedfile.h"
+#include "descriptorsink.h"
+#include "siftpipeline.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -14,109 +17,186 @@
 #include <list>
 #include <random>
 
-#include <QtCore/QDirIterator>
-#include <QtCore/QDir>
-#include <QtCore/QDebug>
-
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/xml_iarchive.hpp>
-#include <boost/archive/xml_oarchive.hpp>
-
 const std::string PATH = "./data/mat-500-";
 const std::string TXT = ".txt";
+const std::string BINARY_DATA = "./data/mat-500.bin";
 
 const std::string BOW_DIRECTORY = "101_ObjectCategories";
+const std::string DESCRIPTORS_DATA = "./data/sift.bin";
+//Сколько байт дескрипторов держать в памяти вместе с выборкой VOCABULARY_SAMPLE,
+//остальное - в DESCRIPTORS_DATA
+const size_t DESCRIPTOR_MEMORY_BUDGET = 512 << 20;
+//Размер словаря и равномерной выборки дескрипторов, которую держит DescriptorSink
+const int VOCABULARY_SIZE = 100;
+const size_t VOCABULARY_SAMPLE = 200000;
+//Mini-batch k-means по всем дескрипторам: размер пачки и сколько пачек
+const int VOCABULARY_BATCH = 4096;
+const int VOCABULARY_BATCHES = 2000;
+//Словарь-дерево по выборке: до VOCABULARY_BRANCHING^VOCABULARY_DEPTH слов-листьев.
+//На 200000 дескрипторов выборки глубже 4 листья остаются почти пустыми
+const int VOCABULARY_BRANCHING = 10;
+const int VOCABULARY_DEPTH = 4;
+//Словарь в формате ClusterSpace::save, открывается через ClusterSpace::map
+const std::string CLUSTER_SPACE_FILE = "cluster_space.bin";
 
 typedef std::vector<cv::Mat> ClassifiedImages;
 
-//Прочитать все файлы с данными
-cv::Mat read_data()
+//Прочитать i-й файл с данными в rows, вернуть число прочитанных строк
+int read_data_file(int i, cv::Mat& rows)
 {
-    cv::Mat data(DATA_SIZE, ROW_SIZE, CV_64FC1);
+    std::stringstream ss;
+    ss << PATH << i << TXT;
+    std::ifstream file(ss.str());
 
-    std::vector<char> block;
-    for (int i = 1; i <= 10; ++i)
+    int row = 0;
+    if (file.is_open())
     {
-      std::stringstream ss;
-      std::vector<double> entry;
-      entry.resize(ROW_SIZE);
+      //Как можно быстрее читаем файл
+      std::vector<char> block;
+      std::streambuf* buffer = file.rdbuf();
 
-      ss << PATH << i << TXT;
-      std::ifstream file(ss.str());
+      file.seekg(0, std::ios::end);
+      size_t size = file.tellg();
+      file.seekg(0, std::ios::beg);
 
-      if (file.is_open())
-      {
-        //Как можно быстрее читаем файл
-        std::streambuf* buffer = file.rdbuf();
+      block.resize(size);
+      buffer->sgetn(&block[0], size);
 
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        file.seekg(0, std::ios::beg);
+      std::string contents(block.begin(), block.end());
+      std::istringstream stream(contents);
 
-        block.resize(size);
-        buffer->sgetn(&block[0], size);
+      //Разбираем файл по строкам
+      while (!stream.eof() && row < rows.rows)
+      {
+        std::string line;
+        std::getline(stream, line);
 
-        std::string contents(block.begin(), block.end());
-        std::istringstream stream(contents);
+        //собираем данные из строки
+        if (!line.empty())
+        {
+          double* row_ptr = rows.ptr<double>(row++);
+          std::istringstream line_stream(line);
 
-        //Разбираем файл по строкам
-        int row = (i - 1) * (DATA_SIZE / 10);
+          std::vector<std::string> values{ std::istream_iterator<std::string>(line_stream),
+                                           std::istream_iterator<std::string>()};
 
-        while (!stream.eof())
-        {
-          std::string line;
-          std::getline(stream, line);
-
-          //собираем данные из строки
-          if (!line.empty())
-          {
-            double* row_ptr = data.ptr<double>(row++);
-            std::istringstream line_stream(line);
-
-            std::vector<std::string> values{ std::istream_iterator<std::string>(line_stream),
-                                             std::istream_iterator<std::string>()};
-
-            std::transform(values.begin(), values.end(), row_ptr, [&](const std::string& str){
-              return std::stod(str);
-            });
-          }
+          std::transform(values.begin(), values.end(), row_ptr, [&](const std::string& str){
+            return std::stod(str);
+          });
         }
       }
-      else
-      {
-          std::cerr << "Couldn't open " << ss.str() << std::endl;
-      }
-      std::cout << "File #" << i << " read successfully!" << std::endl;
+    }
+    else
+    {
+        std::cerr << "Couldn't open " << ss.str() << std::endl;
+    }
+    std::cout << "File #" << i << " read successfully!" << std::endl;
+    return row;
+}
+
+//Прочитать все файлы с данными
+cv::Mat read_data()
+{
+    cv::Mat data(DATA_SIZE, ROW_SIZE, CV_64FC1);
+
+    for (int i = 1; i <= 10; ++i)
+    {
+      cv::Mat part(data, cv::Range((i - 1) * (DATA_SIZE / 10), i * (DATA_SIZE / 10)), cv::Range::all());
+      read_data_file(i, part);
     }
 
     std::cerr << "Data read successfully!" << std::endl;
     return std::move(data);
 }
 
-//Вырезать из картинки кусок 16x16 по ключевой точке
-cv::Mat getKeypointPatch(const cv::KeyPoint keypoint, const cv::Mat& image)
+//Переложить текстовые файлы в бинарный BINARY_DATA, держа в памяти только один файл
+void convert_data()
 {
-  cv::Point pt = keypoint.pt;
-  float size = 16;
-  float angle = keypoint.angle;
+    DatasetWriter writer(BINARY_DATA, ROW_SIZE);
+    if (!writer.is_open())
+    {
+      std::cerr << "Couldn't create " << BINARY_DATA << std::endl;
+      return;
+    }
+
+    cv::Mat part(DATA_SIZE / 10, ROW_SIZE, CV_64FC1);
+
+    for (int i = 1; i <= 10; ++i)
+    {
+      int rows = read_data_file(i, part);
+      if (!writer.append(cv::Mat(part, cv::Range(0, rows), cv::Range::all())))
+      {
+        std::cerr << "Couldn't write " << BINARY_DATA << std::endl;
+        return;
+      }
+    }
+
+    if (!writer.close())
+    {
+      std::cerr << "Couldn't write " << BINARY_DATA << std::endl;
+      return;
+    }
+    std::cerr << "Data converted successfully!" << std::endl;
+}
 
-  cv::RotatedRect rect(pt, cv::Size2f(size, size), angle);
+//Слова всех картинок по словарю vocabulary, инвертированный файл на столько слов,
+//сколько их в словаре, и Precision@5 поиска, где каждая картинка - запрос
+void evaluate_vocabulary(const ClusterSpace<double, 128>& vocabulary, const DescriptorSink& descriptor_sink,
+                         const std::vector<size_t>& image_sizes, const std::vector<int>& image_categories,
+                         const std::vector<std::string>& image_paths)
+{
+  std::cout << "Vocabulary: " << vocabulary.size() << " words" << std::endl;
 
-  cv::Mat m, rotated, cropped;
-  cv::Size rect_size = rect.size;
-  angle = rect.angle;
+  std::cerr << "Building inverted file..." << std::endl;
+  InvertedFile inverted_file(vocabulary.size());
+  std::vector<std::vector<int>> image_words;
+  cv::Mat descriptors;
 
-  if (rect.angle < -45.) {
-    angle += 90.0;
-    std::swap(rect_size.width, rect_size.height);
+  size_t first = 0;
+  for (size_t image_size : image_sizes)
+  {
+    if (!descriptor_sink.read(first, image_size, descriptors))
+    {
+      std::cerr << "Couldn't read descriptors of " << image_paths[image_words.size()] << std::endl;
+      return;
+    }
+    image_words.push_back(vocabulary.assign(descriptors));
+    inverted_file.add_image(image_words.back());
+    first += image_size;
   }
+  inverted_file.finalize();
+  std::cout << "Inverted file: " << inverted_file.memory_usage() << " bytes" << std::endl;
+
+  //Каждая картинка как запрос: доля картинок той же категории среди 5 лучших, не считая её саму
+  const int TOP = 5;
+  std::vector<std::vector<InvertedFile::Match>> matches = inverted_file.query(image_words, TOP + 1);
+
+  //Саму картинку может не оказаться среди TOP + 1 (равные оценки, пустая гистограмма),
+  //поэтому берутся первые TOP чужих
+  size_t relevant = 0, retrieved = 0;
+  for (size_t image = 0; image < matches.size(); ++image)
+  {
+    int taken = 0;
+    for (const InvertedFile::Match& match : matches[image])
+    {
+      if (match.second == static_cast<int>(image))
+        continue;
+      if (taken++ == TOP)
+        break;
 
-  m = cv::getRotationMatrix2D(rect.center, angle, 1.0);
-  cv::warpAffine(image, rotated, m, image.size(), cv::INTER_CUBIC);
-  cv::getRectSubPix(rotated, rect_size, rect.center, cropped);
+      relevant += image_categories[match.second] == image_categories[image];
+      ++retrieved;
+    }
+  }
+  std::cout << "Precision@" << TOP << ": " << (retrieved ? static_cast<double>(relevant) / retrieved : 0)
+            << std::endl;
 
-  return cropped;
+  if (!matches.empty())
+  {
+    std::cout << "Query: " << image_paths[0] << std::endl;
+    for (const InvertedFile::Match& match : matches[0])
+      std::cout << "  " << match.first << " " << image_paths[match.second] << std::endl;
+  }
 }
 
 int main()
@@ -125,79 +205,70 @@ int main()
 //  KnnFinder finder(read_data());
 //  finder.do_different_size_search();
 
-  std::vector<cv::KeyPoint> keypoints;
-  std::vector<cv::Mat> keypoint_patches;
-
-  cv::SiftFeatureDetector detector;
+// То же без загрузки всех данных в память (бинарный файл один раз готовит convert_data)
+//  KnnFinder finder(BINARY_DATA);
+//  finder.do_out_of_core_size_search();
 
   ClassifiedImages images;
-  QDir image_directory(QString::fromStdString(BOW_DIRECTORY));
 
-  qDebug() << image_directory;
+  //Дескрипторы копятся кусками и уходят в файл сверх бюджета памяти. Плоский словарь
+  //учится mini-batch k-means по всем сразу, словарь-дерево - по равномерной выборке
+  DescriptorSink descriptor_sink(128, DESCRIPTOR_MEMORY_BUDGET, DESCRIPTORS_DATA, VOCABULARY_SAMPLE);
 
-  cv::Mat descriptor_set;
-  cv::Mat descriptors;
-
-  //читаем не все картинки из-за нехватки памяти
-  QStringList dirs = image_directory.entryList();
-  qDebug() << dirs;
+  //Для каждой картинки: путь, категория и сколько у неё дескрипторов
+  std::vector<std::string> image_paths;
+  std::vector<int> image_categories;
+  std::vector<size_t> image_sizes;
 
-  for (int i = 0; i < dirs.size(); ++i)
-  {
-    if (dirs[i] == "." || dirs[i] == "..")
-      continue;
+  //Если файл сброса не пишется, остальные картинки пропускаются, и работа заканчивается
+  bool spill_failed = false;
 
-    QDirIterator iterator(image_directory.absolutePath() + QDir::separator() + dirs[i]);
-    std::cout << i << ": " << dirs[i].toStdString() << std::endl;
+  SiftPipeline pipeline;
+  pipeline.run(BOW_DIRECTORY, [&](ExtractedImage&& image) {
+    //Картинке без дескрипторов нечего делать в индексе
+    if (image.descriptors.empty() || spill_failed)
+      return;
 
-    int counter = 0;
-    while (iterator.hasNext())
+    if (!descriptor_sink.append(image.descriptors))
     {
-      if (counter++ <= 20)
-      {
-        QString next = iterator.next();
-        QFileInfo fileinfo = iterator.fileInfo();
-
-        if (fileinfo.isFile())
-        {
-          std::cout << next.toStdString() << std::endl;
-          std::vector<cv::KeyPoint> image_keypoints;
-          std::string image_path = next.toStdString();
-
-          cv::Mat image = cv::imread(image_path);
-          if (!image.empty())
-          {
-            detector.detect(image, image_keypoints);
-            detector.compute(image, image_keypoints, descriptors);
-            descriptor_set.push_back(descriptors);
-          }
-        }
-      }
-      else
-        break;
+      spill_failed = true;
+      return;
     }
-  }
 
-  std::cerr << "Building ClusterSpace..." << std::endl;
-  ClusterSpace<double, 128> cluster_space(100);
-  cluster_space.build(descriptor_set);
-  std::cerr << "ClusterSpace has been built!" << std::endl;
+    image_paths.push_back(std::move(image.path));
+    image_categories.push_back(image.category);
+    image_sizes.push_back(image.descriptors.rows);
 
-  std::cout << "Size: " << cluster_space.size() << std::endl;
-  size_t total = 0;
-  std::for_each(cluster_space.begin(), cluster_space.end(), [&](const Cluster<double, 128>& cluster){
-    total += cluster.size();
+    if (image_paths.size() % 1000 == 0)
+      std::cerr << image_paths.size() << " images" << std::endl;
   });
-  std::cout << "Total: " << total << std::endl;
+  pipeline.print_stats(std::cout);
 
-  std::ofstream dump("cluster_space.txt");
-  if (dump.is_open())
+  if (!descriptor_sink.finish() || spill_failed)
   {
-    boost::archive::binary_oarchive oarchive(dump);
-    oarchive << cluster_space;
-    std::cout << "ClusterSpace dumped!" << std::endl;
+    std::cerr << "Couldn't write " << DESCRIPTORS_DATA << std::endl;
+    return 1;
   }
-  dump.close();
+  std::cout << "Descriptors: " << descriptor_sink.rows() << ", spilled: " << descriptor_sink.spilled() << std::endl;
+
+  //Плоский словарь из VOCABULARY_SIZE слов. Пачки из всех дескрипторов, и сброшенных
+  //в файл, и оставшихся в памяти, в перемешанном порядке: подряд идут дескрипторы
+  //одной картинки и одной категории
+  std::cerr << "Building flat vocabulary..." << std::endl;
+  ClusterSpace<double, 128> flat_vocabulary(VOCABULARY_SIZE);
+  ShuffledDescriptorStream shuffled_descriptors(descriptor_sink);
+  flat_vocabulary.build_vocabulary(shuffled_descriptors,
+                                   MiniBatchParams(VOCABULARY_SIZE, VOCABULARY_BATCH, VOCABULARY_BATCHES));
+  evaluate_vocabulary(flat_vocabulary, descriptor_sink, image_sizes, image_categories, image_paths);
+
+  //Словарь-дерево: слова - листья иерархического k-means по выборке
+  std::cerr << "Building vocabulary tree..." << std::endl;
+  ClusterSpace<double, 128> cluster_space;
+  cluster_space.build_tree(descriptor_sink.sample(), VOCABULARY_BRANCHING, VOCABULARY_DEPTH);
+  evaluate_vocabulary(cluster_space, descriptor_sink, image_sizes, image_categories, image_paths);
+
+  if (cluster_space.save(CLUSTER_SPACE_FILE))
+    std::cout << "ClusterSpace dumped!" << std::endl;
 
   return 0;
 }
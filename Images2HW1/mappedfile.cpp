@@ -0,0 +1,34 @@
+#include "mappedfile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path)
+  : m_data(nullptr), m_size(0)
+{
+  const int descriptor = open(path.c_str(), O_RDONLY);
+  if (descriptor < 0)
+    return;
+
+  struct stat info;
+  if (fstat(descriptor, &info) == 0 && info.st_size > 0)
+  {
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+    if (mapping != MAP_FAILED)
+    {
+      m_data = static_cast<const char*>(mapping);
+      m_size = info.st_size;
+    }
+  }
+
+  //Отображение живёт и после закрытия дескриптора
+  close(descriptor);
+}
+
+MappedFile::~MappedFile()
+{
+  if (m_data)
+    munmap(const_cast<char*>(m_data), m_size);
+}
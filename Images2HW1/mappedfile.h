@@ -0,0 +1,39 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+//Файл, отображённый в память только для чтения. Страницы общие для всех процессов,
+//открывших тот же файл, и подгружаются при первом обращении
+class MappedFile
+{
+public:
+  MappedFile(const std::string& path);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_open() const
+  {
+    return m_data != nullptr;
+  }
+
+  const char* data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+  const char* m_data;
+  size_t m_size;
+};
+
+#endif // MAPPEDFILE_H
@@ -0,0 +1,133 @@
+#include "minibatchkmeans.h"
+#include "distance.h"
+#include "exactknn.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+MiniBatchKMeans::MiniBatchKMeans(const MiniBatchParams& params)
+  : m_params(params)
+{
+}
+
+void MiniBatchKMeans::init(DescriptorStream& stream)
+{
+  const size_t init_size = m_params.init_size > 0 ? m_params.init_size
+                                                  : std::max(3 * m_params.k, m_params.batch_size);
+
+  //Выборка резервуаром за один проход: размер потока заранее не известен
+  cv::Mat sample(init_size, stream.cols(), CV_32F);
+  std::mt19937_64 generator(init_size);
+  size_t seen = 0;
+
+  cv::Mat batch;
+  stream.rewind();
+  while (size_t count = stream.next(m_params.batch_size, batch))
+  {
+    for (size_t i = 0; i < count; ++i, ++seen)
+    {
+      size_t slot = seen;
+      if (seen >= init_size)
+        slot = std::uniform_int_distribution<size_t>(0, seen)(generator);
+
+      if (slot < init_size)
+      {
+        const double* row = batch.ptr<double>(i);
+        std::copy(row, row + batch.cols, sample.ptr<float>(slot));
+      }
+    }
+  }
+  stream.rewind();
+
+  assert(seen >= static_cast<size_t>(m_params.k));
+  if (seen < init_size)
+    sample = cv::Mat(sample, cv::Range(0, seen), cv::Range::all());
+
+  //cv::kmeans умеет только float
+  cv::Mat labels, centers;
+  cv::kmeans(sample, m_params.k, labels, cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 10, 1e-4),
+             1, cv::KMEANS_PP_CENTERS, centers);
+  centers.convertTo(m_centers, CV_64F);
+
+  m_counts.assign(m_params.k, 0);
+}
+
+std::vector<int> MiniBatchKMeans::assign(const cv::Mat& rows) const
+{
+  ExactKnnIndex index(m_centers);
+  cv::Mat indices, distances;
+  index.knnSearch(rows, indices, distances, 1);
+
+  return std::vector<int>(indices.ptr<int>(0), indices.ptr<int>(0) + rows.rows);
+}
+
+double MiniBatchKMeans::update(const cv::Mat& batch)
+{
+  const std::vector<int> labels = assign(batch);
+
+  //Раскладываем строки пачки по центрам, чтобы каждый центр обновлялся одним потоком
+  std::vector<size_t> offsets(m_params.k + 1, 0);
+  for (int label : labels)
+    ++offsets[label + 1];
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  std::vector<int> members(labels.size());
+  std::vector<size_t> position(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < labels.size(); ++i)
+    members[position[labels[i]]++] = i;
+
+  std::vector<double> shifts(m_params.k, 0);
+  parallel_for(m_params.k, 8, [&](size_t begin, size_t end) {
+    std::vector<double> previous(m_centers.cols);
+    for (size_t c = begin; c < end; ++c)
+    {
+      if (offsets[c] == offsets[c + 1])
+        continue;
+
+      double* center = m_centers.ptr<double>(c);
+      std::copy(center, center + m_centers.cols, previous.begin());
+
+      //c += (x - c) / count для каждой точки по очереди
+      for (size_t i = offsets[c]; i < offsets[c + 1]; ++i)
+      {
+        const double rate = 1.0 / ++m_counts[c];
+        const double* row = batch.ptr<double>(members[i]);
+        for (int j = 0; j < m_centers.cols; ++j)
+          center[j] += rate * (row[j] - center[j]);
+      }
+
+      shifts[c] = l2_squared(previous.data(), center, m_centers.cols);
+    }
+  });
+
+  return std::accumulate(shifts.begin(), shifts.end(), 0.0) / m_params.k;
+}
+
+const cv::Mat& MiniBatchKMeans::fit(DescriptorStream& stream)
+{
+  init(stream);
+
+  cv::Mat batch;
+  for (int i = 0; i < m_params.max_batches; ++i)
+  {
+    if (stream.next(m_params.batch_size, batch) == 0)
+    {
+      stream.rewind();
+      if (stream.next(m_params.batch_size, batch) == 0)
+        break;
+    }
+
+    const double shift = update(batch);
+    if (shift < m_params.tolerance)
+    {
+      std::cerr << "Mini-batch k-means converged after " << i + 1 << " batches" << std::endl;
+      break;
+    }
+  }
+
+  return m_centers;
+}
@@ -0,0 +1,57 @@
+#ifndef MINIBATCHKMEANS_H
+#define MINIBATCHKMEANS_H
+
+#include "descriptorstream.h"
+
+#include <vector>
+
+struct MiniBatchParams
+{
+  MiniBatchParams(int k = 100, int batch_size = 4096, int max_batches = 1000, int init_size = 0,
+                  double tolerance = 1e-6)
+    : k(k), batch_size(batch_size), max_batches(max_batches), init_size(init_size), tolerance(tolerance)
+  {
+  }
+
+  int k;
+  int batch_size;
+  //Сколько пачек обработать самое большее, поток при этом перематывается по кругу
+  int max_batches;
+  //Размер выборки для начальных центров k-means++, 0 - max(3k, batch_size)
+  int init_size;
+  //Останов, когда средний квадрат сдвига центров за пачку меньше tolerance
+  double tolerance;
+};
+
+//Mini-batch k-means (Sculley, Web-scale k-means clustering).
+//В памяти только центры, счётчики и текущая пачка: начальные центры строятся
+//k-means++ по равномерной выборке из потока, затем каждая пачка сдвигает центры
+//к средним своих точек с шагом 1 / (число точек, попавших в центр за всё время).
+class MiniBatchKMeans
+{
+public:
+  MiniBatchKMeans(const MiniBatchParams& params = MiniBatchParams());
+
+  //Обучить центры по stream. Возвращает k x cols (CV_64F)
+  const cv::Mat& fit(DescriptorStream& stream);
+
+  const cv::Mat& centers() const
+  {
+    return m_centers;
+  }
+
+  //Номер ближайшего центра для каждой строки rows (CV_64F)
+  std::vector<int> assign(const cv::Mat& rows) const;
+
+private:
+  void init(DescriptorStream& stream);
+
+  //Сдвинуть центры по пачке, вернуть средний квадрат сдвига
+  double update(const cv::Mat& batch);
+
+  MiniBatchParams m_params;
+  cv::Mat m_centers;
+  std::vector<size_t> m_counts;
+};
+
+#endif // MINIBATCHKMEANS_H
@@ -0,0 +1,57 @@
+#ifndef NEIGHBOURS_H
+#define NEIGHBOURS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+typedef std::pair<double, int> Neighbour;
+typedef std::vector<Neighbour> NeighbourHeap;
+
+//Куча с максимумом наверху: держим knn лучших
+inline void push_neighbour(NeighbourHeap& heap, size_t knn, double distance, int index)
+{
+  const Neighbour candidate(distance, index);
+  if (heap.size() < knn)
+  {
+    heap.push_back(candidate);
+    std::push_heap(heap.begin(), heap.end());
+  }
+  else if (candidate < heap.front())
+  {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = candidate;
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+//Метки посещённых точек. Вместо очистки на каждый запрос увеличиваем поколение.
+struct VisitedList
+{
+  VisitedList() : generation(0)
+  {
+  }
+
+  void start(size_t size)
+  {
+    if (tags.size() < size || ++generation == 0)
+    {
+      tags.assign(std::max(size, tags.size()), 0);
+      generation = 1;
+    }
+  }
+
+  bool visit(int node)
+  {
+    if (tags[node] == generation)
+      return false;
+    tags[node] = generation;
+    return true;
+  }
+
+  std::vector<uint32_t> tags;
+  uint32_t generation;
+};
+
+#endif // NEIGHBOURS_H
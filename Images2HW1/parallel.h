@@ -0,0 +1,43 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+inline size_t hardware_threads()
+{
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+//Выполнить body(begin, end) для кусков [0, count) размера grain во всех потоках.
+//Куски раздаются динамически, поэтому неравномерная нагрузка не страшна.
+template <class Body>
+void parallel_for(size_t count, size_t grain, Body body, size_t threads = 0)
+{
+  if (count == 0)
+    return;
+
+  grain = std::max<size_t>(grain, 1);
+  if (threads == 0)
+    threads = hardware_threads();
+  threads = std::min(threads, (count + grain - 1) / grain);
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t begin = next.fetch_add(grain); begin < count; begin = next.fetch_add(grain))
+      body(begin, std::min(count, begin + grain));
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i)
+    workers.emplace_back(worker);
+
+  worker();
+
+  for (std::thread& thread : workers)
+    thread.join();
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,163 @@
+#include "patchextractor.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <emmintrin.h>
+
+namespace
+{
+  //Значение канала c в (x, y), нули за краем картинки
+  inline float pixel_or_zero(const cv::Mat& source, int x, int y, int c)
+  {
+    if (x < 0 || y < 0 || x >= source.cols || y >= source.rows)
+      return 0;
+    return source.ptr<float>(y)[x * source.channels() + c];
+  }
+
+  //Билинейная выборка одной точки, для хвоста строки короче 4
+  void sample_point(const cv::Mat& source, float x, float y, float* out)
+  {
+    const int x0 = static_cast<int>(std::floor(x));
+    const int y0 = static_cast<int>(std::floor(y));
+    const float fx = x - x0;
+    const float fy = y - y0;
+
+    for (int c = 0; c < source.channels(); ++c)
+      out[c] = (1 - fx) * (1 - fy) * pixel_or_zero(source, x0, y0, c)
+             + fx * (1 - fy) * pixel_or_zero(source, x0 + 1, y0, c)
+             + (1 - fx) * fy * pixel_or_zero(source, x0, y0 + 1, c)
+             + fx * fy * pixel_or_zero(source, x0 + 1, y0 + 1, c);
+  }
+
+  //floor для SSE2: усечение к нулю, минус 1 там, где оно округлило вверх
+  inline __m128i floor_epi32(__m128 value)
+  {
+    const __m128i truncated = _mm_cvttps_epi32(value);
+    const __m128 greater = _mm_cmpgt_ps(_mm_cvtepi32_ps(truncated), value);
+    return _mm_add_epi32(truncated, _mm_castps_si128(greater));
+  }
+}
+
+void extract_patches(const cv::Mat& image, const std::vector<cv::KeyPoint>& keypoints, cv::Mat& patches,
+                     int patch_size, size_t threads)
+{
+  const int channels = image.channels();
+  const int row_size = patch_size * patch_size * channels;
+
+  //Одно приведение к float на всю картинку, дальше только выборка
+  cv::Mat source;
+  image.convertTo(source, CV_MAKETYPE(CV_32F, channels));
+
+  patches.create(keypoints.size(), row_size, CV_32F);
+
+  const int width = source.cols;
+  const int height = source.rows;
+  const float half = (patch_size - 1) * 0.5f;
+
+  parallel_for(keypoints.size(), 64, [&](size_t begin, size_t end) {
+    int xs[4], ys[4];
+    float corners[4][4];
+    float values[4];
+
+    for (size_t k = begin; k < end; ++k)
+    {
+      const cv::KeyPoint& keypoint = keypoints[k];
+      const float angle = keypoint.angle * static_cast<float>(CV_PI / 180);
+      const float alpha = std::cos(angle);
+      const float beta = std::sin(angle);
+
+      //Кусок выпуклый, так что если все его углы внутри, внутри и все выборки
+      //вместе с правыми и нижними соседями - проверки границ не нужны. Запас в пиксель -
+      //на расхождение округления углов и точек, набранных шагами по строке
+      bool inside = true;
+      for (int corner = 0; corner < 4; ++corner)
+      {
+        const float du = (corner & 1 ? half : -half);
+        const float dv = (corner & 2 ? half : -half);
+        const float x = keypoint.pt.x + alpha * du - beta * dv;
+        const float y = keypoint.pt.y + beta * du + alpha * dv;
+        inside = inside && x >= 1 && y >= 1 && x < width - 2 && y < height - 2;
+      }
+
+      float* out = patches.ptr<float>(k);
+      const __m128 steps = _mm_set_ps(3, 2, 1, 0);
+
+      for (int v = 0; v < patch_size; ++v)
+      {
+        //Вдоль строки куска точка в исходной картинке сдвигается на (alpha, beta)
+        const float dy = v - half;
+        const float row_x = keypoint.pt.x - half * alpha - beta * dy;
+        const float row_y = keypoint.pt.y - half * beta + alpha * dy;
+
+        //По 4 точки строки: координаты, доли и веса считаются SSE, четыре угла
+        //каждой точки выбираются по одному - в SSE2 нет gather
+        int u = 0;
+        for (; u + 4 <= patch_size; u += 4)
+        {
+          const __m128 offset = _mm_add_ps(_mm_set1_ps(static_cast<float>(u)), steps);
+          const __m128 x = _mm_add_ps(_mm_set1_ps(row_x), _mm_mul_ps(offset, _mm_set1_ps(alpha)));
+          const __m128 y = _mm_add_ps(_mm_set1_ps(row_y), _mm_mul_ps(offset, _mm_set1_ps(beta)));
+
+          const __m128i x0 = floor_epi32(x);
+          const __m128i y0 = floor_epi32(y);
+          const __m128 fx = _mm_sub_ps(x, _mm_cvtepi32_ps(x0));
+          const __m128 fy = _mm_sub_ps(y, _mm_cvtepi32_ps(y0));
+          const __m128 one = _mm_set1_ps(1);
+          const __m128 gx = _mm_sub_ps(one, fx);
+          const __m128 gy = _mm_sub_ps(one, fy);
+
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(xs), x0);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(ys), y0);
+
+          for (int c = 0; c < channels; ++c)
+          {
+            for (int i = 0; i < 4; ++i)
+            {
+              if (inside)
+              {
+                const float* top = source.ptr<float>(ys[i]) + xs[i] * channels + c;
+                const float* bottom = source.ptr<float>(ys[i] + 1) + xs[i] * channels + c;
+                corners[0][i] = top[0];
+                corners[1][i] = top[channels];
+                corners[2][i] = bottom[0];
+                corners[3][i] = bottom[channels];
+              }
+              else
+              {
+                corners[0][i] = pixel_or_zero(source, xs[i], ys[i], c);
+                corners[1][i] = pixel_or_zero(source, xs[i] + 1, ys[i], c);
+                corners[2][i] = pixel_or_zero(source, xs[i], ys[i] + 1, c);
+                corners[3][i] = pixel_or_zero(source, xs[i] + 1, ys[i] + 1, c);
+              }
+            }
+
+            const __m128 top = _mm_add_ps(_mm_mul_ps(gx, _mm_loadu_ps(corners[0])), _mm_mul_ps(fx, _mm_loadu_ps(corners[1])));
+            const __m128 bottom = _mm_add_ps(_mm_mul_ps(gx, _mm_loadu_ps(corners[2])), _mm_mul_ps(fx, _mm_loadu_ps(corners[3])));
+            const __m128 result = _mm_add_ps(_mm_mul_ps(gy, top), _mm_mul_ps(fy, bottom));
+
+            if (channels == 1)
+              _mm_storeu_ps(out + u, result);
+            else
+            {
+              _mm_storeu_ps(values, result);
+              for (int i = 0; i < 4; ++i)
+                out[(u + i) * channels + c] = values[i];
+            }
+          }
+        }
+
+        for (; u < patch_size; ++u)
+          sample_point(source, row_x + u * alpha, row_y + u * beta, out + u * channels);
+
+        out += patch_size * channels;
+      }
+    }
+  }, threads);
+}
+
+cv::Mat patch_at(const cv::Mat& patches, int index, int channels, int patch_size)
+{
+  return cv::Mat(patch_size, patch_size, CV_MAKETYPE(CV_32F, channels), const_cast<float*>(patches.ptr<float>(index)));
+}
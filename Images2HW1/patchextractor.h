@@ -0,0 +1,24 @@
+#ifndef PATCHEXTRACTOR_H
+#define PATCHEXTRACTOR_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+const int PATCH_SIZE = 16;
+
+//Вырезать повёрнутые по keypoint.angle куски patch_size x patch_size вокруг всех ключевых точек.
+//Каждый пиксел куска берётся из исходной картинки билинейной интерполяцией
+//в точке c + [[cos, -sin], [sin, cos]] * d, где c - центр точки, d - смещение пиксела
+//от центра куска, так что работа O(patch_size^2) на точку, а не O(размер картинки).
+//Результат - CV_32F, строка на точку, patch_size * patch_size * channels чисел подряд.
+//Снаружи картинки - нули, как у warpAffine с границей по умолчанию.
+//Строка куска считается по 4 пиксела SSE, точки делятся между threads потоками (0 - все ядра).
+void extract_patches(const cv::Mat& image, const std::vector<cv::KeyPoint>& keypoints, cv::Mat& patches,
+                     int patch_size = PATCH_SIZE, size_t threads = 0);
+
+//Кусок index из результата extract_patches как картинка patch_size x patch_size, без копирования
+cv::Mat patch_at(const cv::Mat& patches, int index, int channels, int patch_size = PATCH_SIZE);
+
+#endif // PATCHEXTRACTOR_H
@@ -0,0 +1,267 @@
+#include "siftpipeline.h"
+#include "boundedqueue.h"
+#include "parallel.h"
+#include "patchextractor.h"
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/nonfree/features2d.hpp>
+
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+
+namespace
+{
+  struct ImagePath
+  {
+    std::string path;
+    int category;
+  };
+
+  struct DecodedImage
+  {
+    std::string path;
+    int category;
+    cv::Mat image;
+  };
+
+  double seconds_since(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  //Первое исключение любой стадии. fail закрывает все очереди через cancel,
+  //чтобы никто не остался ждать в push или pop
+  class PipelineFailure
+  {
+  public:
+    PipelineFailure(const std::function<void()>& cancel)
+      : m_cancel(cancel), m_failed(false)
+    {
+    }
+
+    void fail(std::exception_ptr error)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_error)
+          m_error = error;
+      }
+      m_failed = true;
+      m_cancel();
+    }
+
+    bool failed() const
+    {
+      return m_failed;
+    }
+
+    void rethrow() const
+    {
+      if (m_error)
+        std::rethrow_exception(m_error);
+    }
+
+  private:
+    std::function<void()> m_cancel;
+    std::mutex m_mutex;
+    std::exception_ptr m_error;
+    std::atomic<bool> m_failed;
+  };
+
+  //Запустить threads потоков worker, последний завершившийся закрывает output
+  template <class Queue, class Worker>
+  std::vector<std::thread> start_stage(size_t threads, Queue& output, PipelineFailure& failure, Worker worker)
+  {
+    std::shared_ptr<std::atomic<size_t>> running = std::make_shared<std::atomic<size_t>>(threads);
+
+    std::vector<std::thread> result;
+    for (size_t i = 0; i < threads; ++i)
+      result.emplace_back([running, &output, &failure, worker]() {
+        try
+        {
+          worker();
+        }
+        catch (...)
+        {
+          failure.fail(std::current_exception());
+        }
+
+        if (--*running == 0)
+          output.close();
+      });
+    return result;
+  }
+}
+
+SiftPipeline::SiftPipeline(const PipelineParams& params)
+  : m_params(params), m_seconds(0)
+{
+  if (m_params.decode_threads == 0)
+    m_params.decode_threads = hardware_threads();
+  if (m_params.extract_threads == 0)
+    m_params.extract_threads = hardware_threads();
+}
+
+void SiftPipeline::run(const std::string& root, const std::function<void(ExtractedImage&&)>& sink)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  BoundedQueue<ImagePath> paths(m_params.queue_capacity);
+  BoundedQueue<DecodedImage> images(m_params.queue_capacity);
+  BoundedQueue<ExtractedImage> results(m_params.queue_capacity);
+
+  PipelineFailure failure([&]() {
+    paths.close();
+    images.close();
+    results.close();
+  });
+
+  m_stats.assign(1, StageStats("walk", 1));
+  m_stats.push_back(StageStats("decode", m_params.decode_threads));
+  m_stats.push_back(StageStats("extract", m_params.extract_threads));
+  m_stats.push_back(StageStats("sink", 1));
+
+  std::mutex stats_mutex;
+  auto account = [&](size_t stage, size_t items, double busy) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    m_stats[stage].items += items;
+    m_stats[stage].busy += busy;
+  };
+
+  std::vector<std::thread> walkers = start_stage(1, paths, failure, [&]() {
+    size_t items = 0;
+    double busy = 0;
+    auto busy_start = std::chrono::steady_clock::now();
+
+    QDir directory(QString::fromStdString(root));
+    QStringList dirs = directory.entryList();
+    for (int i = 0; i < dirs.size() && !failure.failed(); ++i)
+    {
+      if (dirs[i] == "." || dirs[i] == "..")
+        continue;
+
+      QDirIterator iterator(directory.absolutePath() + QDir::separator() + dirs[i]);
+      while (iterator.hasNext() && !failure.failed())
+      {
+        const QString next = iterator.next();
+        if (!iterator.fileInfo().isFile())
+          continue;
+
+        ImagePath item = { next.toStdString(), i };
+        busy += seconds_since(busy_start);
+        if (!paths.push(std::move(item)))
+          break;
+        busy_start = std::chrono::steady_clock::now();
+        ++items;
+      }
+    }
+
+    busy += seconds_since(busy_start);
+    account(0, items, busy);
+  });
+
+  std::vector<std::thread> decoders = start_stage(m_params.decode_threads, images, failure, [&]() {
+    size_t items = 0;
+    double busy = 0;
+
+    ImagePath item;
+    while (!failure.failed() && paths.pop(item))
+    {
+      const auto busy_start = std::chrono::steady_clock::now();
+      DecodedImage decoded = { item.path, item.category, cv::imread(item.path) };
+      busy += seconds_since(busy_start);
+
+      if (!decoded.image.empty())
+      {
+        if (!images.push(std::move(decoded)))
+          break;
+        ++items;
+      }
+    }
+
+    account(1, items, busy);
+  });
+
+  std::vector<std::thread> extractors = start_stage(m_params.extract_threads, results, failure, [&]() {
+    size_t items = 0;
+    double busy = 0;
+
+    //Детектор не потокобезопасен, поэтому у каждого потока свой
+    cv::SIFT detector;
+    std::vector<cv::KeyPoint> keypoints;
+
+    DecodedImage item;
+    while (!failure.failed() && images.pop(item))
+    {
+      const auto busy_start = std::chrono::steady_clock::now();
+      ExtractedImage extracted = { item.path, item.category, cv::Mat(), cv::Mat() };
+      detector(item.image, cv::noArray(), keypoints, extracted.descriptors);
+      //Куски по тем же точкам, пока картинка ещё в памяти. Поток стадии уже один из
+      //extract_threads, поэтому без своего параллелизма
+      if (m_params.patch_size > 0)
+        extract_patches(item.image, keypoints, extracted.patches, m_params.patch_size, 1);
+      busy += seconds_since(busy_start);
+
+      if (!results.push(std::move(extracted)))
+        break;
+      ++items;
+    }
+
+    account(2, items, busy);
+  });
+
+  size_t items = 0;
+  double busy = 0;
+  try
+  {
+    ExtractedImage item;
+    while (!failure.failed() && results.pop(item))
+    {
+      const auto busy_start = std::chrono::steady_clock::now();
+      sink(std::move(item));
+      busy += seconds_since(busy_start);
+      ++items;
+    }
+  }
+  catch (...)
+  {
+    failure.fail(std::current_exception());
+  }
+  account(3, items, busy);
+
+  for (std::vector<std::thread>* stage : { &walkers, &decoders, &extractors })
+    for (std::thread& thread : *stage)
+      thread.join();
+
+  m_stats[0].output_wait = paths.push_wait();
+  m_stats[1].input_wait = paths.pop_wait();
+  m_stats[1].output_wait = images.push_wait();
+  m_stats[2].input_wait = images.pop_wait();
+  m_stats[2].output_wait = results.push_wait();
+  m_stats[3].input_wait = results.pop_wait();
+
+  m_seconds = seconds_since(start);
+  failure.rethrow();
+}
+
+void SiftPipeline::print_stats(std::ostream& stream) const
+{
+  stream << "Pipeline: " << m_seconds << " s" << std::endl;
+  for (const StageStats& stage : m_stats)
+  {
+    //Занятость - доля времени потоков стадии, потраченная на саму работу
+    const double thread_seconds = m_seconds * stage.threads;
+    stream << "  " << stage.name << " x" << stage.threads
+           << ": " << stage.items << " items, " << (m_seconds > 0 ? stage.items / m_seconds : 0) << " items/s"
+           << ", busy " << (thread_seconds > 0 ? 100 * stage.busy / thread_seconds : 0) << "%"
+           << ", waiting for input " << stage.input_wait << " s"
+           << ", blocked on output " << stage.output_wait << " s" << std::endl;
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef SIFTPIPELINE_H
+#define SIFTPIPELINE_H
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+struct ExtractedImage
+{
+  std::string path;
+  //Номер подкаталога категории в списке каталога, как его отдаёт QDir::entryList
+  int category;
+  cv::Mat descriptors;
+  //Повёрнутые куски вокруг точек (extract_patches), если PipelineParams::patch_size > 0
+  cv::Mat patches;
+};
+
+struct PipelineParams
+{
+  PipelineParams(size_t decode_threads = 2, size_t extract_threads = 0, size_t queue_capacity = 64,
+                 int patch_size = 0)
+    : decode_threads(decode_threads), extract_threads(extract_threads), queue_capacity(queue_capacity),
+      patch_size(patch_size)
+  {
+  }
+
+  //0 - по числу ядер
+  size_t decode_threads;
+  //0 - по числу ядер
+  size_t extract_threads;
+  //Сколько элементов может ждать между соседними стадиями
+  size_t queue_capacity;
+  //Размер кусков вокруг точек для ExtractedImage::patches, 0 - не вырезать
+  int patch_size;
+};
+
+//Извлечение SIFT из всех картинок дерева каталогов конвейером:
+//обход каталогов -> декодирование (decode_threads) -> поиск точек и дескрипторов
+//за один проход (extract_threads, у каждого свой детектор) -> sink в вызывающем потоке.
+//Стадии связаны очередями ограниченного размера, так что память не растёт,
+//если какая-то стадия отстаёт.
+class SiftPipeline
+{
+public:
+  SiftPipeline(const PipelineParams& params = PipelineParams());
+
+  //sink вызывается для каждой картинки в порядке готовности, из вызывающего потока.
+  //Исключение из sink или из потока стадии останавливает конвейер: очереди закрываются,
+  //потоки дожидаются, и первое исключение пробрасывается из run
+  void run(const std::string& root, const std::function<void(ExtractedImage&&)>& sink);
+
+  //Для каждой стадии: сколько элементов, сколько в секунду, занятость потоков,
+  //ожидание входа и блокировка на выходе
+  void print_stats(std::ostream& stream) const;
+
+private:
+  struct StageStats
+  {
+    StageStats(const std::string& name = "", size_t threads = 0)
+      : name(name), threads(threads), items(0), busy(0), input_wait(0), output_wait(0)
+    {
+    }
+
+    std::string name;
+    size_t threads;
+    size_t items;
+    double busy;
+    double input_wait;
+    double output_wait;
+  };
+
+  PipelineParams m_params;
+  std::vector<StageStats> m_stats;
+  double m_seconds;
+};
+
+#endif // SIFTPIPELINE_H
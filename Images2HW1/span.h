@@ -0,0 +1,54 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <cstddef>
+
+//Невладеющий вид на непрерывный кусок памяти
+template <class T>
+class Span
+{
+public:
+  Span() : m_data(nullptr), m_size(0)
+  {
+  }
+
+  Span(T* data, size_t size) : m_data(data), m_size(size)
+  {
+  }
+
+  T* begin() const
+  {
+    return m_data;
+  }
+
+  T* end() const
+  {
+    return m_data + m_size;
+  }
+
+  T* data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  bool empty() const
+  {
+    return m_size == 0;
+  }
+
+  T& operator[](size_t i) const
+  {
+    return m_data[i];
+  }
+
+private:
+  T* m_data;
+  size_t m_size;
+};
+
+#endif // SPAN_H
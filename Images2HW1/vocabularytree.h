@@ -0,0 +1,257 @@
+#ifndef VOCABULARYTREE_H
+#define VOCABULARYTREE_H
+
+#include "distance.h"
+#include "hamerlykmeans.h"
+#include "parallel.h"
+#include "span.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+//Иерархический k-means (Nister, Stewenius, Scalable recognition with a vocabulary tree).
+//Каждый узел делит свои дескрипторы на branching частей тем же точным k-means,
+//что и ClusterSpace::build, до глубины depth. Слова - листья, их до branching^depth.
+//Слово для дескриптора ищется спуском от корня: на каждом уровне выбирается
+//ближайший из не более чем branching детей, то есть O(branching * depth) расстояний.
+//Дети без строк не заводятся, так что пустых слов и пустых ветвей нет.
+template <size_t Dim>
+class VocabularyTree
+{
+public:
+  VocabularyTree() : m_branching(0), m_depth(0), m_words(0)
+  {
+  }
+
+  //data - CV_32F или CV_64F, Dim столбцов
+  void build(const cv::Mat& data, int branching, int depth, int iterations = 20)
+  {
+    assert(data.cols == static_cast<int>(Dim));
+    assert(branching > 1 && depth > 0);
+
+    m_branching = branching;
+    m_depth = depth;
+
+    cv::Mat double_data;
+    data.convertTo(double_data, CV_64F);
+
+    //Центр корня - среднее, он нужен, только если корень остался листом
+    m_centers.assign(Dim, 0.0);
+    for (int r = 0; r < double_data.rows; ++r)
+      for (size_t j = 0; j < Dim; ++j)
+        m_centers[j] += double_data.ptr<double>(r)[j] / double_data.rows;
+    m_firstChild.assign(1, -1);
+    m_childCount.assign(1, 0);
+    m_rowBegin.assign(1, 0);
+    m_rowEnd.assign(1, data.rows);
+
+    //Строки каждого узла уровня - подряд идущий кусок order, как в ClusterSpace
+    std::vector<int> order(data.rows);
+    std::iota(order.begin(), order.end(), 0);
+
+    std::vector<PendingNode> level(1, PendingNode(0, 0, data.rows));
+    for (int l = 0; l < depth && !level.empty(); ++l)
+    {
+      std::cerr << "Vocabulary tree level " << l << ": " << level.size() << " nodes" << std::endl;
+
+      std::vector<std::vector<int>> labels(level.size());
+      std::vector<cv::Mat> centers(level.size());
+
+      //Пока узлов мало, параллелим сам k-means, потом - узлы целиком по одному потоку
+      const bool parallel_nodes = level.size() >= hardware_threads();
+      auto cluster_node = [&](size_t i) {
+        const PendingNode& node = level[i];
+        const size_t size = node.end - node.begin;
+        if (size <= static_cast<size_t>(branching))
+          return;
+
+        cv::Mat rows(size, Dim, CV_64F);
+        for (size_t r = 0; r < size; ++r)
+          std::copy(double_data.ptr<double>(order[node.begin + r]),
+                    double_data.ptr<double>(order[node.begin + r]) + Dim, rows.ptr<double>(r));
+
+        HamerlyKMeans<Dim> kmeans(branching, iterations, node.id, parallel_nodes ? 1 : 0);
+        labels[i] = kmeans.fit(rows);
+        centers[i] = kmeans.centers();
+      };
+
+      if (parallel_nodes)
+        parallel_for(level.size(), 1, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i)
+            cluster_node(i);
+        });
+      else
+        for (size_t i = 0; i < level.size(); ++i)
+          cluster_node(i);
+
+      std::vector<PendingNode> next;
+      for (size_t i = 0; i < level.size(); ++i)
+        if (!labels[i].empty())
+          split(level[i], labels[i], centers[i], order, next);
+
+      level.swap(next);
+    }
+
+    //Листья нумеруются в порядке узлов, их строки выкладываются подряд в том же порядке
+    m_wordOf.assign(m_firstChild.size(), -1);
+    m_leaves.clear();
+    m_wordOffsets.assign(1, 0);
+    m_rows.clear();
+    m_words = 0;
+    for (size_t node = 0; node < m_firstChild.size(); ++node)
+      if (m_firstChild[node] < 0)
+      {
+        m_wordOf[node] = m_words++;
+        m_leaves.push_back(node);
+        m_rows.insert(m_rows.end(), order.begin() + m_rowBegin[node], order.begin() + m_rowEnd[node]);
+        m_wordOffsets.push_back(m_rows.size());
+      }
+  }
+
+  //Номер слова для одного дескриптора
+  int assign(const double* descriptor) const
+  {
+    int node = 0;
+    while (m_firstChild[node] >= 0)
+    {
+      const int first = m_firstChild[node];
+      int best = first;
+      double best_distance = std::numeric_limits<double>::max();
+      for (int child = first; child < first + m_childCount[node]; ++child)
+      {
+        const double distance = l2_squared<Dim>(descriptor, &m_centers[child * Dim]);
+        if (distance < best_distance)
+        {
+          best_distance = distance;
+          best = child;
+        }
+      }
+      node = best;
+    }
+
+    return m_wordOf[node];
+  }
+
+  //Слова для всех дескрипторов картинки (CV_32F или CV_64F)
+  std::vector<int> assign(const cv::Mat& descriptors) const
+  {
+    assert(descriptors.cols == static_cast<int>(Dim));
+
+    cv::Mat double_descriptors;
+    descriptors.convertTo(double_descriptors, CV_64F);
+
+    std::vector<int> words(descriptors.rows);
+    parallel_for(descriptors.rows, 256, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i)
+        words[i] = assign(double_descriptors.ptr<double>(i));
+    });
+
+    return words;
+  }
+
+  int words() const
+  {
+    return m_words;
+  }
+
+  //Центр листа слова word, Dim чисел
+  const double* center(int word) const
+  {
+    return &m_centers[m_leaves[word] * Dim];
+  }
+
+  //Номера строк build, попавших в слово word
+  Span<const int> rows(int word) const
+  {
+    return Span<const int>(m_rows.data() + m_wordOffsets[word], m_wordOffsets[word + 1] - m_wordOffsets[word]);
+  }
+
+  size_t nodes() const
+  {
+    return m_firstChild.size();
+  }
+
+  int branching() const
+  {
+    return m_branching;
+  }
+
+  int depth() const
+  {
+    return m_depth;
+  }
+
+private:
+  struct PendingNode
+  {
+    PendingNode(int id, size_t begin, size_t end) : id(id), begin(begin), end(end)
+    {
+    }
+
+    int id;
+    size_t begin;
+    size_t end;
+  };
+
+  //Разложить кусок order узла по кластерам и завести детей для непустых из них.
+  //Пустой кластер стал бы словом без членов, а спуск в assign мог бы в него свернуть
+  void split(const PendingNode& node, const std::vector<int>& labels, const cv::Mat& centers,
+             std::vector<int>& order, std::vector<PendingNode>& next)
+  {
+    std::vector<size_t> offsets(centers.rows + 1, 0);
+    for (int label : labels)
+      ++offsets[label + 1];
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    std::vector<int> rows(order.begin() + node.begin, order.begin() + node.end);
+    std::vector<size_t> position(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < rows.size(); ++i)
+      order[node.begin + position[labels[i]]++] = rows[i];
+
+    const int first = m_firstChild.size();
+    m_firstChild[node.id] = first;
+    for (int c = 0; c < centers.rows; ++c)
+    {
+      if (offsets[c + 1] == offsets[c])
+        continue;
+
+      const int child = m_firstChild.size();
+      m_firstChild.push_back(-1);
+      m_childCount.push_back(0);
+      m_rowBegin.push_back(node.begin + offsets[c]);
+      m_rowEnd.push_back(node.begin + offsets[c + 1]);
+      m_centers.insert(m_centers.end(), centers.ptr<double>(c), centers.ptr<double>(c) + Dim);
+
+      next.push_back(PendingNode(child, m_rowBegin.back(), m_rowEnd.back()));
+    }
+    m_childCount[node.id] = m_firstChild.size() - first;
+  }
+
+  int m_branching;
+  int m_depth;
+  int m_words;
+
+  //Центры всех узлов подряд, nodes x Dim
+  std::vector<double> m_centers;
+  //Дети узла - m_childCount[node] узлов подряд с m_firstChild[node], -1 у листьев
+  std::vector<int> m_firstChild;
+  std::vector<int> m_childCount;
+  //Кусок order узла при построении
+  std::vector<size_t> m_rowBegin;
+  std::vector<size_t> m_rowEnd;
+  std::vector<int> m_wordOf;
+  //Узел листа для каждого слова
+  std::vector<int> m_leaves;
+
+  //Строки слова word - m_rows[m_wordOffsets[word]..m_wordOffsets[word + 1])
+  std::vector<size_t> m_wordOffsets;
+  std::vector<int> m_rows;
+};
+
+#endif // VOCABULARYTREE_H
@@ -3,6 +3,25 @@ CONFIG += console
 CONFIG -= app_bundle
 CONFIG -= qt
 
-SOURCES += main.cpp
+SOURCES += main.cpp \
+    bilateralgrid.cpp \
+    denoisepresets.cpp \
+    notchfilter.cpp \
+    parametersearch.cpp \
+    qualitymetrics.cpp \
+    tiledimage.cpp \
+    tilednotch.cpp
+
+HEADERS += \
+    bilateralgrid.h \
+    denoisepresets.h \
+    notchfilter.h \
+    parallelloop.h \
+    parametersearch.h \
+    qualitymetrics.h \
+    tiledimage.h \
+    tilednotch.h
 
 LIBS += -lopencv_core -lopencv_highgui -lopencv_imgproc
+
+QMAKE_CXXFLAGS += -std=c++11
@@ -0,0 +1,210 @@
+#include "bilateralgrid.h"
+#include "parallelloop.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+namespace
+{
+  //Поле из пустых ячеек вокруг данных, чтобы размытие и интерполяция не выходили за сетку
+  const int PADDING = 2;
+
+  const float BLUR_KERNEL[] = { 1 / 16.f, 4 / 16.f, 6 / 16.f, 4 / 16.f, 1 / 16.f };
+
+  //Координата в сетке: целая часть и дробная
+  inline void gridCoordinate(double value, double step, int& cell, float& fraction)
+  {
+    const double position = value / step + PADDING;
+    cell = static_cast<int>(position);
+    fraction = static_cast<float>(position - cell);
+  }
+}
+
+BilateralGrid::BilateralGrid(double sigmaSpace, double sigmaColor)
+  : m_sigmaSpace(sigmaSpace), m_sigmaColor(sigmaColor)
+{
+}
+
+Mat BilateralGrid::apply(const Mat& image) const
+{
+  assert(image.type() == CV_8UC1 || image.type() == CV_8UC3);
+
+  Mat guide;
+  if (image.channels() == 3)
+    cvtColor(image, guide, CV_BGR2GRAY);
+  else
+    guide = image;
+  guide.convertTo(guide, CV_32F);
+
+  const double colorStep = m_sigmaColor / image.channels();
+
+  Grid grid;
+  grid.width = static_cast<int>((image.cols - 1) / m_sigmaSpace) + 2 + 2 * PADDING;
+  grid.height = static_cast<int>((image.rows - 1) / m_sigmaSpace) + 2 + 2 * PADDING;
+  grid.depth = static_cast<int>(255 / colorStep) + 2 + 2 * PADDING;
+  grid.values = image.channels() + 1;
+  grid.data.resize(static_cast<size_t>(grid.width) * grid.height * grid.depth * grid.values);
+
+  Grid buffer = grid;
+
+  splat(image, guide, colorStep, grid);
+  blur(grid, buffer);
+
+  Mat result(image.size(), image.type());
+  slice(guide, colorStep, grid, result);
+  return result;
+}
+
+void BilateralGrid::splat(const Mat& image, const Mat& guide, double colorStep, Grid& grid) const
+{
+  const int channels = image.channels();
+
+  //Каждая строка сетки собирает пиксели сама, без общих записей между потоками:
+  //в строку gy попадают строки картинки с gy - 1 < y / sigmaSpace + PADDING < gy + 1
+  parallelFor(grid.height, [&](const Range& range) {
+    for (int gy = range.start; gy < range.end; ++gy)
+    {
+      std::fill(grid.cell(0, gy, 0), grid.cell(0, gy, 0) + grid.width * grid.depth * grid.values, 0.f);
+
+      const int first = std::max(0, static_cast<int>(std::floor((gy - 1 - PADDING) * m_sigmaSpace)));
+      const int last = std::min(image.rows - 1, static_cast<int>(std::ceil((gy + 1 - PADDING) * m_sigmaSpace)));
+      for (int y = first; y <= last; ++y)
+      {
+        int cellY;
+        float fractionY;
+        gridCoordinate(y, m_sigmaSpace, cellY, fractionY);
+
+        float weightY;
+        if (cellY == gy)
+          weightY = 1 - fractionY;
+        else if (cellY + 1 == gy)
+          weightY = fractionY;
+        else
+          continue;
+
+        const uchar* pixels = image.ptr<uchar>(y);
+        const float* luma = guide.ptr<float>(y);
+        for (int x = 0; x < image.cols; ++x)
+        {
+          int cellX, cellZ;
+          float fractionX, fractionZ;
+          gridCoordinate(x, m_sigmaSpace, cellX, fractionX);
+          gridCoordinate(luma[x], colorStep, cellZ, fractionZ);
+
+          for (int dx = 0; dx < 2; ++dx)
+          {
+            const float weightX = weightY * (dx ? fractionX : 1 - fractionX);
+            for (int dz = 0; dz < 2; ++dz)
+            {
+              const float weight = weightX * (dz ? fractionZ : 1 - fractionZ);
+              float* cell = grid.cell(cellX + dx, gy, cellZ + dz);
+              for (int c = 0; c < channels; ++c)
+                cell[c] += weight * pixels[x * channels + c];
+              cell[channels] += weight;
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+void BilateralGrid::blur(Grid& grid, Grid& buffer)
+{
+  //Оси по очереди: z, x, y. Шаг соседней ячейки вдоль оси в числах float и число ячеек
+  const size_t strides[] = { static_cast<size_t>(grid.values),
+                             static_cast<size_t>(grid.depth) * grid.values,
+                             static_cast<size_t>(grid.width) * grid.depth * grid.values };
+  const int sizes[] = { grid.depth, grid.width, grid.height };
+
+  Grid* source = &grid;
+  Grid* target = &buffer;
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    const size_t stride = strides[axis];
+    const int size = sizes[axis];
+
+    parallelFor(grid.height, [&](const Range& range) {
+      for (int gy = range.start; gy < range.end; ++gy)
+      {
+        for (int gx = 0; gx < grid.width; ++gx)
+        {
+          for (int gz = 0; gz < grid.depth; ++gz)
+          {
+            const int coordinates[] = { gz, gx, gy };
+            const int position = coordinates[axis];
+
+            const float* in = source->cell(gx, gy, gz);
+            float* out = target->cell(gx, gy, gz);
+            std::fill(out, out + grid.values, 0.f);
+
+            for (int k = -2; k <= 2; ++k)
+            {
+              if (position + k < 0 || position + k >= size)
+                continue;
+
+              const float* neighbour = in + static_cast<ptrdiff_t>(k) * static_cast<ptrdiff_t>(stride);
+              for (int v = 0; v < grid.values; ++v)
+                out[v] += BLUR_KERNEL[k + 2] * neighbour[v];
+            }
+          }
+        }
+      }
+    });
+
+    std::swap(source, target);
+  }
+
+  //После нечётного числа проходов результат в buffer
+  grid.data.swap(buffer.data);
+}
+
+void BilateralGrid::slice(const Mat& guide, double colorStep, Grid& grid, Mat& result) const
+{
+  const int channels = result.channels();
+
+  parallelFor(result.rows, [&](const Range& range) {
+    std::vector<float> values(grid.values);
+    for (int y = range.start; y < range.end; ++y)
+    {
+      int cellY;
+      float fractionY;
+      gridCoordinate(y, m_sigmaSpace, cellY, fractionY);
+
+      const float* luma = guide.ptr<float>(y);
+      uchar* pixels = result.ptr<uchar>(y);
+      for (int x = 0; x < result.cols; ++x)
+      {
+        int cellX, cellZ;
+        float fractionX, fractionZ;
+        gridCoordinate(x, m_sigmaSpace, cellX, fractionX);
+        gridCoordinate(luma[x], colorStep, cellZ, fractionZ);
+
+        std::fill(values.begin(), values.end(), 0.f);
+        for (int dy = 0; dy < 2; ++dy)
+        {
+          for (int dx = 0; dx < 2; ++dx)
+          {
+            for (int dz = 0; dz < 2; ++dz)
+            {
+              const float weight = (dy ? fractionY : 1 - fractionY) * (dx ? fractionX : 1 - fractionX)
+                                 * (dz ? fractionZ : 1 - fractionZ);
+              const float* cell = grid.cell(cellX + dx, cellY + dy, cellZ + dz);
+              for (int v = 0; v < grid.values; ++v)
+                values[v] += weight * cell[v];
+            }
+          }
+        }
+
+        //Вес не нулевой: в ячейке самого пикселя после размытия что-то есть
+        for (int c = 0; c < channels; ++c)
+          pixels[x * channels + c] = saturate_cast<uchar>(values[c] / values[channels]);
+      }
+    }
+  });
+}
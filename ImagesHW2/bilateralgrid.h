@@ -0,0 +1,52 @@
+#ifndef BILATERALGRID_H
+#define BILATERALGRID_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+//Приближённый билатеральный фильтр через билатеральную сетку (Chen, Paris, Durand,
+//Real-time edge-aware image processing with the bilateral grid).
+//
+//Пиксели раскладываются в трёхмерную сетку (x / sigmaSpace, y / sigmaSpace, яркость / sigmaColor)
+//с весами трилинейной интерполяции; в каждой ячейке копятся сумма цветов и число пикселей.
+//Сетка размывается гауссом [1 4 6 4 1] / 16 по всем трём осям, и результат читается
+//обратно трилинейной интерполяцией с делением на накопленный вес. Ячеек в sigmaSpace^2
+//раз меньше, чем пикселей, так что стоимость на пиксель не зависит от sigmaSpace,
+//а большие sigmaSpace даже быстрее.
+//
+//Цветная картинка фильтруется по яркости: одна сетка с четырьмя числами в ячейке (B, G, R, вес).
+//bilateralFilter в OpenCV сравнивает цвета по сумме модулей разностей трёх каналов,
+//поэтому для трёх каналов шаг по яркости - sigmaColor / 3.
+class BilateralGrid
+{
+public:
+  BilateralGrid(double sigmaSpace, double sigmaColor);
+
+  //CV_8UC1 или CV_8UC3, результат того же типа
+  cv::Mat apply(const cv::Mat& image) const;
+
+private:
+  struct Grid
+  {
+    int width;
+    int height;
+    int depth;
+    int values;
+    std::vector<float> data;
+
+    float* cell(int x, int y, int z)
+    {
+      return &data[((static_cast<size_t>(y) * width + x) * depth + z) * values];
+    }
+  };
+
+  void splat(const cv::Mat& image, const cv::Mat& guide, double colorStep, Grid& grid) const;
+  static void blur(Grid& grid, Grid& buffer);
+  void slice(const cv::Mat& guide, double colorStep, Grid& grid, cv::Mat& result) const;
+
+  double m_sigmaSpace;
+  double m_sigmaColor;
+};
+
+#endif // BILATERALGRID_H
@@ -0,0 +1,89 @@
+#include "denoisepresets.h"
+#include "notchfilter.h"
+
+#include <cassert>
+#include <memory>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+void addNotchStages(ParameterSearch& search, const std::vector<double>& thresholds,
+                    const std::vector<double>& notchWidths, const std::vector<double>& sharpens)
+{
+  //Только ради общего кэша SpectrumPlan
+  std::shared_ptr<NotchFilter> planner = std::make_shared<NotchFilter>();
+
+  //outputs: 0 - вход, 1 - спектр, 2 - логарифм модуля, 3 - пики, 4 - обратное dft без обрезки
+  search.addStage("dft", std::vector<double>(1, 0), [planner](const std::vector<Mat>& outputs,
+                                                              const std::vector<double>&) -> Mat {
+    assert(outputs[0].channels() == 1);
+    return planner->forward(outputs[0]);
+  });
+
+  search.addStage("magnitude", std::vector<double>(1, 0), [planner](const std::vector<Mat>& outputs,
+                                                                    const std::vector<double>&) -> Mat {
+    const Mat& spectrum = outputs[1];
+    return Mat(NotchFilter::logMagnitude(spectrum, *planner->plan(spectrum.rows, spectrum.cols)), true);
+  });
+
+  search.addStage("threshold", thresholds, [planner](const std::vector<Mat>& outputs,
+                                                     const std::vector<double>& values) -> Mat {
+    const Mat& spectrum = outputs[1];
+    const std::vector<float> magnitude(outputs[2].begin<float>(), outputs[2].end<float>());
+
+    const NotchFilter filter(values[2]);
+    std::vector<int> peaks = filter.detectPeaks(magnitude, *planner->plan(spectrum.rows, spectrum.cols));
+    //Первым лежит число пиков, так что Mat не бывает пустым и без пиков
+    peaks.insert(peaks.begin(), peaks.size());
+    return Mat(peaks, true);
+  });
+
+  search.addStage("notchWidth", notchWidths, [planner](const std::vector<Mat>& outputs,
+                                                       const std::vector<double>& values) -> Mat {
+    Mat spectrum = outputs[1].clone();
+    const std::vector<int> peaks(outputs[3].begin<int>() + 1, outputs[3].end<int>());
+
+    const NotchFilter filter(values[2], static_cast<int>(values[3]));
+    NotchFilter::applyMask(spectrum, filter.columnMask(peaks, *planner->plan(spectrum.rows, spectrum.cols)));
+
+    Mat result;
+    idft(spectrum, result, DFT_SCALE | DFT_REAL_OUTPUT);
+    return result;
+  });
+
+  search.addStage("sharpen", sharpens, [](const std::vector<Mat>& outputs,
+                                          const std::vector<double>& values) -> Mat {
+    const Mat& input = outputs[0];
+    const NotchFilter filter(values[2], static_cast<int>(values[3]), values[4]);
+
+    Mat result;
+    filter.sharpened(outputs[4](Rect(0, 0, input.cols, input.rows))).convertTo(result, input.depth());
+    return result;
+  });
+}
+
+void addDenoiseStages(ParameterSearch& search, const std::vector<double>& diameters,
+                      const std::vector<double>& sigmaSpaces, const std::vector<double>& sigmaColors,
+                      const std::vector<double>& medianSizes)
+{
+  search.addStage("d", diameters);
+  search.addStage("sigmaSpace", sigmaSpaces);
+  search.addStage("sigmaColor", sigmaColors, [](const std::vector<Mat>& outputs,
+                                                 const std::vector<double>& values) -> Mat {
+    Mat result;
+    bilateralFilter(outputs[0], result, static_cast<int>(values[0]), values[2], values[1]);
+    return result;
+  });
+
+  search.addStage("median", medianSizes, [](const std::vector<Mat>& outputs,
+                                             const std::vector<double>& values) -> Mat {
+    const int size = static_cast<int>(values[3]);
+    if (size <= 1)
+      return outputs.back();
+
+    Mat result;
+    medianBlur(outputs.back(), result, size);
+    return result;
+  });
+}
@@ -0,0 +1,19 @@
+#ifndef DENOISEPRESETS_H
+#define DENOISEPRESETS_H
+
+#include <vector>
+
+#include "parametersearch.h"
+
+//Стадии task3_5 для ParameterSearch: dft, логарифм спектра, threshold, notchWidth, sharpen.
+//Вход - одноканальная картинка. Лист совпадает с NotchFilter(threshold, notchWidth, sharpen).apply
+void addNotchStages(ParameterSearch& search, const std::vector<double>& thresholds,
+                    const std::vector<double>& notchWidths, const std::vector<double>& sharpens);
+
+//Стадии task3_6: параметры bilateralFilter (d, sigmaSpace, sigmaColor) и размер medianBlur
+//(1 - без него). bilateralFilter считается один раз на тройку, medianBlur - на каждый лист
+void addDenoiseStages(ParameterSearch& search, const std::vector<double>& diameters,
+                      const std::vector<double>& sigmaSpaces, const std::vector<double>& sigmaColors,
+                      const std::vector<double>& medianSizes);
+
+#endif // DENOISEPRESETS_H
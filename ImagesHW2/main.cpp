@@ -1,9 +1,18 @@
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
+#include "bilateralgrid.h"
+#include "denoisepresets.h"
+#include "notchfilter.h"
+#include "parametersearch.h"
+#include "qualitymetrics.h"
+#include "tilednotch.h"
+
 using namespace cv;
 
 const std::string LENA_ORIGINAL_GRAY = "./images/lena_gray_512.tif";
@@ -12,169 +21,276 @@ const std::string LENA_NOISED_GRAY = "./images/lena_diagonal.jpg";
 const std::string LENA_ORIGINAL = "./images/lena_color_512.tif";
 const std::string LENA_NOISED = "./images/lena_color_512-noise.tif";
 
-double mse(const Mat& im1, const Mat& im2)
+Mat original, noised, filtered;
+
+void task3_5()
 {
-  MatConstIterator_<uchar> it1 = im1.begin<uchar>();
-  MatConstIterator_<uchar> it2 = im2.begin<uchar>();
+  original = imread(LENA_ORIGINAL_GRAY, CV_LOAD_IMAGE_GRAYSCALE);
+  noised = imread(LENA_NOISED_GRAY, CV_LOAD_IMAGE_GRAYSCALE);
 
-  int n = 0;
-  double result = 0;
-  for (; it1 != im1.end<uchar>(); it1++, it2++)
-  {
-    result += std::pow((*it1 - *it2), 2);
-    ++n;
-  }
+  NotchFilter filter;
+  Mat result = filter.apply(noised);
+
+  std::cout << meanSquaredError(result, original) << std::endl;
+
+  imshow("result", result);
+  imshow("input image", original);
+  imshow("noised", noised);
 
-  return result / n;
+  std::stringstream ss;
+  ss << "lena_dft_filtered_mse=" << meanSquaredError(result, original) << ".jpg";
+
+  imwrite(ss.str(), result);
+  waitKey();
 }
-Mat original, noised, filtered;
 
-Mat prepareForDFT(const Mat& image)
+void task3_6()
 {
-  Mat result;
-  int n = getOptimalDFTSize(image.cols);
-  int m = getOptimalDFTSize(image.rows);
-  copyMakeBorder(image, result, 0, m - image.rows, 0,n - image.cols,
-                 BORDER_CONSTANT, Scalar::all(0));
-  return result;
+  original = imread(LENA_ORIGINAL);
+  noised = imread(LENA_NOISED);
+
+  int64 start = getTickCount();
+  bilateralFilter(noised, filtered, 9, 294, 4);
+  double exactSeconds = (getTickCount() - start) / getTickFrequency();
+
+  //Окно d = 9 обрезает гаусс с sigmaSpace = 4 на одной сигме, по размытию это примерно гаусс с сигмой 2
+  start = getTickCount();
+  Mat approximated = BilateralGrid(2, 294).apply(noised);
+  double gridSeconds = (getTickCount() - start) / getTickFrequency();
+
+  const double gridError = meanSquaredError(approximated, filtered);
+  std::cout << "bilateralFilter " << exactSeconds << " s, grid " << gridSeconds << " s, mse between them "
+            << gridError << std::endl;
+
+  medianBlur(filtered, filtered, 3);
+
+  QualityScores scores = measureQuality(filtered, original);
+  std::cout << "mse " << scores.mse << ", psnr " << scores.psnr << " dB, ssim " << scores.ssim << std::endl;
+
+  double MSError = scores.mse;
+
+  std::stringstream ss;
+  ss << "lena_filtered_mse=" << MSError << ".jpg";
+  imwrite(ss.str(), filtered);
 }
 
-void flipQuadrants(Mat& im)
+//Значения from, from + step, ... до to включительно
+std::vector<double> valueGrid(double from, double to, double step)
 {
-  int cx = im.cols/2;
-  int cy = im.rows/2;
-
-  Mat q0(im, Rect(0, 0, cx, cy));
-  Mat q1(im, Rect(cx, 0, cx, cy));
-  Mat q2(im, Rect(0, cy, cx, cy));
-  Mat q3(im, Rect(cx, cy, cx, cy));
-
-  Mat tmp;
-  q0.copyTo(tmp);
-  q3.copyTo(q0);
-  tmp.copyTo(q3);
-
-  q1.copyTo(tmp);
-  q2.copyTo(q1);
-  tmp.copyTo(q2);
+  std::vector<double> result;
+  for (double value = from; value <= to + step / 2; value += step)
+    result.push_back(value);
+  return result;
 }
 
-std::vector<Point2d> locatePeaks(const Mat& peaks)
+void printSearch(const ParameterSearch& search, const std::vector<ParameterSearch::Result>& results, double seconds)
 {
-  assert(peaks.type() == CV_32F);
+  std::cout << results.size() << " combinations in " << seconds << " s, " << search.computations()
+            << " stage runs instead of " << search.naiveComputations() << std::endl;
 
-  std::vector<Point2d> result;
-  for (int i = 0; i < peaks.rows; ++i)
+  for (size_t i = 0; i < results.size() && i < 5; ++i)
   {
-    const float* ptr = peaks.ptr<float>(i);
-    for (int j = 0; j < peaks.cols; ++j)
-    {
-      if (ptr[j] > 0 && j != peaks.cols / 2)
-      {
-        result.push_back(Point2d(j, i));
-      }
-    }
+    for (int stage = 0; stage < search.stages(); ++stage)
+      std::cout << search.stageName(stage) << "=" << results[i].values[stage] << " ";
+
+    const QualityScores& scores = results[i].scores;
+    if (search.metrics() & METRIC_MSE)
+      std::cout << "mse " << scores.mse << " ";
+    if (search.metrics() & METRIC_PSNR)
+      std::cout << "psnr " << scores.psnr << " dB ";
+    if (search.metrics() & METRIC_SSIM)
+      std::cout << "ssim " << scores.ssim;
+    std::cout << std::endl;
   }
-
-  return result;
 }
 
-void task3_5()
+//Подбор параметров task3_5 и task3_6 по сетке
+void tune()
 {
-  original = imread(LENA_ORIGINAL_GRAY, CV_LOAD_IMAGE_GRAYSCALE);
-  noised = imread(LENA_NOISED_GRAY, CV_LOAD_IMAGE_GRAYSCALE);
-
-  Mat padded = prepareForDFT(noised);
+  ParameterSearch notch(METRIC_MSE, METRIC_PSNR | METRIC_SSIM);
+  addNotchStages(notch, valueGrid(0.8, 0.95, 0.01), valueGrid(10, 50, 4), valueGrid(0, 0.6, 0.05));
 
-  Mat planes[] = { Mat_<float>(padded), Mat::zeros(padded.size(), CV_32F) };
+  int64 start = getTickCount();
+  std::vector<ParameterSearch::Result> results = notch.run(
+    std::vector<Mat>(1, imread(LENA_NOISED_GRAY, CV_LOAD_IMAGE_GRAYSCALE)),
+    std::vector<Mat>(1, imread(LENA_ORIGINAL_GRAY, CV_LOAD_IMAGE_GRAYSCALE)));
+  printSearch(notch, results, (getTickCount() - start) / getTickFrequency());
 
-  Mat complex;
-  merge(planes, 2, complex);
+  ParameterSearch denoise(METRIC_MSE, METRIC_PSNR | METRIC_SSIM);
+  addDenoiseStages(denoise, valueGrid(5, 13, 2), valueGrid(2, 8, 2), valueGrid(50, 350, 50), valueGrid(1, 5, 2));
 
-  dft(complex, complex);
-
-  split(complex, planes);
+  start = getTickCount();
+  results = denoise.run(std::vector<Mat>(1, imread(LENA_NOISED)), std::vector<Mat>(1, imread(LENA_ORIGINAL)));
+  printSearch(denoise, results, (getTickCount() - start) / getTickFrequency());
+}
 
-  Mat mag;
-  magnitude(planes[0], planes[1], mag);
+//Кадры источника (видео или последовательность вида "frames/%04d.png") через NotchStream в видео output
+void filterVideo(const std::string& input, const std::string& output)
+{
+  VideoCapture capture(input);
+  if (!capture.isOpened())
+  {
+    std::cerr << "Can't open " << input << std::endl;
+    return;
+  }
 
-  mag += Scalar::all(1);
-  log(mag, mag);
+  const double fps = capture.get(CV_CAP_PROP_FPS);
+  VideoWriter writer;
 
-  mag = mag(Rect(0, 0, mag.cols & -2, mag.rows & -2));
-  flipQuadrants(mag);
+  NotchFilter filter;
+  NotchStream stream(filter);
 
-  normalize(mag, mag, 0, 1, CV_MINMAX);
+  int64 start = getTickCount();
+  stream.run(capture, [&](const Mat& frame) {
+    if (!writer.isOpened())
+      writer.open(output, CV_FOURCC('M', 'J', 'P', 'G'), fps > 0 ? fps : 25, frame.size(), frame.channels() == 3);
+    writer << frame;
+  });
+  double seconds = (getTickCount() - start) / getTickFrequency();
 
-  Mat peaks(mag.size(), CV_32F);
-  threshold(mag, peaks, 0.89, 1, THRESH_BINARY);
+  std::cout << stream.frames() << " frames, " << stream.frames() / seconds << " fps, mask updated "
+            << stream.maskUpdates() << " times" << std::endl;
+}
 
-  std::vector<Point2d> points = locatePeaks(peaks);
+bool isRaw(const std::string& path)
+{
+  return path.size() > 4 && path.compare(path.size() - 4, 4, ".raw") == 0;
+}
 
-  Mat filter = Mat::ones(mag.size(), CV_32F);
-  for (std::vector<Point2d>::iterator it = points.begin(); it != points.end(); ++it)
+//Фильтрация тайлами. Файлы .raw (RawImageFile) читаются и пишутся по тайлам,
+//так что могут не помещаться в память, остальные картинки читаются целиком
+void filterTiled(const std::string& input, const std::string& output)
+{
+  RawImageFile rawInput;
+  Mat image;
+  if (isRaw(input) ? !rawInput.open(input) : (image = imread(input, CV_LOAD_IMAGE_UNCHANGED)).empty())
   {
-    const Point2d& point = *it;
-    line(filter, Point(point.x, 0), Point(point.x, mag.rows), Scalar::all(0), 30);
+    std::cerr << "Can't open " << input << std::endl;
+    return;
   }
 
-  flipQuadrants(filter);
-
-  Mat filterPlanes[] = { filter, Mat::zeros(filter.size(), CV_32F) };
-  merge(filterPlanes, 2, filter);
+  MatTileSource imageSource(image);
+  const TileSource& source = isRaw(input) ? static_cast<const TileSource&>(rawInput) : imageSource;
 
-  Mat result;
-  mulSpectrums(complex, filter, result, DFT_REAL_OUTPUT);
+  NotchFilter filter;
+  TiledNotchFilter tiled(filter);
+  tiled.estimate(source);
 
-  idft(result, result);
-
-  normalize(result, result, 0, 1, NORM_MINMAX);
-  split(result, planes);
+  int64 start = getTickCount();
+  if (isRaw(output))
+  {
+    RawImageFile sink;
+    if (!sink.create(output, source.size(), source.type()))
+    {
+      std::cerr << "Can't create " << output << std::endl;
+      return;
+    }
+    tiled.apply(source, sink);
+  }
+  else
+  {
+    MatTileSink sink(source.size(), source.type());
+    tiled.apply(source, sink);
+    imwrite(output, sink.image());
+  }
+  double seconds = (getTickCount() - start) / getTickFrequency();
 
-  result = planes[0];
-  result.convertTo(result, CV_8U, 255);
+  std::cout << source.size().width << "x" << source.size().height << " filtered in " << seconds << " s" << std::endl;
+}
 
-  std::cout << mean(original)[0] << " " << mean(result)[0] << std::endl;
+//Наибольшая разница, число различающихся значений и PSNR result относительно reference
+void printDifference(const std::string& label, const Mat& result, const Mat& reference)
+{
+  Mat difference;
+  absdiff(result, reference, difference);
+  difference = difference.reshape(1);
+
+  double maxDifference = 0;
+  minMaxLoc(difference, 0, &maxDifference);
+  std::cout << "  " << label << ": max abs difference " << maxDifference << ", differing values "
+            << countNonZero(difference) << " of " << difference.total() << ", PSNR "
+            << peakSignalToNoise(result, reference) << " dB" << std::endl;
+}
 
-  double diff = mean(original)[0] - mean(result)[0];
-  result += Scalar::all(diff);
-  cv::exp(result, result);
+//Сверка тайловой фильтрации на картинке в памяти. TiledNotchFilter - приближение
+//NotchFilter::apply (пики по окну, обрезанное ядро), поэтому главная строка - ошибка
+//относительно apply. Вторая - относительно applyWhole, свёртки всей картинки тем же
+//ядром: она показывает только швы тайлов, которые берутся маленькими, чтобы швов было много.
+//Сравнивается и в типе картинки, и на её копии в CV_32F - там видна разница без округления
+void checkTiled(const std::string& input, int tileSize)
+{
+  Mat image = imread(input, CV_LOAD_IMAGE_UNCHANGED);
+  if (image.empty())
+  {
+    std::cerr << "Can't open " << input << std::endl;
+    return;
+  }
 
-  Mat blurred;
-  GaussianBlur(result, blurred, Size(3,3), 20);
-  addWeighted(result, 1.3, blurred, -0.3, 0, result);
+  Mat floatImage;
+  image.convertTo(floatImage, CV_32F);
 
-  std::cout << mse(result, original) << std::endl;
+  const Mat images[] = { image, floatImage };
+  for (const Mat& current : images)
+  {
+    NotchFilter filter;
+    TiledNotchFilter tiled(filter, tileSize);
 
-  imshow("result", result);
-  imshow("input image", original);
-  imshow("noised", noised);
-  imshow("spectrum", mag);
+    MatTileSource source(current);
+    tiled.estimate(source);
 
-  std::stringstream ss;
-  ss << "lena_dft_filtered_mse=" << mse(result, original) << ".jpg";
+    MatTileSink sink(current.size(), current.type());
+    tiled.apply(source, sink);
 
-  imwrite(ss.str(), result);
-  waitKey();
+    std::cout << (current.depth() == CV_32F ? "CV_32F" : "input type") << ", tiles " << tileSize << "x" << tileSize
+              << ":" << std::endl;
+    printDifference("vs NotchFilter::apply", sink.image(), filter.apply(current));
+    printDifference("vs applyWhole (tile seams)", sink.image(), tiled.applyWhole(current));
+  }
 }
 
-void task3_6()
+//Без аргументов - task3_5 на Лене. С аргументами "маска_файлов каталог_результатов" -
+//та же фильтрация для всех подходящих картинок, с "--video источник результат.avi" - для кадров,
+//с "--tiled картинка результат" - тайлами для картинок, которые не помещаются в память,
+//"--tiled --check картинка [размер_тайла]" - ошибка тайлов относительно NotchFilter::apply.
+//"--denoise" - task3_6, "--tune" - подбор параметров обеих задач
+int main(int argc, char** argv)
 {
-  original = imread(LENA_ORIGINAL);
-  noised = imread(LENA_NOISED);
+  if (argc == 2 && std::string(argv[1]) == "--tune")
+  {
+    tune();
+    return 0;
+  }
 
-  bilateralFilter(noised, filtered, 9, 294, 4);
-  medianBlur(filtered, filtered, 3);
+  if (argc == 2 && std::string(argv[1]) == "--denoise")
+  {
+    task3_6();
+    return 0;
+  }
 
-  double MSError = mse(filtered, original);
+  if ((argc == 4 || argc == 5) && std::string(argv[1]) == "--tiled" && std::string(argv[2]) == "--check")
+  {
+    checkTiled(argv[3], argc == 5 ? std::atoi(argv[4]) : 128);
+    return 0;
+  }
 
-  std::stringstream ss;
-  ss << "lena_filtered_mse=" << MSError << ".jpg";
-  imwrite(ss.str(), filtered);
-}
+  if (argc == 4 && std::string(argv[1]) == "--tiled")
+  {
+    filterTiled(argv[2], argv[3]);
+    return 0;
+  }
+
+  if (argc == 4 && std::string(argv[1]) == "--video")
+  {
+    filterVideo(argv[2], argv[3]);
+    return 0;
+  }
+
+  if (argc == 3)
+  {
+    std::cout << NotchFilter().processFiles(argv[1], argv[2]) << " images filtered" << std::endl;
+    return 0;
+  }
 
-int main()
-{
   task3_5();
   return 0;
 }
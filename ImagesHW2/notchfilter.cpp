@@ -0,0 +1,347 @@
+#include "notchfilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+int evenDFTSize(int size)
+{
+  int result = getOptimalDFTSize(size);
+  while (result % 2 != 0)
+    result = getOptimalDFTSize(result + 1);
+  return result;
+}
+
+SpectrumPlan::SpectrumPlan(int rows, int cols)
+  : rows(rows), cols(cols), columnFrequency(cols)
+{
+  assert(rows % 2 == 0 && cols % 2 == 0);
+
+  //Столбцы 1..cols-2 - пары (Re, Im) частот 1..cols/2-1 для всех строк
+  for (int v = 1; v < cols / 2; ++v)
+  {
+    for (int u = 0; u < rows; ++u)
+    {
+      reIndex.push_back(u * cols + 2 * v - 1);
+      imIndex.push_back(u * cols + 2 * v);
+      frequency.push_back(v);
+    }
+  }
+
+  //Столбцы 0 и cols-1 - частоты 0 и cols/2, упакованные по вертикали так же:
+  //Re(0), пары (Re(u), Im(u)) для 0 < u < rows/2, Re(rows/2). Остальные u - сопряжённые
+  const int packed[] = { 0, cols - 1 };
+  for (int column : packed)
+  {
+    const int v = column == 0 ? 0 : cols / 2;
+
+    reIndex.push_back(column);
+    imIndex.push_back(-1);
+    frequency.push_back(v);
+
+    for (int u = 1; u < rows / 2; ++u)
+    {
+      reIndex.push_back((2 * u - 1) * cols + column);
+      imIndex.push_back(2 * u * cols + column);
+      frequency.push_back(v);
+    }
+
+    reIndex.push_back((rows - 1) * cols + column);
+    imIndex.push_back(-1);
+    frequency.push_back(v);
+  }
+
+  columnFrequency[0] = 0;
+  columnFrequency[cols - 1] = cols / 2;
+  for (int column = 1; column < cols - 1; ++column)
+    columnFrequency[column] = (column + 1) / 2;
+}
+
+NotchFilter::NotchFilter(double threshold, int notchWidth, double sharpen)
+  : m_threshold(threshold), m_notchWidth(notchWidth), m_sharpen(sharpen)
+{
+}
+
+std::shared_ptr<const SpectrumPlan> NotchFilter::plan(int rows, int cols) const
+{
+  std::lock_guard<std::mutex> lock(m_plansMutex);
+
+  std::shared_ptr<const SpectrumPlan>& result = m_plans[std::make_pair(rows, cols)];
+  if (!result)
+    result = std::make_shared<SpectrumPlan>(rows, cols);
+  return result;
+}
+
+std::vector<float> NotchFilter::logMagnitude(const Mat& spectrum, const SpectrumPlan& plan)
+{
+  assert(spectrum.type() == CV_32F && spectrum.isContinuous());
+
+  const float* data = spectrum.ptr<float>();
+  const size_t count = plan.reIndex.size();
+
+  std::vector<float> result(count);
+  for (size_t k = 0; k < count; ++k)
+  {
+    const float re = data[plan.reIndex[k]];
+    const float im = plan.imIndex[k] >= 0 ? data[plan.imIndex[k]] : 0;
+    result[k] = std::log(1 + std::sqrt(re * re + im * im));
+  }
+  return result;
+}
+
+std::vector<int> NotchFilter::detectPeaks(const Mat& spectrum, const SpectrumPlan& plan) const
+{
+  return detectPeaks(logMagnitude(spectrum, plan), plan);
+}
+
+std::vector<int> NotchFilter::detectPeaks(const std::vector<float>& magnitude, const SpectrumPlan& plan) const
+{
+  //Минимум и максимум на половине спектра те же, что у всего спектра
+  const float minValue = *std::min_element(magnitude.begin(), magnitude.end());
+  const float maxValue = *std::max_element(magnitude.begin(), magnitude.end());
+
+  //Нулевая частота - не шум, её пропускаем, как locatePeaks пропускал центральный столбец
+  const float level = minValue + m_threshold * (maxValue - minValue);
+  std::vector<bool> isPeak(plan.cols / 2 + 1, false);
+  for (size_t k = 0; k < magnitude.size(); ++k)
+    if (magnitude[k] > level && plan.frequency[k] != 0)
+      isPeak[plan.frequency[k]] = true;
+
+  std::vector<int> result;
+  for (int v = 1; v <= plan.cols / 2; ++v)
+    if (isPeak[v])
+      result.push_back(v);
+  return result;
+}
+
+std::vector<float> NotchFilter::columnMask(const std::vector<int>& peaks, const SpectrumPlan& plan) const
+{
+  //Полоса вокруг пика v_p в сдвинутом спектре задевает частоты v с |v - v_p| <= width / 2,
+  //и симметричная ей - с |v + v_p| <= width / 2. Частота cols/2 в сдвинутом спектре
+  //это столбец 0, то есть -cols/2
+  std::vector<float> frequencyMask(plan.cols / 2 + 1, 1);
+  for (int v = 0; v <= plan.cols / 2; ++v)
+  {
+    for (int peak : peaks)
+    {
+      const bool hit = v == plan.cols / 2 ? 2 * (v - peak) <= m_notchWidth
+                                          : 2 * std::abs(v - peak) <= m_notchWidth || 2 * (v + peak) <= m_notchWidth;
+      if (hit)
+      {
+        frequencyMask[v] = 0;
+        break;
+      }
+    }
+  }
+
+  std::vector<float> result(plan.cols);
+  for (int column = 0; column < plan.cols; ++column)
+    result[column] = frequencyMask[plan.columnFrequency[column]];
+  return result;
+}
+
+Mat NotchFilter::forward(const Mat& channel) const
+{
+  const int rows = evenDFTSize(channel.rows);
+  const int cols = evenDFTSize(channel.cols);
+
+  Mat padded;
+  copyMakeBorder(channel, padded, 0, rows - channel.rows, 0, cols - channel.cols, BORDER_CONSTANT, Scalar::all(0));
+  padded.convertTo(padded, CV_32F);
+
+  Mat spectrum;
+  dft(padded, spectrum);
+  return spectrum;
+}
+
+void NotchFilter::applyMask(Mat& spectrum, const std::vector<float>& mask)
+{
+  assert(static_cast<int>(mask.size()) == spectrum.cols);
+
+  for (int i = 0; i < spectrum.rows; ++i)
+  {
+    float* row = spectrum.ptr<float>(i);
+    for (int j = 0; j < spectrum.cols; ++j)
+      row[j] *= mask[j];
+  }
+}
+
+Mat NotchFilter::applyChannel(const Mat& channel) const
+{
+  Mat spectrum = forward(channel);
+  std::shared_ptr<const SpectrumPlan> spectrumPlan = plan(spectrum.rows, spectrum.cols);
+
+  applyMask(spectrum, columnMask(detectPeaks(spectrum, *spectrumPlan), *spectrumPlan));
+  return inverse(spectrum, channel.size());
+}
+
+Mat NotchFilter::inverse(const Mat& spectrum, Size size) const
+{
+  Mat result;
+  idft(spectrum, result, DFT_SCALE | DFT_REAL_OUTPUT);
+  return sharpened(result(Rect(0, 0, size.width, size.height)));
+}
+
+Mat NotchFilter::sharpened(const Mat& image) const
+{
+  if (m_sharpen <= 0)
+    return image;
+
+  Mat blurred, result;
+  GaussianBlur(image, blurred, Size(3, 3), 20);
+  addWeighted(image, 1 + m_sharpen, blurred, -m_sharpen, 0, result);
+  return result;
+}
+
+Mat NotchFilter::apply(const Mat& image) const
+{
+  std::vector<Mat> channels;
+  split(image, channels);
+
+  for (Mat& channel : channels)
+    applyChannel(channel).convertTo(channel, image.depth());
+
+  Mat result;
+  merge(channels, result);
+  return result;
+}
+
+namespace
+{
+  class FileFilter : public ParallelLoopBody
+  {
+  public:
+    FileFilter(const NotchFilter& filter, const std::vector<std::string>& files,
+               const std::string& outputDirectory, std::vector<int>& written)
+      : m_filter(filter), m_files(files), m_outputDirectory(outputDirectory), m_written(written)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+      for (int i = range.start; i < range.end; ++i)
+      {
+        Mat image = imread(m_files[i], CV_LOAD_IMAGE_UNCHANGED);
+        if (image.empty())
+          continue;
+
+        const std::string& path = m_files[i];
+        const std::string name = path.substr(path.find_last_of("/\\") + 1);
+        m_written[i] = imwrite(m_outputDirectory + "/" + name, m_filter.apply(image));
+      }
+    }
+
+  private:
+    const NotchFilter& m_filter;
+    const std::vector<std::string>& m_files;
+    const std::string& m_outputDirectory;
+    std::vector<int>& m_written;
+  };
+}
+
+int NotchFilter::processFiles(const std::string& inputPattern, const std::string& outputDirectory) const
+{
+  std::vector<std::string> files;
+  glob(inputPattern, files);
+
+  //Картинки обрабатываются параллельно, dft внутри каждой - в одном потоке
+  std::vector<int> written(files.size(), 0);
+  parallel_for_(Range(0, files.size()), FileFilter(*this, files, outputDirectory, written));
+
+  return std::count(written.begin(), written.end(), 1);
+}
+
+NotchStream::NotchStream(const NotchFilter& filter, int checkInterval, double driftThreshold)
+  : m_filter(filter), m_checkInterval(checkInterval), m_driftThreshold(driftThreshold), m_frames(0), m_maskUpdates(0)
+{
+}
+
+std::vector<double> NotchStream::energyProfile(const Mat& spectrum, const SpectrumPlan& plan)
+{
+  //Оба числа пары (Re, Im) и упакованные столбцы 0 и cols-1 относятся к одной частоте,
+  //так что достаточно сложить квадраты по столбцам CCS
+  std::vector<double> energy(plan.cols / 2 + 1, 0);
+  for (int i = 0; i < spectrum.rows; ++i)
+  {
+    const float* row = spectrum.ptr<float>(i);
+    for (int j = 0; j < spectrum.cols; ++j)
+      energy[plan.columnFrequency[j]] += row[j] * row[j];
+  }
+
+  double total = 0;
+  for (double value : energy)
+    total += value;
+
+  for (double& value : energy)
+    value = std::log(value / std::max(total, 1e-12) + 1e-12);
+  return energy;
+}
+
+bool NotchStream::drifted(const std::vector<double>& profile, const std::vector<double>& reference) const
+{
+  for (size_t v = 0; v < profile.size(); ++v)
+    if (std::abs(profile[v] - reference[v]) > m_driftThreshold)
+      return true;
+  return false;
+}
+
+Mat NotchStream::process(const Mat& frame)
+{
+  std::vector<Mat> channels;
+  split(frame, channels);
+
+  //Новый размер или число каналов - маску ищем заново
+  if (frame.size() != m_size || channels.size() != m_channels.size())
+  {
+    m_size = frame.size();
+    m_channels.assign(channels.size(), ChannelState());
+  }
+
+  const bool check = m_checkInterval > 0 && m_frames % m_checkInterval == 0;
+  ++m_frames;
+
+  for (size_t c = 0; c < channels.size(); ++c)
+  {
+    Mat spectrum = m_filter.forward(channels[c]);
+    ChannelState& state = m_channels[c];
+
+    if (state.mask.empty() || check)
+    {
+      std::shared_ptr<const SpectrumPlan> plan = m_filter.plan(spectrum.rows, spectrum.cols);
+      std::vector<double> profile = energyProfile(spectrum, *plan);
+
+      if (state.mask.empty() || drifted(profile, state.profile))
+      {
+        state.mask = m_filter.columnMask(m_filter.detectPeaks(spectrum, *plan), *plan);
+        state.profile.swap(profile);
+        ++m_maskUpdates;
+      }
+    }
+
+    NotchFilter::applyMask(spectrum, state.mask);
+    m_filter.inverse(spectrum, frame.size()).convertTo(channels[c], frame.depth());
+  }
+
+  Mat result;
+  merge(channels, result);
+  return result;
+}
+
+int NotchStream::run(VideoCapture& capture, const std::function<void(const Mat&)>& sink)
+{
+  const int start = m_frames;
+
+  Mat frame;
+  while (capture.read(frame))
+    sink(process(frame));
+
+  return m_frames - start;
+}
@@ -0,0 +1,152 @@
+#ifndef NOTCHFILTER_H
+#define NOTCHFILTER_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+//Разметка CCS спектра (результат dft без DFT_COMPLEX_OUTPUT) для одного размера:
+//где лежат Re и Im каждого элемента половины спектра 0 <= v <= cols / 2.
+//Строится один раз на размер и переиспользуется всеми картинками этого размера.
+struct SpectrumPlan
+{
+  SpectrumPlan(int rows, int cols);
+
+  int rows;
+  int cols;
+
+  //Для элемента k половины спектра: индексы Re и Im в CCS матрице (-1 - мнимая часть равна 0)
+  //и частота по горизонтали v
+  std::vector<int> reIndex;
+  std::vector<int> imIndex;
+  std::vector<int> frequency;
+
+  //Частота по горизонтали каждого столбца CCS матрицы
+  std::vector<int> columnFrequency;
+};
+
+//Удаление периодического шума, как в task3_5: в логарифме амплитудного спектра ищутся
+//пики выше threshold (после нормировки в [0, 1]), и по каждому пику вырезается
+//вертикальная полоса ширины notchWidth во всю высоту сдвинутого спектра.
+//
+//Спектр считается вещественным dft в упакованном виде CCS, размеры дополняются
+//до чётных оптимальных. Так как спектр вещественной картинки сопряжённо симметричен,
+//пики ищутся только на половине спектра, а полосы зависят только от горизонтальной
+//частоты, поэтому фильтр - это маска по столбцам CCS, и сдвиг квадрантов не нужен.
+class NotchFilter
+{
+public:
+  NotchFilter(double threshold = 0.89, int notchWidth = 30, double sharpen = 0.3);
+
+  //Отфильтровать картинку (любое число каналов, каждый отдельно). Результат того же типа и размера
+  cv::Mat apply(const cv::Mat& image) const;
+
+  //Горизонтальные частоты пиков спектра (CCS, CV_32F)
+  std::vector<int> detectPeaks(const cv::Mat& spectrum, const SpectrumPlan& plan) const;
+
+  //То же по готовому logMagnitude, чтобы перебирать threshold без пересчёта логарифмов
+  std::vector<int> detectPeaks(const std::vector<float>& magnitude, const SpectrumPlan& plan) const;
+
+  //log(1 + |F|) для элементов половины спектра в порядке plan.reIndex
+  static std::vector<float> logMagnitude(const cv::Mat& spectrum, const SpectrumPlan& plan);
+
+  //Маска по столбцам CCS: 0 - столбец вырезается, 1 - остаётся
+  std::vector<float> columnMask(const std::vector<int>& peaks, const SpectrumPlan& plan) const;
+
+  //Отфильтровать все картинки inputPattern (маска cv::glob, например "scans/*.png")
+  //параллельно и записать в outputDirectory под теми же именами. Возвращает число записанных
+  int processFiles(const std::string& inputPattern, const std::string& outputDirectory) const;
+
+  std::shared_ptr<const SpectrumPlan> plan(int rows, int cols) const;
+
+  //Шаги applyChannel по отдельности, чтобы маску можно было переиспользовать.
+  //Дополненный до чётного оптимального размера CCS спектр канала
+  cv::Mat forward(const cv::Mat& channel) const;
+
+  //Умножить каждую строку CCS спектра на маску столбцов
+  static void applyMask(cv::Mat& spectrum, const std::vector<float>& mask);
+
+  //Обратное преобразование, обрезка до size и повышение резкости, CV_32F
+  cv::Mat inverse(const cv::Mat& spectrum, cv::Size size) const;
+
+  //Повышение резкости результата inverse. image может быть областью дополненной матрицы,
+  //размытие на краях тогда берёт пиксели из неё, как в inverse
+  cv::Mat sharpened(const cv::Mat& image) const;
+
+  double sharpen() const
+  {
+    return m_sharpen;
+  }
+
+private:
+  cv::Mat applyChannel(const cv::Mat& channel) const;
+
+  double m_threshold;
+  int m_notchWidth;
+  double m_sharpen;
+
+  mutable std::mutex m_plansMutex;
+  mutable std::map<std::pair<int, int>, std::shared_ptr<const SpectrumPlan>> m_plans;
+};
+
+//Потоковая фильтрация кадров одного источника. Периодическая помеха от одного устройства
+//стационарна, поэтому маска ищется на первом кадре и дальше только применяется:
+//на кадр - прямое dft, умножение и обратное dft. Раз в checkInterval кадров
+//сравнивается доля энергии спектра по горизонтальным частотам с запомненной при
+//поиске маски; если логарифм доли где-то изменился больше чем на driftThreshold,
+//маска ищется заново.
+class NotchStream
+{
+public:
+  NotchStream(const NotchFilter& filter, int checkInterval = 10, double driftThreshold = 1.0);
+
+  cv::Mat process(const cv::Mat& frame);
+
+  //Отфильтровать все кадры capture (видео или последовательность картинок) и отдать sink.
+  //Возвращает число кадров
+  int run(cv::VideoCapture& capture, const std::function<void(const cv::Mat&)>& sink);
+
+  int frames() const
+  {
+    return m_frames;
+  }
+
+  //Сколько раз маска искалась заново
+  int maskUpdates() const
+  {
+    return m_maskUpdates;
+  }
+
+private:
+  struct ChannelState
+  {
+    std::vector<float> mask;
+    std::vector<double> profile;
+  };
+
+  //log доли энергии спектра на каждой горизонтальной частоте 0..cols/2
+  static std::vector<double> energyProfile(const cv::Mat& spectrum, const SpectrumPlan& plan);
+
+  bool drifted(const std::vector<double>& profile, const std::vector<double>& reference) const;
+
+  const NotchFilter& m_filter;
+  int m_checkInterval;
+  double m_driftThreshold;
+
+  cv::Size m_size;
+  std::vector<ChannelState> m_channels;
+
+  int m_frames;
+  int m_maskUpdates;
+};
+
+//Оптимальный для dft размер не меньше size, чётный
+int evenDFTSize(int size);
+
+#endif // NOTCHFILTER_H
@@ -0,0 +1,32 @@
+#ifndef PARALLELLOOP_H
+#define PARALLELLOOP_H
+
+#include <opencv2/core/core.hpp>
+
+//cv::parallel_for_ в OpenCV 2.4 принимает только наследника ParallelLoopBody.
+//Обёртка, чтобы тело цикла можно было передать лямбдой: body(const cv::Range&)
+template <class Body>
+class LambdaLoopBody : public cv::ParallelLoopBody
+{
+public:
+  explicit LambdaLoopBody(const Body& body) : m_body(body)
+  {
+  }
+
+  void operator()(const cv::Range& range) const
+  {
+    m_body(range);
+  }
+
+private:
+  Body m_body;
+};
+
+template <class Body>
+void parallelFor(int count, const Body& body)
+{
+  if (count > 0)
+    cv::parallel_for_(cv::Range(0, count), LambdaLoopBody<Body>(body));
+}
+
+#endif // PARALLELLOOP_H
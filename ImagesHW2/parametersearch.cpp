@@ -0,0 +1,129 @@
+#include "parametersearch.h"
+#include "parallelloop.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace cv;
+
+ParameterSearch::ParameterSearch(QualityMetric metric, int reported)
+  : m_metric(metric), m_metrics(metric | reported), m_computations(0), m_inputs(0)
+{
+  assert(metric == METRIC_MSE || metric == METRIC_SSIM);
+}
+
+void ParameterSearch::addStage(const std::string& name, const std::vector<double>& values, const StageFunction& compute)
+{
+  assert(!values.empty());
+
+  Stage stage;
+  stage.name = name;
+  stage.values = values;
+  stage.compute = compute;
+  m_stages.push_back(stage);
+}
+
+size_t ParameterSearch::naiveComputations() const
+{
+  size_t combinations = 1;
+  size_t computing = 0;
+  for (const Stage& stage : m_stages)
+  {
+    combinations *= stage.values.size();
+    if (stage.compute)
+      ++computing;
+  }
+  return combinations * computing * m_inputs;
+}
+
+Mat ParameterSearch::evaluate(int stage, const Node& node, const Mat& input,
+                              const std::vector<std::vector<Node>>& levels) const
+{
+  //Результаты предков от корня: outputs[i + 1] - результат стадии i
+  std::vector<Mat> outputs(stage + 1);
+  outputs[0] = input;
+  for (int level = stage - 1, parent = node.parent; level >= 0; parent = levels[level][parent].parent, --level)
+    outputs[level + 1] = levels[level][parent].output;
+
+  if (!m_stages[stage].compute)
+    return outputs.back();
+
+  ++m_computations;
+  return m_stages[stage].compute(outputs, node.values);
+}
+
+bool ParameterSearch::better(const QualityScores& a, const QualityScores& b) const
+{
+  return m_metric == METRIC_MSE ? a.mse < b.mse : a.ssim > b.ssim;
+}
+
+std::vector<ParameterSearch::Result> ParameterSearch::run(const std::vector<Mat>& inputs,
+                                                          const std::vector<Mat>& references)
+{
+  assert(!m_stages.empty() && inputs.size() == references.size());
+
+  m_computations = 0;
+  m_inputs = inputs.size();
+
+  const int last = m_stages.size() - 1;
+  std::vector<Result> results;
+
+  for (size_t pair = 0; pair < inputs.size(); ++pair)
+  {
+    //Уровни дерева кроме листьев. Узлы уровня перечисляются в порядке (родитель, значение),
+    //поэтому листья в каждой паре идут в одном порядке
+    std::vector<std::vector<Node>> levels(last + 1);
+    for (int stage = 0; stage <= last; ++stage)
+    {
+      const size_t parents = stage == 0 ? 1 : levels[stage - 1].size();
+      std::vector<Node>& nodes = levels[stage];
+      for (size_t parent = 0; parent < parents; ++parent)
+      {
+        for (double value : m_stages[stage].values)
+        {
+          Node node;
+          node.parent = parent;
+          if (stage > 0)
+            node.values = levels[stage - 1][parent].values;
+          node.values.push_back(value);
+          nodes.push_back(node);
+        }
+      }
+
+      if (stage == last)
+        break;
+
+      parallelFor(nodes.size(), [&](const Range& range) {
+        for (int i = range.start; i < range.end; ++i)
+          nodes[i].output = evaluate(stage, nodes[i], inputs[pair], levels);
+      });
+    }
+
+    //Листья: результат сразу сравнивается с эталоном и не хранится
+    const std::vector<Node>& leaves = levels[last];
+    std::vector<QualityScores> scores(leaves.size());
+    parallelFor(leaves.size(), [&](const Range& range) {
+      for (int i = range.start; i < range.end; ++i)
+        scores[i] = measureQuality(evaluate(last, leaves[i], inputs[pair], levels), references[pair], m_metrics);
+    });
+
+    if (results.empty())
+    {
+      results.resize(leaves.size());
+      for (size_t i = 0; i < leaves.size(); ++i)
+        results[i].values = leaves[i].values;
+    }
+
+    for (size_t i = 0; i < leaves.size(); ++i)
+    {
+      results[i].scores.mse += scores[i].mse / inputs.size();
+      results[i].scores.psnr += scores[i].psnr / inputs.size();
+      results[i].scores.ssim += scores[i].ssim / inputs.size();
+    }
+  }
+
+  std::stable_sort(results.begin(), results.end(), [this](const Result& a, const Result& b) {
+    return better(a.scores, b.scores);
+  });
+  return results;
+}
@@ -0,0 +1,105 @@
+#ifndef PARAMETERSEARCH_H
+#define PARAMETERSEARCH_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "qualitymetrics.h"
+
+//Перебор параметров цепочки обработки по сетке с запоминанием общих промежуточных результатов.
+//
+//Цепочка - последовательность стадий, у каждой свой параметр и список его значений.
+//Результат стадии зависит только от значений параметров до неё включительно (префикса),
+//поэтому все сочетания образуют дерево: узел уровня i - префикс из i + 1 значений,
+//и результат каждого узла считается ровно один раз из результатов его предков.
+//Например, для task3_5 прямое dft считается один раз на картинку, пики - один раз
+//на threshold, обратное dft - один раз на пару (threshold, notchWidth), и только
+//повышение резкости - на каждое сочетание.
+//
+//Узлы одного уровня считаются параллельно. Промежуточные уровни хранятся в памяти
+//целиком, листья сразу оцениваются и выбрасываются.
+class ParameterSearch
+{
+public:
+  //outputs - вход цепочки и результаты всех предков узла, от корня; values - значения
+  //параметров от первой стадии до этой включительно. Результат последней стадии
+  //сравнивается с эталоном
+  typedef std::function<cv::Mat(const std::vector<cv::Mat>& outputs, const std::vector<double>& values)> StageFunction;
+
+  struct Result
+  {
+    std::vector<double> values;
+    //Средние по всем парам (вход, эталон) для метрик metrics(), остальные поля - 0.
+    //psnr - среднее psnr пар, а не psnr средней mse
+    QualityScores scores;
+  };
+
+  //metric - METRIC_MSE (минимизируется) или METRIC_SSIM (максимизируется),
+  //reported - какие метрики ещё посчитать для Result::scores (METRIC_PSNR при METRIC_MSE бесплатна)
+  explicit ParameterSearch(QualityMetric metric = METRIC_MSE, int reported = 0);
+
+  //Метрики, которые считаются для каждого листа: metric | reported
+  int metrics() const
+  {
+    return m_metrics;
+  }
+
+  //Стадия без функции ничего не считает и передаёт дальше результат предыдущей:
+  //так несколько параметров одной операции задаются отдельными уровнями
+  void addStage(const std::string& name, const std::vector<double>& values,
+                const StageFunction& compute = StageFunction());
+
+  //Все сочетания для всех пар, от лучшего к худшему
+  std::vector<Result> run(const std::vector<cv::Mat>& inputs, const std::vector<cv::Mat>& references);
+
+  //Сколько раз вызывались функции стадий в последнем run и сколько вызывалось бы без запоминания
+  size_t computations() const
+  {
+    return m_computations;
+  }
+
+  size_t naiveComputations() const;
+
+  const std::string& stageName(int stage) const
+  {
+    return m_stages[stage].name;
+  }
+
+  int stages() const
+  {
+    return m_stages.size();
+  }
+
+private:
+  struct Stage
+  {
+    std::string name;
+    std::vector<double> values;
+    StageFunction compute;
+  };
+
+  struct Node
+  {
+    int parent;
+    std::vector<double> values;
+    cv::Mat output;
+  };
+
+  //Результат узла по результатам предков; levels - уже посчитанные уровни
+  cv::Mat evaluate(int stage, const Node& node, const cv::Mat& input,
+                   const std::vector<std::vector<Node>>& levels) const;
+
+  bool better(const QualityScores& a, const QualityScores& b) const;
+
+  QualityMetric m_metric;
+  int m_metrics;
+  std::vector<Stage> m_stages;
+  mutable std::atomic<size_t> m_computations;
+  size_t m_inputs;
+};
+
+#endif // PARAMETERSEARCH_H
@@ -0,0 +1,188 @@
+#include "qualitymetrics.h"
+#include "parallelloop.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+#include <emmintrin.h>
+
+using namespace cv;
+
+namespace
+{
+  //Строк в полосе: полосы считаются независимо и складываются в одном порядке,
+  //так что результат не зависит от числа потоков
+  const int BAND_ROWS = 64;
+
+  int bandCount(int rows)
+  {
+    return (rows + BAND_ROWS - 1) / BAND_ROWS;
+  }
+
+  //Сумма квадратов разностей двух строк uchar. Квадраты пар складываются _mm_madd_epi16
+  //в int32; за SUM_CHUNK байт сумма в каждом элементе не превышает 2^31
+  const int SUM_CHUNK = 1 << 14;
+
+  uint64_t squaredDifference(const uchar* a, const uchar* b, int count)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t result = 0;
+
+    int i = 0;
+    while (i + 16 <= count)
+    {
+      __m128i acc = _mm_setzero_si128();
+      const int end = std::min(count, i + SUM_CHUNK);
+      for (; i + 16 <= end; i += 16)
+      {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        const __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+      }
+
+      int32_t lanes[4];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+      result += static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    for (; i < count; ++i)
+      result += (a[i] - b[i]) * (a[i] - b[i]);
+
+    return result;
+  }
+
+  double psnrFromMse(double mse, double peak)
+  {
+    if (mse == 0)
+      return std::numeric_limits<double>::infinity();
+    return 10 * std::log10(peak * peak / mse);
+  }
+
+  //Средний SSIM одного канала
+  double channelSimilarity(const Mat& image, const Mat& reference, int window, double peak)
+  {
+    Mat a, b, product;
+    image.convertTo(a, CV_64F);
+    reference.convertTo(b, CV_64F);
+    multiply(a, b, product);
+
+    Mat sumA, squaresA, sumB, squaresB, sumProduct;
+    integral(a, sumA, squaresA, CV_64F);
+    integral(b, sumB, squaresB, CV_64F);
+    integral(product, sumProduct, CV_64F);
+
+    const int rows = image.rows - window + 1;
+    const int cols = image.cols - window + 1;
+    const double area = window * window;
+    const double c1 = (0.01 * peak) * (0.01 * peak);
+    const double c2 = (0.03 * peak) * (0.03 * peak);
+
+    //Сумма по окну с левым верхним углом (x, y)
+    auto windowSum = [window](const Mat& table, int y, int x) {
+      return table.at<double>(y + window, x + window) - table.at<double>(y, x + window)
+           - table.at<double>(y + window, x) + table.at<double>(y, x);
+    };
+
+    std::vector<double> partial(bandCount(rows), 0);
+    parallelFor(partial.size(), [&](const Range& range) {
+      for (int band = range.start; band < range.end; ++band)
+      {
+        double sum = 0;
+        for (int y = band * BAND_ROWS; y < std::min(rows, (band + 1) * BAND_ROWS); ++y)
+        {
+          for (int x = 0; x < cols; ++x)
+          {
+            const double meanA = windowSum(sumA, y, x) / area;
+            const double meanB = windowSum(sumB, y, x) / area;
+            const double varianceA = windowSum(squaresA, y, x) / area - meanA * meanA;
+            const double varianceB = windowSum(squaresB, y, x) / area - meanB * meanB;
+            const double covariance = windowSum(sumProduct, y, x) / area - meanA * meanB;
+
+            sum += ((2 * meanA * meanB + c1) * (2 * covariance + c2))
+                 / ((meanA * meanA + meanB * meanB + c1) * (varianceA + varianceB + c2));
+          }
+        }
+        partial[band] = sum;
+      }
+    });
+
+    return std::accumulate(partial.begin(), partial.end(), 0.0) / (static_cast<double>(rows) * cols);
+  }
+}
+
+double meanSquaredError(const Mat& image, const Mat& reference)
+{
+  assert(image.size() == reference.size() && image.type() == reference.type());
+
+  const double count = static_cast<double>(image.total()) * image.channels();
+  if (image.depth() != CV_8U)
+    return norm(image, reference, NORM_L2SQR) / count;
+
+  const int rowLength = image.cols * image.channels();
+  std::vector<uint64_t> partial(bandCount(image.rows), 0);
+  parallelFor(partial.size(), [&](const Range& range) {
+    for (int band = range.start; band < range.end; ++band)
+      for (int y = band * BAND_ROWS; y < std::min(image.rows, (band + 1) * BAND_ROWS); ++y)
+        partial[band] += squaredDifference(image.ptr<uchar>(y), reference.ptr<uchar>(y), rowLength);
+  });
+
+  return std::accumulate(partial.begin(), partial.end(), uint64_t(0)) / count;
+}
+
+double peakSignalToNoise(const Mat& image, const Mat& reference, double peak)
+{
+  return psnrFromMse(meanSquaredError(image, reference), peak);
+}
+
+double structuralSimilarity(const Mat& image, const Mat& reference, int window, double peak)
+{
+  assert(image.size() == reference.size() && image.type() == reference.type());
+  assert(image.rows >= window && image.cols >= window);
+
+  std::vector<Mat> imageChannels, referenceChannels;
+  split(image, imageChannels);
+  split(reference, referenceChannels);
+
+  double result = 0;
+  for (size_t c = 0; c < imageChannels.size(); ++c)
+    result += channelSimilarity(imageChannels[c], referenceChannels[c], window, peak);
+  return result / imageChannels.size();
+}
+
+QualityScores measureQuality(const Mat& image, const Mat& reference, int metrics)
+{
+  QualityScores result;
+  if (metrics & (METRIC_MSE | METRIC_PSNR))
+  {
+    const double mse = meanSquaredError(image, reference);
+    if (metrics & METRIC_MSE)
+      result.mse = mse;
+    if (metrics & METRIC_PSNR)
+      result.psnr = psnrFromMse(mse, 255);
+  }
+
+  if (metrics & METRIC_SSIM)
+    result.ssim = structuralSimilarity(image, reference);
+
+  return result;
+}
+
+std::vector<QualityScores> measureQuality(const std::vector<Mat>& images, const std::vector<Mat>& references,
+                                          int metrics)
+{
+  assert(references.size() == 1 || references.size() == images.size());
+
+  //Пар обычно много, так что параллелим прежде всего по парам
+  std::vector<QualityScores> result(images.size());
+  parallelFor(images.size(), [&](const Range& range) {
+    for (int i = range.start; i < range.end; ++i)
+      result[i] = measureQuality(images[i], references[references.size() == 1 ? 0 : i], metrics);
+  });
+  return result;
+}
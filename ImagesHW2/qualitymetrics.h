@@ -0,0 +1,47 @@
+#ifndef QUALITYMETRICS_H
+#define QUALITYMETRICS_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+//Метрики качества результата относительно эталона того же размера и типа.
+//Все учитывают все каналы: MSE - среднее по всем числам картинки, SSIM - среднее по каналам.
+//Считаются параллельно по полосам строк; для CV_8U разности квадратов - через SSE2.
+
+enum QualityMetric
+{
+  METRIC_MSE = 1,
+  METRIC_PSNR = 2,
+  METRIC_SSIM = 4,
+  METRIC_ALL = METRIC_MSE | METRIC_PSNR | METRIC_SSIM
+};
+
+struct QualityScores
+{
+  QualityScores() : mse(0), psnr(0), ssim(0)
+  {
+  }
+
+  double mse;
+  double psnr;
+  double ssim;
+};
+
+double meanSquaredError(const cv::Mat& image, const cv::Mat& reference);
+
+//В децибелах, peak - максимальное значение пикселя. Для совпадающих картинок - бесконечность
+double peakSignalToNoise(const cv::Mat& image, const cv::Mat& reference, double peak = 255);
+
+//Средний SSIM (Wang et al.) по всем окнам window x window. Средние, дисперсии
+//и ковариация окна берутся из интегральных картинок, так что цена окна не зависит от его размера
+double structuralSimilarity(const cv::Mat& image, const cv::Mat& reference, int window = 7, double peak = 255);
+
+//metrics - маска QualityMetric, не запрошенные поля остаются нулевыми
+QualityScores measureQuality(const cv::Mat& image, const cv::Mat& reference, int metrics = METRIC_ALL);
+
+//Пары (images[i], references[i]) параллельно. Если эталон один, он используется для всех картинок
+std::vector<QualityScores> measureQuality(const std::vector<cv::Mat>& images, const std::vector<cv::Mat>& references,
+                                          int metrics = METRIC_ALL);
+
+#endif // QUALITYMETRICS_H
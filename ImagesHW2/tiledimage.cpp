@@ -0,0 +1,175 @@
+#include "tiledimage.h"
+
+#include <cassert>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace cv;
+
+namespace
+{
+  const uint32_t RAW_MAGIC = 0x474d4952; // "RIMG"
+
+  struct RawHeader
+  {
+    uint32_t magic;
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+  };
+
+  //pread/pwrite могут обработать меньше байт, чем просили
+  bool readFully(int fd, void* data, size_t size, off_t offset)
+  {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0)
+    {
+      const ssize_t done = pread(fd, bytes, size, offset);
+      if (done <= 0)
+        return false;
+      bytes += done;
+      size -= done;
+      offset += done;
+    }
+    return true;
+  }
+
+  bool writeFully(int fd, const void* data, size_t size, off_t offset)
+  {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+      const ssize_t done = pwrite(fd, bytes, size, offset);
+      if (done <= 0)
+        return false;
+      bytes += done;
+      size -= done;
+      offset += done;
+    }
+    return true;
+  }
+}
+
+MatTileSource::MatTileSource(const Mat& image)
+  : m_image(image)
+{
+}
+
+Size MatTileSource::size() const
+{
+  return m_image.size();
+}
+
+int MatTileSource::type() const
+{
+  return m_image.type();
+}
+
+void MatTileSource::read(const Rect& rect, Mat& tile) const
+{
+  m_image(rect).copyTo(tile);
+}
+
+MatTileSink::MatTileSink(Size size, int type)
+  : m_image(size, type)
+{
+}
+
+void MatTileSink::write(const Rect& rect, const Mat& tile)
+{
+  Mat target = m_image(rect);
+  tile.copyTo(target);
+}
+
+RawImageFile::RawImageFile()
+  : m_fd(-1), m_type(0)
+{
+}
+
+RawImageFile::~RawImageFile()
+{
+  close();
+}
+
+bool RawImageFile::open(const std::string& path)
+{
+  close();
+
+  m_fd = ::open(path.c_str(), O_RDONLY);
+  if (m_fd < 0)
+    return false;
+
+  RawHeader header;
+  if (!readFully(m_fd, &header, sizeof(header), 0) || header.magic != RAW_MAGIC)
+  {
+    close();
+    return false;
+  }
+
+  m_size = Size(header.cols, header.rows);
+  m_type = header.type;
+  return true;
+}
+
+bool RawImageFile::create(const std::string& path, Size size, int type)
+{
+  close();
+
+  m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (m_fd < 0)
+    return false;
+
+  m_size = size;
+  m_type = type;
+
+  RawHeader header = { RAW_MAGIC, size.height, size.width, type };
+  if (!writeFully(m_fd, &header, sizeof(header), 0) || ftruncate(m_fd, offset(0, size.height)) != 0)
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void RawImageFile::close()
+{
+  if (m_fd >= 0)
+    ::close(m_fd);
+  m_fd = -1;
+}
+
+Size RawImageFile::size() const
+{
+  return m_size;
+}
+
+int RawImageFile::type() const
+{
+  return m_type;
+}
+
+off_t RawImageFile::offset(int x, int y) const
+{
+  const off_t elemSize = CV_ELEM_SIZE(m_type);
+  return sizeof(RawHeader) + (static_cast<off_t>(y) * m_size.width + x) * elemSize;
+}
+
+void RawImageFile::read(const Rect& rect, Mat& tile) const
+{
+  assert((rect & Rect(Point(), m_size)) == rect);
+
+  tile.create(rect.size(), m_type);
+  for (int y = 0; y < rect.height; ++y)
+    CV_Assert(readFully(m_fd, tile.ptr(y), rect.width * tile.elemSize(), offset(rect.x, rect.y + y)));
+}
+
+void RawImageFile::write(const Rect& rect, const Mat& tile)
+{
+  assert((rect & Rect(Point(), m_size)) == rect);
+  assert(tile.size() == rect.size() && tile.type() == m_type);
+
+  for (int y = 0; y < rect.height; ++y)
+    CV_Assert(writeFully(m_fd, tile.ptr(y), rect.width * tile.elemSize(), offset(rect.x, rect.y + y)));
+}
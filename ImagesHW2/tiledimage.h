@@ -0,0 +1,102 @@
+#ifndef TILEDIMAGE_H
+#define TILEDIMAGE_H
+
+#include <string>
+
+#include <sys/types.h>
+
+#include <opencv2/core/core.hpp>
+
+//Картинка, из которой можно читать прямоугольники. read должен быть потокобезопасным:
+//тайлы читаются параллельно
+class TileSource
+{
+public:
+  virtual ~TileSource()
+  {
+  }
+
+  virtual cv::Size size() const = 0;
+  virtual int type() const = 0;
+
+  //rect целиком внутри картинки, tile получает тип type()
+  virtual void read(const cv::Rect& rect, cv::Mat& tile) const = 0;
+};
+
+//Картинка, в которую пишутся прямоугольники. Прямоугольники параллельных write не пересекаются
+class TileSink
+{
+public:
+  virtual ~TileSink()
+  {
+  }
+
+  virtual void write(const cv::Rect& rect, const cv::Mat& tile) = 0;
+};
+
+//Картинка целиком в памяти
+class MatTileSource : public TileSource
+{
+public:
+  explicit MatTileSource(const cv::Mat& image);
+
+  cv::Size size() const;
+  int type() const;
+  void read(const cv::Rect& rect, cv::Mat& tile) const;
+
+private:
+  cv::Mat m_image;
+};
+
+class MatTileSink : public TileSink
+{
+public:
+  MatTileSink(cv::Size size, int type);
+
+  void write(const cv::Rect& rect, const cv::Mat& tile);
+
+  const cv::Mat& image() const
+  {
+    return m_image;
+  }
+
+private:
+  cv::Mat m_image;
+};
+
+//Несжатая картинка в файле: заголовок (magic "RIMG", rows, cols, type) и строки подряд.
+//Прямоугольники читаются и пишутся построчно через pread/pwrite, так что картинка
+//может быть больше памяти, а параллельные обращения не мешают друг другу
+class RawImageFile : public TileSource, public TileSink
+{
+public:
+  RawImageFile();
+  ~RawImageFile();
+
+  bool open(const std::string& path);
+  bool create(const std::string& path, cv::Size size, int type);
+  void close();
+
+  bool isOpen() const
+  {
+    return m_fd >= 0;
+  }
+
+  cv::Size size() const;
+  int type() const;
+  void read(const cv::Rect& rect, cv::Mat& tile) const;
+  void write(const cv::Rect& rect, const cv::Mat& tile);
+
+private:
+  RawImageFile(const RawImageFile&);
+  RawImageFile& operator=(const RawImageFile&);
+
+  //Смещение пикселя (x, y) в файле
+  off_t offset(int x, int y) const;
+
+  int m_fd;
+  cv::Size m_size;
+  int m_type;
+};
+
+#endif // TILEDIMAGE_H
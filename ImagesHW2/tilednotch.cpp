@@ -0,0 +1,199 @@
+#include "tilednotch.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+namespace
+{
+  //Повышение резкости как в NotchFilter::inverse
+  void sharpenChannel(Mat& channel, double sharpen)
+  {
+    if (sharpen <= 0)
+      return;
+
+    Mat blurred;
+    GaussianBlur(channel, blurred, Size(3, 3), 20);
+    addWeighted(channel, 1 + sharpen, blurred, -sharpen, 0, channel);
+  }
+
+  class TileFilter : public ParallelLoopBody
+  {
+  public:
+    TileFilter(const TileSource& source, TileSink& sink, const std::vector<std::vector<float>>& gains,
+               int tileSize, int radius, int length, double sharpen)
+      : m_source(source), m_sink(sink), m_gains(gains), m_tileSize(tileSize), m_radius(radius),
+        m_length(length), m_sharpen(sharpen)
+    {
+    }
+
+    void operator()(const Range& range) const
+    {
+      const Size size = m_source.size();
+      const Rect image(Point(), size);
+      const int tilesPerRow = (size.width + m_tileSize - 1) / m_tileSize;
+      const int margin = m_sharpen > 0 ? 1 : 0;
+
+      Mat input, buffer, spectrum, filtered;
+      std::vector<Mat> channels;
+
+      for (int i = range.start; i < range.end; ++i)
+      {
+        //output - что пишет тайл, support - где нужна свёртка для резкости,
+        //input - что читается: support и radius столбцов с каждой стороны
+        const Rect output = Rect(i % tilesPerRow * m_tileSize, i / tilesPerRow * m_tileSize, m_tileSize, m_tileSize)
+                          & image;
+        const Rect support = Rect(output.x - margin, output.y - margin,
+                                  output.width + 2 * margin, output.height + 2 * margin) & image;
+        const Rect inputRect = Rect(support.x - m_radius, support.y, support.width + 2 * m_radius, support.height)
+                              & image;
+
+        m_source.read(inputRect, input);
+        split(input, channels);
+
+        for (size_t c = 0; c < channels.size(); ++c)
+        {
+          //Строки с нулями за краями картинки: столбец j буфера - столбец support.x - radius + j
+          buffer.create(support.height, m_length, CV_32F);
+          buffer.setTo(Scalar::all(0));
+          Mat target = buffer(Rect(inputRect.x - (support.x - m_radius), 0, inputRect.width, inputRect.height));
+          channels[c].convertTo(target, CV_32F);
+
+          dft(buffer, spectrum, DFT_ROWS);
+          NotchFilter::applyMask(spectrum, m_gains[c]);
+          idft(spectrum, filtered, DFT_ROWS | DFT_SCALE | DFT_REAL_OUTPUT);
+
+          //Столбцы radius..radius+support.width не задеты циклическим сдвигом.
+          //clone, чтобы размытие на краях support не брало пиксели из полей
+          Mat result = filtered(Rect(m_radius, 0, support.width, support.height)).clone();
+          sharpenChannel(result, m_sharpen);
+
+          result(Rect(output.x - support.x, output.y - support.y, output.width, output.height))
+            .convertTo(channels[c], CV_MAT_DEPTH(m_source.type()));
+        }
+
+        Mat tile;
+        merge(channels, tile);
+        m_sink.write(output, tile);
+      }
+    }
+
+  private:
+    const TileSource& m_source;
+    TileSink& m_sink;
+    const std::vector<std::vector<float>>& m_gains;
+    int m_tileSize;
+    int m_radius;
+    int m_length;
+    double m_sharpen;
+  };
+}
+
+TiledNotchFilter::TiledNotchFilter(const NotchFilter& filter, int tileSize, int radius, int estimationSize)
+  : m_filter(filter), m_tileSize(tileSize), m_radius(radius), m_estimationSize(estimationSize)
+{
+}
+
+void TiledNotchFilter::estimate(const TileSource& source)
+{
+  const Size size = source.size();
+  const int width = std::min(m_estimationSize, size.width);
+  const int height = std::min(m_estimationSize, size.height);
+
+  Mat window;
+  source.read(Rect((size.width - width) / 2, (size.height - height) / 2, width, height), window);
+
+  std::vector<Mat> channels;
+  split(window, channels);
+
+  m_kernels.clear();
+  for (const Mat& channel : channels)
+  {
+    Mat spectrum = m_filter.forward(channel);
+    std::shared_ptr<const SpectrumPlan> plan = m_filter.plan(spectrum.rows, spectrum.cols);
+    m_kernels.push_back(designKernel(m_filter.columnMask(m_filter.detectPeaks(spectrum, *plan), *plan)));
+  }
+}
+
+Mat TiledNotchFilter::designKernel(const std::vector<float>& mask) const
+{
+  //Одна строка в CCS: Re(0), (Re(v), Im(v)) для 0 < v < n/2, Re(n/2). Маска вещественна,
+  //так что мнимые части нулевые, а Re(v) - значение маски на частоте v
+  const int length = mask.size();
+  Mat spectrum(1, length, CV_32F, Scalar::all(0));
+  for (int column = 0; column < length; ++column)
+    if (column == 0 || column == length - 1 || column % 2 == 1)
+      spectrum.at<float>(column) = mask[column];
+
+  Mat response;
+  idft(spectrum, response, DFT_SCALE | DFT_REAL_OUTPUT);
+
+  //Отклик циклический и симметричный: отсчёт k лежит в столбце k mod length
+  const int radius = std::min(m_radius, length / 2 - 1);
+  Mat kernel(1, 2 * m_radius + 1, CV_32F, Scalar::all(0));
+  for (int k = -radius; k <= radius; ++k)
+  {
+    const double window = 0.5 * (1 + std::cos(CV_PI * k / (radius + 1)));
+    kernel.at<float>(m_radius + k) = window * response.at<float>((k + length) % length);
+  }
+  return kernel;
+}
+
+std::vector<float> TiledNotchFilter::kernelGains(const Mat& kernel, int length) const
+{
+  Mat circular(1, length, CV_32F, Scalar::all(0));
+  for (int k = -m_radius; k <= m_radius; ++k)
+    circular.at<float>((k + length) % length) = kernel.at<float>(m_radius + k);
+
+  Mat spectrum;
+  dft(circular, spectrum);
+
+  //Re частоты столбца; Im спектра симметричного ядра равны нулю
+  std::vector<float> gains(length);
+  for (int column = 0; column < length; ++column)
+  {
+    const int reColumn = column == 0 || column == length - 1 ? column : column - (column + 1) % 2;
+    gains[column] = spectrum.at<float>(reColumn);
+  }
+  return gains;
+}
+
+void TiledNotchFilter::apply(const TileSource& source, TileSink& sink) const
+{
+  assert(static_cast<int>(m_kernels.size()) == CV_MAT_CN(source.type()));
+
+  const Size size = source.size();
+  const int length = evenDFTSize(m_tileSize + 2 + 2 * m_radius);
+
+  std::vector<std::vector<float>> gains;
+  for (const Mat& kernel : m_kernels)
+    gains.push_back(kernelGains(kernel, length));
+
+  const int tiles = ((size.width + m_tileSize - 1) / m_tileSize) * ((size.height + m_tileSize - 1) / m_tileSize);
+  parallel_for_(Range(0, tiles), TileFilter(source, sink, gains, m_tileSize, m_radius, length, m_filter.sharpen()));
+}
+
+Mat TiledNotchFilter::applyWhole(const Mat& image) const
+{
+  assert(static_cast<int>(m_kernels.size()) == image.channels());
+
+  std::vector<Mat> channels;
+  split(image, channels);
+
+  for (size_t c = 0; c < channels.size(); ++c)
+  {
+    Mat result;
+    channels[c].convertTo(result, CV_32F);
+    filter2D(result, result, CV_32F, m_kernels[c], Point(-1, -1), 0, BORDER_CONSTANT);
+    sharpenChannel(result, m_filter.sharpen());
+    result.convertTo(channels[c], image.depth());
+  }
+
+  Mat result;
+  merge(channels, result);
+  return result;
+}
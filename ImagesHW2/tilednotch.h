@@ -0,0 +1,70 @@
+#ifndef TILEDNOTCH_H
+#define TILEDNOTCH_H
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "notchfilter.h"
+#include "tiledimage.h"
+
+//Фильтрация NotchFilter для картинок, которые нельзя дополнить и преобразовать целиком.
+//
+//Маска NotchFilter зависит только от горизонтальной частоты, то есть это свёртка каждой
+//строки с одномерным ядром - обратным dft маски. Ядро имеет смысл по частотам, а не
+//по номерам столбцов спектра, поэтому маску можно оценить на окне из середины картинки.
+//Ядро обрезается до радиуса radius с окном Ханна, и дальше картинка обрабатывается
+//независимыми тайлами tileSize x tileSize методом overlap-save: строки тайла
+//с полями по radius слева и справа преобразуются dft с DFT_ROWS, умножаются на спектр
+//ядра, а поля после обратного преобразования отбрасываются. Повышение резкости требует
+//ещё одного пикселя с каждой стороны. Памяти нужно на несколько тайлов на поток,
+//независимо от размера картинки.
+//
+//Это приближение NotchFilter::apply, а не тот же фильтр: пики ищутся по окну, а не по
+//спектру всей картинки, ядро обрезано до radius, а за краями картинки нули вместо
+//циклического продолжения дополненной картинки. Между собой тайлы не расходятся:
+//результат совпадает (до округления float) со свёрткой всей картинки тем же ядром -
+//см. applyWhole. Ошибку относительно apply показывает "--tiled --check".
+class TiledNotchFilter
+{
+public:
+  TiledNotchFilter(const NotchFilter& filter, int tileSize = 1024, int radius = 128, int estimationSize = 2048);
+
+  //Найти пики на окне estimationSize x estimationSize в середине source и построить ядра
+  //для каждого канала
+  void estimate(const TileSource& source);
+
+  //Отфильтровать source в sink того же размера и типа, тайлы - параллельно
+  void apply(const TileSource& source, TileSink& sink) const;
+
+  //Та же фильтрация целой картинки в памяти: свёртка filter2D с нулями за краями
+  cv::Mat applyWhole(const cv::Mat& image) const;
+
+  //Ядро канала, 1 x (2 * radius + 1), CV_32F
+  const cv::Mat& kernel(int channel) const
+  {
+    return m_kernels[channel];
+  }
+
+  int tileSize() const
+  {
+    return m_tileSize;
+  }
+
+private:
+  //Маска по столбцам CCS спектра длины design -> симметричное ядро радиуса m_radius
+  cv::Mat designKernel(const std::vector<float>& mask) const;
+
+  //Коэффициенты, на которые умножаются столбцы CCS спектров строк длины length.
+  //Ядро симметрично, поэтому его спектр вещественный и свёртка - та же маска по столбцам
+  std::vector<float> kernelGains(const cv::Mat& kernel, int length) const;
+
+  const NotchFilter& m_filter;
+  int m_tileSize;
+  int m_radius;
+  int m_estimationSize;
+
+  std::vector<cv::Mat> m_kernels;
+};
+
+#endif // TILEDNOTCH_H
@@ -4,17 +4,20 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.cpp \
+    blobwriter.cpp \
     siftmatcher.cpp \
     harrismatcher.cpp
 
-QMAKE_CXXFLAGS += --std=c++11
+QMAKE_CXXFLAGS += --std=c++11 -pthread
 
 LIBS += -lopencv_core -lopencv_highgui -lopencv_imgproc -lopencv_nonfree \
         -lopencv_objdetect -lopencv_features2d -lopencv_contrib\
-        -lopencv_flann -lopencv_stitching
+        -lopencv_flann -lopencv_stitching -pthread
 
 HEADERS += \
+    blobbatch.hpp \
     blobdetector.hpp \
+    blobwriter.hpp \
     siftmatcher.hpp \
     harrismatcher.hpp \
     constants.h
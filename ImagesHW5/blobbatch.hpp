@@ -0,0 +1,156 @@
+#ifndef BLOBBATCH_HPP
+#define BLOBBATCH_HPP
+
+#include "blobdetector.hpp"
+#include "blobwriter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Очередь между потоками без ограничения размера: число элементов ограничивает
+//тот, кто в неё кладёт. pop ждёт, пока очередь пуста и не закрыта
+template<class T>
+class WorkQueue
+{
+public:
+  WorkQueue() : m_closed(false)
+  {
+  }
+
+  void push(const T& value)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_items.push_back(value);
+    }
+    m_ready.notify_one();
+  }
+
+  //false, если очередь закрыта и пуста
+  bool pop(T& value)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_ready.wait(lock, [this]() { return !m_items.empty() || m_closed; });
+    if (m_items.empty())
+      return false;
+
+    value = m_items.front();
+    m_items.pop_front();
+    return true;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_ready.notify_all();
+  }
+
+private:
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<T> m_items;
+  bool m_closed;
+};
+
+//Поиск блобов для каталога картинок или потока кадров без окон. Картинки раздаются
+//threads потокам, у каждого свой BlobDetector, так что буферы пирамиды живут всё время
+//работы и переиспользуются между картинками одного размера. Результаты идут в BlobWriter
+template<class Strategy>
+class BlobBatch
+{
+public:
+  //threads - сколько потоков использовать, 0 - все
+  explicit BlobBatch(int threads = 0)
+    : m_threads(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency()))
+  {
+  }
+
+  //Все файлы по маске cv::glob (например "frames/*.png"). Номер картинки - место
+  //в отсортированном списке. Возвращает число обработанных картинок
+  int processFiles(const std::string& pattern, BlobWriter& writer) const
+  {
+    std::vector<std::string> files;
+    cv::glob(pattern, files);
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> processed(0);
+    runWorkers([&]() {
+      BlobDetector<Strategy> detector;
+      for (size_t i = next++; i < files.size(); i = next++)
+      {
+        const cv::Mat image = cv::imread(files[i]);
+        if (image.empty())
+          continue;
+
+        writer.write(i, files[i], detector.detect(image));
+        ++processed;
+      }
+    });
+
+    return processed;
+  }
+
+  //Кадры capture (видео или последовательность картинок). Кадры читает отдельный поток
+  //в кольцо из 2 * threads матриц, которые переиспользуются, пока размер кадра не меняется,
+  //а вызывающий поток работает одним из threads обработчиков.
+  //Номер картинки - номер кадра. Возвращает число кадров
+  int processStream(cv::VideoCapture& capture, BlobWriter& writer) const
+  {
+    std::vector<cv::Mat> frames(2 * m_threads);
+
+    //Пары (слот кольца, номер кадра)
+    WorkQueue<std::pair<int, int>> ready;
+    WorkQueue<int> freeSlots;
+    for (size_t slot = 0; slot < frames.size(); ++slot)
+      freeSlots.push(slot);
+
+    std::thread reader([&]() {
+      int slot = 0;
+      for (int frame = 0; freeSlots.pop(slot) && capture.read(frames[slot]); ++frame)
+        ready.push(std::make_pair(slot, frame));
+      ready.close();
+    });
+
+    std::atomic<int> processed(0);
+    runWorkers([&]() {
+      BlobDetector<Strategy> detector;
+      std::pair<int, int> item;
+      while (ready.pop(item))
+      {
+        writer.write(item.second, "frame", detector.detect(frames[item.first]));
+        freeSlots.push(item.first);
+        ++processed;
+      }
+    });
+
+    reader.join();
+    return processed;
+  }
+
+private:
+  template<class Worker>
+  void runWorkers(const Worker& worker) const
+  {
+    std::vector<std::thread> threads;
+    for (int i = 1; i < m_threads; ++i)
+      threads.emplace_back(worker);
+
+    worker();
+
+    for (std::thread& thread : threads)
+      thread.join();
+  }
+
+  int m_threads;
+};
+
+#endif // BLOBBATCH_HPP
@@ -8,54 +8,143 @@
 #include <cmath>
 #include <sys/syscall.h>
 
-#include <opencv2/opencv.hpp>
+#include <emmintrin.h>
 
-#include <boost/lexical_cast.hpp>
+#include <opencv2/opencv.hpp>
 
 const std::string IMAGES_DIR = "images/";
+//Масштабов на октаву, в которых ищутся блобы
 const int SCALE_COUNT = 3;
-const double STEP = std::sqrt(std::sqrt(2.0));
+//Отношение сигм соседних уровней октавы
+const double STEP = std::pow(2.0, 1.0 / SCALE_COUNT);
+//Сигма первого уровня октавы в её пикселях
 const double SIGMA = 1.6;
-const double SCALE_SPACE_STEP = 0.4;
+//Размытие, которое уже есть у исходной картинки
+const double INITIAL_SIGMA = 0.5;
+//Октавы строятся, пока наибольшая сигма, на которой в октаве ищутся блобы (2 * SIGMA
+//в её пикселях), не больше MAX_SIGMA в пикселях исходной и меньшая сторона не меньше MIN_OCTAVE_SIZE
+const double MAX_SIGMA = 33;
+const int MIN_OCTAVE_SIZE = 16;
 
 typedef std::vector<std::pair<cv::Point, double> > BlobCenters;
+//Уровни одного размера и их сигмы в пикселях исходной картинки
 typedef std::vector<std::pair<cv::Mat, double> > ScaleSpace;
 
+//Октава пирамиды: картинка уменьшена в scale раз, точка (x, y) октавы -
+//точка (x * scale, y * scale) исходной
+struct Octave
+{
+  ScaleSpace levels;
+  int scale;
+};
+
+typedef std::vector<Octave> ScalePyramid;
+
+inline int gaussianKernelSize(double sigma)
+{
+  return std::ceil(3 * sigma) * 2 + 1;
+}
+
+//Буферы, которые стратегии переиспользуют между картинками одного размера
+struct ScaleSpaceBuffers
+{
+  ScalePyramid gaussians;
+  cv::Mat integral;
+};
+
+//Привести пирамиду к octaves октавам по levelCount уровней. Матрицы существующих уровней
+//остаются, и create в функциях OpenCV не выделяет память, если размер не изменился
+inline void resizePyramid(ScalePyramid& pyramid, int octaves, int levelCount)
+{
+  pyramid.resize(octaves);
+  for (int o = 0; o < octaves; ++o)
+  {
+    pyramid[o].scale = 1 << o;
+    pyramid[o].levels.resize(levelCount);
+  }
+}
+
+//Сколько октав строить для картинки size: пока наибольшая сигма поиска блобов
+//(2 * SIGMA в пикселях октавы) не больше MAX_SIGMA и октава не меньше MIN_OCTAVE_SIZE
+inline int octaveCount(cv::Size size)
+{
+  int octaves = 0;
+  for (int scale = 1; std::min(size.width, size.height) >= MIN_OCTAVE_SIZE && 2 * SIGMA * scale <= MAX_SIGMA; scale *= 2)
+  {
+    ++octaves;
+    size = cv::Size(size.width / 2, size.height / 2);
+  }
+  return octaves;
+}
+
+//Гауссова пирамида как в SIFT: в октаве levelCount уровней с сигмами SIGMA * STEP^i
+//(в пикселях октавы), каждый размывается из предыдущего на недостающую сигму,
+//так что ядра не растут с масштабом. Следующая октава - уровень SCALE_COUNT
+//(сигма 2 * SIGMA) через пиксель, то есть снова SIGMA в своих пикселях
+inline void createGaussianPyramid(const cv::Mat& image, int levelCount, ScalePyramid& pyramid)
+{
+  assert(levelCount > SCALE_COUNT);
+
+  resizePyramid(pyramid, octaveCount(image.size()), levelCount);
+  for (size_t o = 0; o < pyramid.size(); ++o)
+  {
+    ScaleSpace& levels = pyramid[o].levels;
+    const int scale = pyramid[o].scale;
+
+    if (o == 0)
+    {
+      const double initialBlur = std::sqrt(SIGMA * SIGMA - INITIAL_SIGMA * INITIAL_SIGMA);
+      cv::GaussianBlur(image, levels[0].first,
+                       cv::Size(gaussianKernelSize(initialBlur), gaussianKernelSize(initialBlur)), initialBlur);
+    }
+    else
+    {
+      const cv::Mat& previous = pyramid[o - 1].levels[SCALE_COUNT].first;
+      cv::resize(previous, levels[0].first, cv::Size(previous.cols / 2, previous.rows / 2), 0, 0, cv::INTER_NEAREST);
+    }
+    levels[0].second = SIGMA * scale;
+
+    double sigma = SIGMA;
+    for (int i = 1; i < levelCount; ++i)
+    {
+      const double nextSigma = sigma * STEP;
+      const double blur = std::sqrt(nextSigma * nextSigma - sigma * sigma);
+
+      cv::GaussianBlur(levels[i - 1].first, levels[i].first,
+                       cv::Size(gaussianKernelSize(blur), gaussianKernelSize(blur)), blur);
+      levels[i].second = nextSigma * scale;
+      sigma = nextSigma;
+    }
+  }
+}
 
 class LoG
 {
 public:
   static constexpr double THRESHOLD = 0.35;
 
-  static ScaleSpace createScaleSpace(const cv::Mat& image)
+  //SCALE_COUNT + 2 уровня на октаву, чтобы у каждого из SCALE_COUNT средних были соседи.
+  //sigma^2 * Laplacian не зависит от того, в пикселях какой октавы он посчитан
+  static void createScaleSpace(const cv::Mat& image, ScaleSpaceBuffers& buffers, ScalePyramid& pyramid)
   {
-    ScaleSpace space;
     assert(image.type() == CV_32F);
 
-    double t = 0.5;
-    while (t <= 3.5)
-    {
-      const double sigma = exp(t);
-      const int kernelSize = ceil(3 * sigma) * 2 + 1;
+    createGaussianPyramid(image, SCALE_COUNT + 2, buffers.gaussians);
+    resizePyramid(pyramid, buffers.gaussians.size(), SCALE_COUNT + 2);
 
-      cv::Mat resultImage(image.size(), image.type());
-      cv::GaussianBlur(image, resultImage, cv::Size(kernelSize, kernelSize), sigma);
-      cv::Laplacian(resultImage, resultImage, CV_32F);
-
-      resultImage *= std::pow(sigma, 2);
-      resultImage = cv::abs(resultImage);
+    for (size_t o = 0; o < pyramid.size(); ++o)
+    {
+      for (int i = 0; i < SCALE_COUNT + 2; ++i)
+      {
+        const std::pair<cv::Mat, double>& gaussian = buffers.gaussians[o].levels[i];
+        const double sigma = gaussian.second / pyramid[o].scale;
 
-      space.push_back(std::make_pair(resultImage ,sigma));
-      t += SCALE_SPACE_STEP;
+        cv::Mat& resultImage = pyramid[o].levels[i].first;
+        cv::Laplacian(gaussian.first, resultImage, CV_32F, 1, sigma * sigma);
+        cv::absdiff(resultImage, cv::Scalar::all(0), resultImage);
+        pyramid[o].levels[i].second = gaussian.second;
+      }
     }
-
-//    for (auto it = space.begin(); it != space.end(); ++it)
-//    {
-//      cv::imshow(boost::lexical_cast<std::string>(it->second), it->first);
-//    }
-//    cv::waitKey();
-
-    return space;
   }
 };
 
@@ -64,148 +153,338 @@ class DoG
 public:
   static constexpr double THRESHOLD = 0.7;
 
-  static ScaleSpace createScaleSpace(const cv::Mat& image)
+  //SCALE_COUNT + 3 гауссовых уровня дают SCALE_COUNT + 2 разности на октаву.
+  //Каждая разность нормируется в [0, 1] отдельно, поэтому множитель sigma^2 не нужен
+  static void createScaleSpace(const cv::Mat& image, ScaleSpaceBuffers& buffers, ScalePyramid& pyramid)
+  {
+    createGaussianPyramid(image, SCALE_COUNT + 3, buffers.gaussians);
+    resizePyramid(pyramid, buffers.gaussians.size(), SCALE_COUNT + 2);
+
+    for (size_t o = 0; o < pyramid.size(); ++o)
+    {
+      const ScaleSpace& gaussians = buffers.gaussians[o].levels;
+      for (int i = 0; i < SCALE_COUNT + 2; ++i)
+      {
+        cv::Mat& resultImage = pyramid[o].levels[i].first;
+        cv::absdiff(gaussians[i].first, gaussians[i + 1].first, resultImage);
+        cv::normalize(resultImage, resultImage, 0, 1.0, cv::NORM_MINMAX, CV_32F);
+        pyramid[o].levels[i].second = gaussians[i].second;
+      }
+    }
+  }
+};
+
+//Отклик det(H) одного уровня BoxHessian: вторые производные гаусса заменены ящиками
+//размера size (Bay et al., SURF: Speeded Up Robust Features), каждый ящик - 4 обращения
+//к интегральной картинке, так что цена пикселя не зависит от size. Считается в каждом
+//step-м пикселе исходной картинки, строки делятся между потоками
+class HessianResponse : public cv::ParallelLoopBody
+{
+public:
+  HessianResponse(const cv::Mat& integral, int size, int step, cv::Mat& response)
+    : m_integral(integral), m_size(size), m_step(step), m_response(response)
   {
-    ScaleSpace space;
+  }
 
-    double t = 1.0;
-    while (t <= 3.2)
+  void operator()(const cv::Range& range) const
+  {
+    const int lobe = m_size / 3;
+    const int border = (m_size - 1) / 2;
+    const double inverseArea = 1.0 / (m_size * m_size);
+
+    //Фильтр помещается в картинку, только если до края не меньше border пикселей.
+    //Ближе к краю отклик нулевой: с нулями за краем ящики Dxx, Dyy видят там перепад
+    //яркости, и по краям находились ложные блобы
+    const int imageRows = m_integral.rows - 1;
+    const int imageCols = m_integral.cols - 1;
+
+    for (int y = range.start; y < range.end; ++y)
     {
-      const double sigma = exp(t);
-      const int size = ceil(3 * sigma) * 2 + 1;
+      float* row = m_response.ptr<float>(y);
+      for (int x = 0; x < m_response.cols; ++x)
+      {
+        const int r = y * m_step;
+        const int c = x * m_step;
+        if (r < border || c < border || r + border >= imageRows || c + border >= imageCols)
+        {
+          row[x] = 0;
+          continue;
+        }
 
-      cv::Mat resultImage;
-      cv::GaussianBlur(image, resultImage, cv::Size(size, size), sigma);
-      space.push_back(std::make_pair(resultImage, sigma));
+        const double dxx = boxSum(r - lobe + 1, c - border, 2 * lobe - 1, m_size)
+                         - 3 * boxSum(r - lobe + 1, c - lobe / 2, 2 * lobe - 1, lobe);
+        const double dyy = boxSum(r - border, c - lobe + 1, m_size, 2 * lobe - 1)
+                         - 3 * boxSum(r - lobe / 2, c - lobe + 1, lobe, 2 * lobe - 1);
+        const double dxy = boxSum(r - lobe, c + 1, lobe, lobe) + boxSum(r + 1, c - lobe, lobe, lobe)
+                         - boxSum(r - lobe, c - lobe, lobe, lobe) - boxSum(r + 1, c + 1, lobe, lobe);
 
-      t += SCALE_SPACE_STEP;
+        //0.9 уравнивает ящичные приближения Dxy и Dxx, Dyy
+        row[x] = (dxx * dyy - 0.81 * dxy * dxy) * inverseArea * inverseArea;
+      }
     }
+  }
+
+private:
+  //Сумма по rows x cols с левым верхним углом (row, col), ящик целиком внутри картинки
+  double boxSum(int row, int col, int rows, int cols) const
+  {
+    return m_integral.at<double>(row + rows, col + cols) - m_integral.at<double>(row, col + cols)
+         - m_integral.at<double>(row + rows, col) + m_integral.at<double>(row, col);
+  }
+
+  const cv::Mat& m_integral;
+  int m_size;
+  int m_step;
+  cv::Mat& m_response;
+};
+
+class BoxHessian
+{
+public:
+  static constexpr double THRESHOLD = 0.005;
+
+  //Интегральная картинка строится один раз. Октава o считается в каждом 2^o-м пикселе,
+  //размеры ящиков уровня i - 3 * (2^(o + 1) * (i + 1) + 1): 9, 15, 21, ... в первой октаве,
+  //15, 27, 39, ... во второй. Сигма ящика размера size - 1.2 * size / 9
+  static void createScaleSpace(const cv::Mat& image, ScaleSpaceBuffers& buffers, ScalePyramid& pyramid)
+  {
+    assert(image.type() == CV_32F);
+
+    cv::integral(image, buffers.integral, CV_64F);
 
-    for (size_t i = 0; i < space.size() - 1; ++i)
+    int octaves = 0;
+    for (int step = 1; ; step *= 2, ++octaves)
     {
-      space[i].first = space[i].first - space[i + 1].first;
-      space[i].first *= std::pow(space[i].second, 2);
-      space[i].first = cv::abs(space[i].first);
-      cv::normalize(space[i].first, space[i].first, 0, 1.0, cv::NORM_MINMAX ,CV_32F);
+      //Последний уровень октавы, на котором ищутся блобы
+      const double maxSigma = 1.2 * filterSize(step, SCALE_COUNT) / 9;
+      if (std::min(image.cols, image.rows) / step < MIN_OCTAVE_SIZE || maxSigma > MAX_SIGMA)
+        break;
     }
+    resizePyramid(pyramid, octaves, SCALE_COUNT + 2);
 
-    for (auto it = space.begin(); it != space.end(); ++it)
+    for (int o = 0; o < octaves; ++o)
     {
-      cv::imshow(boost::lexical_cast<std::string>(it->second), it->first);
+      const int step = pyramid[o].scale;
+      const cv::Size size((image.cols + step - 1) / step, (image.rows + step - 1) / step);
+
+      for (int i = 0; i < SCALE_COUNT + 2; ++i)
+      {
+        const int filter = filterSize(step, i);
+
+        cv::Mat& response = pyramid[o].levels[i].first;
+        response.create(size, CV_32F);
+        cv::parallel_for_(cv::Range(0, size.height), HessianResponse(buffers.integral, filter, step, response));
+        pyramid[o].levels[i].second = 1.2 * filter / 9;
+      }
     }
-//    cv::waitKey();
-//    exit(0);
+  }
 
-    return space;
+private:
+  static int filterSize(int step, int level)
+  {
+    return 3 * (2 * step * (level + 1) + 1);
   }
 };
 
-template<class Strategy>
-class BlobDetector
+//Локальные максимумы в окрестности 3x3x3 по полосам строк всех масштабов, кроме крайних.
+//Задача - полоса BAND_ROWS строк одного масштаба. Строка сравнивается с 26 соседями
+//по 4 пикселя за раз: максимум соседей собирается _mm_max_ps из 8 соседних строк
+//(по 3 в соседних масштабах и 2 в своём) и самой строки, сдвинутой на пиксель влево и вправо.
+//Соседи за краем картинки не учитываются, как и раньше
+class ExtremaFinder : public cv::ParallelLoopBody
 {
 public:
-  BlobDetector(const cv::Mat& image)
+  static const int BAND_ROWS = 32;
+
+  //bands - по BlobCenters на задачу, задачи идут по масштабам, внутри - по полосам
+  ExtremaFinder(const ScaleSpace& space, float threshold, std::vector<BlobCenters>& bands)
+    : m_space(space), m_threshold(threshold), m_bands(bands)
   {
-    m_originalImage = image;
-    cv::cvtColor(m_originalImage, m_grayImage, CV_BGR2GRAY);
-    m_grayImage.convertTo(m_grayImage, CV_32F, 1.0 / 255);
+  }
 
-    m_scaleSpace = Strategy::createScaleSpace(m_grayImage);
+  static int bandCount(const ScaleSpace& space)
+  {
+    return (space.size() - 2) * bandsPerScale(space);
   }
 
-  cv::Mat highlightBlobs()
+  void operator()(const cv::Range& range) const
   {
-    BlobCenters centers = detectBlobs();
-    cv::Mat image = m_originalImage;
+    const int bands = bandsPerScale(m_space);
+    const int rows = m_space[0].first.rows;
 
-    for (int i = 0; i < centers.size(); ++i)
+    for (int task = range.start; task < range.end; ++task)
     {
-      cv::circle(image, centers[i].first,
-                 centers[i].second * std::sqrt(2), cv::Scalar(0,0,255), 2);
+      const int scale = 1 + task / bands;
+      const int first = task % bands * BAND_ROWS;
+      for (int y = first; y < std::min(rows, first + BAND_ROWS); ++y)
+        findInRow(scale, y, m_bands[task]);
     }
-
-    return image;
   }
 
 private:
-  std::vector<float> getNeighbourValues(cv::Point point, ScaleSpace space, int spaceLoc)
+  static int bandsPerScale(const ScaleSpace& space)
   {
-    std::vector<float> result;
-    const cv::Mat& currentSpace = space[spaceLoc].first;
-
-    cv::Mat highSpace, lowSpace;
+    return (space[0].first.rows + BAND_ROWS - 1) / BAND_ROWS;
+  }
 
-    if (spaceLoc + 1 < space.size())
-      highSpace = space[spaceLoc + 1].first;
+  void findInRow(int scale, int y, BlobCenters& result) const
+  {
+    const cv::Mat& current = m_space[scale].first;
+    const double sigma = m_space[scale].second;
+    const int cols = current.cols;
 
-    if (spaceLoc - 1 >= 0)
-      lowSpace = space[spaceLoc - 1].first;
+    const float* neighbours[8];
+    int count = 0;
+    for (int s = scale - 1; s <= scale + 1; ++s)
+    {
+      for (int r = y - 1; r <= y + 1; ++r)
+      {
+        if (r >= 0 && r < current.rows && (s != scale || r != y))
+          neighbours[count++] = m_space[s].first.ptr<float>(r);
+      }
+    }
+    const float* center = current.ptr<float>(y);
 
-    int x = point.x;
-    int y = point.y;
+    //Первый и последний столбцы - по одному, у них нет соседа слева или справа
+    int x = 0;
+    if (isMaximum(neighbours, count, center, x, cols))
+      result.push_back(std::make_pair(cv::Point(x, y), sigma));
 
-    for (int i = -1; i <= 1; ++i)
+    const __m128 threshold = _mm_set1_ps(m_threshold);
+    for (x = 1; x + 4 <= cols - 1; x += 4)
     {
-      for (int j = -1; j <= 1; ++j)
+      const __m128 value = _mm_loadu_ps(center + x);
+      __m128 maximum = _mm_max_ps(_mm_loadu_ps(center + x - 1), _mm_loadu_ps(center + x + 1));
+      for (int i = 0; i < count; ++i)
       {
-        if (x + i < 0 || x + i > currentSpace.cols - 1)
-          continue;
+        const float* row = neighbours[i] + x;
+        maximum = _mm_max_ps(maximum, _mm_max_ps(_mm_max_ps(_mm_loadu_ps(row - 1), _mm_loadu_ps(row)),
+                                                 _mm_loadu_ps(row + 1)));
+      }
 
-        if (y + j < 0 || y + j > currentSpace.rows - 1)
-          continue;
+      const int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(value, maximum), _mm_cmpgt_ps(value, threshold)));
+      for (int bit = 0; mask >> bit; ++bit)
+      {
+        if (mask & (1 << bit))
+          result.push_back(std::make_pair(cv::Point(x + bit, y), sigma));
+      }
+    }
 
-        if (i != 0 || j != 0)
-          result.push_back(currentSpace.at<float>(y + j, x + i));
+    for (; x < cols; ++x)
+    {
+      if (isMaximum(neighbours, count, center, x, cols))
+        result.push_back(std::make_pair(cv::Point(x, y), sigma));
+    }
+  }
 
-        if (!highSpace.empty())
-          result.push_back(highSpace.at<float>(y + j, x + i));
+  bool isMaximum(const float* const* neighbours, int count, const float* center, int x, int cols) const
+  {
+    const float value = center[x];
+    if (!(value > m_threshold))
+      return false;
 
-        if (!lowSpace.empty())
-          result.push_back(lowSpace.at<float>(y + j, x + i));
+    for (int dx = -1; dx <= 1; ++dx)
+    {
+      if (x + dx < 0 || x + dx > cols - 1)
+        continue;
+
+      if (dx != 0 && !(value > center[x + dx]))
+        return false;
+
+      for (int i = 0; i < count; ++i)
+      {
+        if (!(value > neighbours[i][x + dx]))
+          return false;
       }
     }
 
-    assert(result.size() == 26 || result.size() == 17 || result.size() == 11);
-    return result;
+    return true;
   }
 
-  BlobCenters detectBlobs()
+  const ScaleSpace& m_space;
+  float m_threshold;
+  std::vector<BlobCenters>& m_bands;
+};
+
+//Поиск блобов без окон и вывода. Детектор можно использовать для многих картинок подряд:
+//серая картинка, уровни пирамиды и полосы поиска переиспользуются, пока размер не меняется
+template<class Strategy>
+class BlobDetector
+{
+public:
+  BlobDetector()
   {
-    assert(m_scaleSpace.size() > 2);
+  }
 
-    BlobCenters result;
-    const int size = m_scaleSpace.size();
+  explicit BlobDetector(const cv::Mat& image)
+  {
+    detect(image);
+  }
 
-    for (int i = 1; i < size - 1; ++i)
+  //image - BGR или серая CV_8U. Ссылка действительна до следующего detect
+  const BlobCenters& detect(const cv::Mat& image)
+  {
+    m_originalImage = image;
+    if (image.channels() == 3)
     {
-      const cv::Mat& currentScale = m_scaleSpace[i].first;
-      double currentSig = m_scaleSpace[i].second;
-      for (int x = 0; x < currentScale.cols; ++x)
-      {
-        for (int y = 0; y < currentScale.rows; ++y)
-        {
-          std::vector<float> neighbours = getNeighbourValues(cv::Point(x,y), m_scaleSpace, i);
-          std::sort(neighbours.begin(), neighbours.end());
-          std::reverse(neighbours.begin(), neighbours.end());
-
-  //        std::cout << neighbours.size() << std::endl;
-          if (currentScale.at<float>(y,x) > neighbours[0] && currentScale.at<float>(y,x) > Strategy::THRESHOLD) //local maximum
-          {
-            result.push_back(std::make_pair(cv::Point(x,y), currentSig));
-          }
-        }
-      }
+      cv::cvtColor(image, m_grayBytes, CV_BGR2GRAY);
+      m_grayBytes.convertTo(m_grayImage, CV_32F, 1.0 / 255);
     }
+    else
+      image.convertTo(m_grayImage, CV_32F, 1.0 / 255);
 
-    std::cout << result.size() << std::endl;
+    Strategy::createScaleSpace(m_grayImage, m_buffers, m_pyramid);
+    detectBlobs();
+    return m_blobs;
+  }
 
-    m_blobs = result;
-    return result;
+  const BlobCenters& blobs() const
+  {
+    return m_blobs;
+  }
+
+  //Копия последней картинки с кругами вокруг блобов
+  cv::Mat highlightBlobs() const
+  {
+    cv::Mat image = m_originalImage.clone();
+
+    for (size_t i = 0; i < m_blobs.size(); ++i)
+    {
+      cv::circle(image, m_blobs[i].first,
+                 m_blobs[i].second * std::sqrt(2), cv::Scalar(0,0,255), 2);
+    }
+
+    return image;
+  }
+
+private:
+  void detectBlobs()
+  {
+    m_blobs.clear();
+    for (const Octave& octave : m_pyramid)
+    {
+      assert(octave.levels.size() > 2);
+
+      m_bands.resize(ExtremaFinder::bandCount(octave.levels));
+      for (BlobCenters& band : m_bands)
+        band.clear();
+      cv::parallel_for_(cv::Range(0, m_bands.size()), ExtremaFinder(octave.levels, Strategy::THRESHOLD, m_bands));
+
+      //Координаты октавы -> координаты исходной картинки, сигмы уже в её пикселях
+      for (const BlobCenters& band : m_bands)
+      {
+        for (auto it = band.begin(); it != band.end(); ++it)
+          m_blobs.push_back(std::make_pair(it->first * octave.scale, it->second));
+      }
+    }
   }
 
-  ScaleSpace m_scaleSpace;
+  ScaleSpaceBuffers m_buffers;
+  ScalePyramid m_pyramid;
+  std::vector<BlobCenters> m_bands;
   BlobCenters m_blobs;
   cv::Mat m_originalImage;
+  cv::Mat m_grayBytes;
   cv::Mat m_grayImage;
 };
 
@@ -0,0 +1,77 @@
+#include "blobwriter.hpp"
+
+#include <cstdint>
+
+namespace
+{
+  const uint32_t BLOB_MAGIC = 0x424f4c42; // "BLOB"
+  const uint32_t BLOB_VERSION = 1;
+
+  //Поле CSV по RFC 4180: в кавычках, если в нём есть запятая, кавычка или перевод строки,
+  //кавычки внутри удваиваются
+  std::string csvField(const std::string& value)
+  {
+    if (value.find_first_of(",\"\r\n") == std::string::npos)
+      return value;
+
+    std::string result = "\"";
+    for (char c : value)
+    {
+      if (c == '"')
+        result += '"';
+      result += c;
+    }
+    return result + '"';
+  }
+}
+
+BlobWriter::BlobWriter(const std::string& path, Format format)
+  : m_format(format),
+    m_stream(path.c_str(), format == BINARY ? std::ios::out | std::ios::binary : std::ios::out)
+{
+  if (m_format == BINARY)
+  {
+    m_stream.write(reinterpret_cast<const char*>(&BLOB_MAGIC), sizeof(BLOB_MAGIC));
+    m_stream.write(reinterpret_cast<const char*>(&BLOB_VERSION), sizeof(BLOB_VERSION));
+  }
+  else
+    m_stream << "index,name,x,y,sigma\n";
+}
+
+BlobWriter::Format BlobWriter::formatFor(const std::string& path)
+{
+  return path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0 ? CSV : BINARY;
+}
+
+bool BlobWriter::isOpen() const
+{
+  return m_stream.is_open();
+}
+
+void BlobWriter::write(int index, const std::string& name, const BlobCenters& blobs)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (m_format == CSV)
+  {
+    const std::string field = csvField(name);
+    for (auto it = blobs.begin(); it != blobs.end(); ++it)
+      m_stream << index << ',' << field << ',' << it->first.x << ',' << it->first.y << ',' << it->second << '\n';
+    return;
+  }
+
+  //Одна запись за раз, буфер записи переиспользуется
+  m_record.resize(blobs.size() * 3);
+  for (size_t i = 0; i < blobs.size(); ++i)
+  {
+    m_record[3 * i] = blobs[i].first.x;
+    m_record[3 * i + 1] = blobs[i].first.y;
+    m_record[3 * i + 2] = blobs[i].second;
+  }
+
+  const int32_t imageIndex = index;
+  const uint32_t count = blobs.size();
+  m_stream.write(reinterpret_cast<const char*>(&imageIndex), sizeof(imageIndex));
+  m_stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  m_stream.write(reinterpret_cast<const char*>(m_record.data()), m_record.size() * sizeof(float));
+}
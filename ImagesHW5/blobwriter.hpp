@@ -0,0 +1,40 @@
+#ifndef BLOBWRITER_HPP
+#define BLOBWRITER_HPP
+
+#include "blobdetector.hpp"
+
+#include <fstream>
+#include <mutex>
+#include <string>
+
+//Запись блобов многих картинок в один файл из нескольких потоков.
+//CSV: строка "номер,имя,x,y,sigma" на блоб.
+//BINARY: заголовок (magic "BLOB", версия), затем на картинку int32 номер, uint32 число блобов
+//и по три float (x, y, sigma) на блоб. Картинки идут в порядке готовности, а не номеров
+class BlobWriter
+{
+public:
+  enum Format
+  {
+    CSV,
+    BINARY
+  };
+
+  BlobWriter(const std::string& path, Format format);
+
+  //.csv - CSV, остальное - BINARY
+  static Format formatFor(const std::string& path);
+
+  bool isOpen() const;
+
+  //Блобы одной картинки пишутся подряд, даже если write зовут из разных потоков
+  void write(int index, const std::string& name, const BlobCenters& blobs);
+
+private:
+  Format m_format;
+  std::ofstream m_stream;
+  std::mutex m_mutex;
+  std::vector<float> m_record;
+};
+
+#endif // BLOBWRITER_HPP
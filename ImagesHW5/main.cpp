@@ -1,11 +1,53 @@
+#include "blobbatch.hpp"
 #include "blobdetector.hpp"
 #include "siftmatcher.hpp"
 #include "harrismatcher.hpp"
 
 #include <fstream>
 
-int main()
+//Блобы всех картинок input (маска с '*' для cv::glob, иначе видео) в output без окон
+template<class Strategy>
+int runBatch(const std::string& input, const std::string& output)
 {
+  BlobWriter writer(output, BlobWriter::formatFor(output));
+  if (!writer.isOpen())
+  {
+    std::cerr << "Cannot open " << output << std::endl;
+    return 1;
+  }
+
+  BlobBatch<Strategy> batch;
+  int processed = 0;
+  if (input.find('*') != std::string::npos)
+    processed = batch.processFiles(input, writer);
+  else
+  {
+    cv::VideoCapture capture(input);
+    if (!capture.isOpened())
+    {
+      std::cerr << "Cannot open " << input << std::endl;
+      return 1;
+    }
+    processed = batch.processStream(capture, writer);
+  }
+
+  std::cout << processed << " images processed" << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  //ImagesHW5 <маска картинок или видео> <выход .csv или .bin> [log|dog|hessian]
+  if (argc >= 3)
+  {
+    const std::string strategy = argc > 3 ? argv[3] : "log";
+    if (strategy == "dog")
+      return runBatch<DoG>(argv[1], argv[2]);
+    if (strategy == "hessian")
+      return runBatch<BoxHessian>(argv[1], argv[2]);
+    return runBatch<LoG>(argv[1], argv[2]);
+  }
+
     cv::Mat image = cv::imread("/home/ees/Pictures/images.jpeg");
   BlobDetector<LoG> detector(image);
   cv::Mat blobs = detector.highlightBlobs();